@@ -0,0 +1,304 @@
+﻿/*!
+\file c11_compress.h
+\author	jiangyong
+\email  kipway@outlook.com
+\update 2018.8.19
+
+eclib adaptive compression policy. choose none, LZ4, LZ4HC or zlib for one message by its size,
+the sampled byte entropy(or a packed format signature) and the ratio and CPU cost achieved
+on the connection before. incompressible connections back off and probe again later.
+
+the policy only choose, the caller compress, measure and report the result.
+
+class comp_stats
+class comp_policy
+
+eclib Copyright (c) 2017-2018, kipway
+source repository : https://github.com/kipway/eclib
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef COMP_MINSIZE
+#	define COMP_MINSIZE 80 // messages smaller not compressed
+#endif
+
+#ifndef COMP_SAMPLE_MINSIZE
+#	define COMP_SAMPLE_MINSIZE 1024 // sample entropy of messages not smaller, LZ4 of smaller costs not much more than sampling
+#endif
+
+#ifndef COMP_SAMPLE_SIZE
+#	define COMP_SAMPLE_SIZE 256 // bytes sampled, 64 bytes chunks spread over the message
+#endif
+
+#ifndef COMP_MAXENTROPY
+#	define COMP_MAXENTROPY 680 // entropy bits per byte x100 of the sample, over it not compressed. 256 random bytes is about 710, JSON 400
+#endif
+
+#ifndef COMP_LARGESIZE
+#	define COMP_LARGESIZE (64 * 1024) // messages not smaller use the large method(LZ4HC or zlib) if it pays
+#endif
+
+#ifndef COMP_UPGRADE_RATIO
+#	define COMP_UPGRADE_RATIO 600 // x1000, the large method is used while its ratio(compressed/source) not over it
+#endif
+
+#ifndef COMP_BAD_RATIO
+#	define COMP_BAD_RATIO 950 // x1000, compressed/source over it is a bad result
+#endif
+
+#ifndef COMP_BAD_COUNT
+#	define COMP_BAD_COUNT 4 // continuous bad results start back off
+#endif
+
+#ifndef COMP_BACKOFF
+#	define COMP_BACKOFF 16 // messages not compressed in the first back off, doubled each time until COMP_BACKOFF_MAX
+#endif
+
+#ifndef COMP_BACKOFF_MAX
+#	define COMP_BACKOFF_MAX 1024
+#endif
+
+#define COMP_SAMPLE_MAX 1024 // max COMP_SAMPLE_SIZE
+#define COMP_SAMPLE_MIN 64   // min COMP_SAMPLE_SIZE, one chunk
+#define COMP_ENTROPY_PACKED 1000 // entropy() return for packed formats(gzip,zip,png,jpeg...)
+#define COMP_MASK(m) (1u << (m)) // method bit of methods mask
+
+namespace ec
+{
+	enum COMPMETHOD
+	{
+		comp_none = 0,
+		comp_lz4 = 1,
+		comp_lz4hc = 2, // LZ4 block format, decode by LZ4
+		comp_zlib = 3,
+		comp_methods = 4
+	};
+
+	struct t_comp_args // knobs of comp_policy
+	{
+		uint32_t uminsize;   // COMP_MINSIZE
+		uint32_t usamplemin; // COMP_SAMPLE_MINSIZE
+		uint32_t usample;    // COMP_SAMPLE_SIZE
+		uint32_t umaxentropy;// COMP_MAXENTROPY
+		uint32_t ularge;     // COMP_LARGESIZE
+		int      nlarge;     // method for large messages, comp_lz4hc default, comp_lz4 never upgrade
+		uint32_t uupgrade;   // COMP_UPGRADE_RATIO
+		uint32_t umaxnsperkb;// the large method not used while its nanoseconds per 1K source bytes over it, 0 no limit
+		uint32_t ubadratio;  // COMP_BAD_RATIO
+		uint32_t ubadcount;  // COMP_BAD_COUNT
+		uint32_t ubackoff;   // COMP_BACKOFF
+		uint32_t ubackoffmax;// COMP_BACKOFF_MAX
+	};
+
+	struct comp_stats // compression results of one connection, moving averages weight 1/8
+	{
+		uint64_t usrc[comp_methods];     // source bytes
+		uint64_t uout[comp_methods];     // compressed bytes
+		uint64_t uns[comp_methods];      // nanoseconds used
+		uint32_t ucount[comp_methods];   // messages, ucount[comp_none] messages not compressed
+		uint32_t uratio[comp_methods];   // average compressed * 1000 / source, 0 no result
+		uint32_t unsperkb[comp_methods]; // average nanoseconds per 1K source bytes
+		uint32_t uskipentropy; // not compressed for sampled entropy or packed format
+		uint32_t uskipbackoff; // not compressed in back off
+		uint32_t unbad;        // continuous bad results
+		uint32_t ubackoff;     // messages left in back off
+		uint32_t unext;        // length of the next back off, 0 first
+		uint32_t uprobe;       // large messages, probe the large method every 64
+		comp_stats() {
+			memset(this, 0, sizeof(comp_stats));
+		}
+	};
+
+	class comp_policy
+	{
+	public:
+		comp_policy()
+		{
+			_args.uminsize = COMP_MINSIZE;
+			_args.usamplemin = COMP_SAMPLE_MINSIZE;
+			_args.usample = COMP_SAMPLE_SIZE;
+			_args.umaxentropy = COMP_MAXENTROPY;
+			_args.ularge = COMP_LARGESIZE;
+			_args.nlarge = comp_lz4hc;
+			_args.uupgrade = COMP_UPGRADE_RATIO;
+			_args.umaxnsperkb = 0;
+			_args.ubadratio = COMP_BAD_RATIO;
+			_args.ubadcount = COMP_BAD_COUNT;
+			_args.ubackoff = COMP_BACKOFF;
+			_args.ubackoffmax = COMP_BACKOFF_MAX;
+		}
+		t_comp_args _args;
+		inline void set(const t_comp_args& args)
+		{
+			_args = args;
+			if (_args.usample > COMP_SAMPLE_MAX)
+				_args.usample = COMP_SAMPLE_MAX;
+			else if (_args.usample < COMP_SAMPLE_MIN)
+				_args.usample = COMP_SAMPLE_MIN;
+		}
+
+		/*!
+		\brief sample order-0 entropy of pd
+		\return bits per byte x100 of the sample, 0 not sampled(smaller than usamplemin), COMP_ENTROPY_PACKED packed format
+		*/
+		uint32_t entropy(const void* pd, size_t size) const
+		{
+			if (!pd || size < _args.usamplemin || size < 8)
+				return 0;
+			const uint8_t* p = (const uint8_t*)pd;
+			if (packed(p, size))
+				return COMP_ENTROPY_PACKED;
+			uint16_t cnt[256];
+			memset(cnt, 0, sizeof(cnt));
+			const float* pd1 = dnlog2n();
+			float fs = 0; // sum(c * log2(c)) updated with each byte
+			size_t i, n = 0, usample = _args.usample > COMP_SAMPLE_MAX ? COMP_SAMPLE_MAX : _args.usample;
+			if (usample < COMP_SAMPLE_MIN) // _args changed without set()
+				usample = COMP_SAMPLE_MIN;
+			if (size <= usample) {
+				for (i = 0; i < size; i++)
+					fs += pd1[cnt[p[i]]++];
+				n = size;
+			}
+			else { // chunks spread over the message, keep the local structure
+				size_t k, chunks = (usample + 63) / 64, step = (size - 64) / (chunks > 1 ? chunks - 1 : 1);
+				for (k = 0; k < chunks; k++) {
+					const uint8_t* pc = p + (k * step);
+					for (i = 0; i < 64; i++)
+						fs += pd1[cnt[pc[i]]++];
+				}
+				n = chunks * 64;
+			}
+			if (!n) // nothing sampled, let the caller compress
+				return 0;
+			float fe = (float)log2((double)n) - fs / n;
+			return fe > 0 ? (uint32_t)(fe * 100 + 0.5f) : 0;
+		}
+
+		/*!
+		\brief choose the method for one message, pst is updated for back off
+		\param uentropy return of entropy()
+		\param pst the connection stats, nullptr none
+		\param umethods COMP_MASK of the methods the peer can decode, comp_lz4 is the default
+		\param uminsize min size instead of _args.uminsize, 0 not used
+		\return COMPMETHOD
+		*/
+		int choose(size_t size, uint32_t uentropy, comp_stats* pst, uint32_t umethods, size_t uminsize = 0) const
+		{
+			if (size < (uminsize ? uminsize : _args.uminsize) || !(umethods & COMP_MASK(comp_lz4)))
+				return comp_none;
+			if (uentropy > _args.umaxentropy) {
+				if (pst)
+					pst->uskipentropy++;
+				return comp_none;
+			}
+			if (uentropy && pst && (umethods & COMP_MASK(comp_zlib)) && pst->uratio[comp_lz4] > _args.ubadratio
+				&& uentropy * 10 < _args.ubadratio * 8 && (!pst->uratio[comp_zlib] || pst->uratio[comp_zlib] <= _args.ubadratio))
+				return comp_zlib; // few repeats for LZ4 but few symbols, entropy coding gains
+			if (pst && pst->ubackoff) {
+				pst->ubackoff--;
+				pst->uskipbackoff++;
+				return comp_none;
+			}
+			int m = _args.nlarge;
+			if (size < _args.ularge || m <= comp_lz4 || m >= comp_methods || !(umethods & COMP_MASK(m)))
+				return comp_lz4;
+			if (!pst || !pst->uratio[m])
+				return m;
+			if (!(++pst->uprobe % 64)) // probe again
+				return m;
+			if (pst->uratio[m] > _args.uupgrade || (_args.umaxnsperkb && pst->unsperkb[m] > _args.umaxnsperkb))
+				return comp_lz4;
+			return m;
+		}
+
+		/*!
+		\brief report the result of one message
+		\param method used, comp_none for not compressed
+		\param uout bytes after compressed
+		\param uns nanoseconds used to compress
+		*/
+		void report(comp_stats* pst, int method, size_t usrc, size_t uout, uint64_t uns) const
+		{
+			if (!pst || method < comp_none || method >= comp_methods || !usrc)
+				return;
+			pst->ucount[method]++;
+			pst->usrc[method] += usrc;
+			pst->uout[method] += uout;
+			if (method == comp_none)
+				return;
+			pst->uns[method] += uns;
+			uint32_t ur = (uint32_t)(uout * 1000 / usrc), unk = (uint32_t)(uns * 1024 / usrc);
+			pst->uratio[method] = pst->uratio[method] ? (pst->uratio[method] * 7 + ur) / 8 : (ur ? ur : 1);
+			pst->unsperkb[method] = pst->unsperkb[method] ? (pst->unsperkb[method] * 7 + unk) / 8 : unk;
+			if (ur <= _args.ubadratio) {
+				pst->unbad = 0;
+				pst->unext = 0;
+				return;
+			}
+			if (++pst->unbad < _args.ubadcount)
+				return;
+			pst->unbad = 0;
+			pst->ubackoff = pst->unext ? pst->unext : _args.ubackoff;
+			pst->unext = pst->ubackoff * 2 > _args.ubackoffmax ? _args.ubackoffmax : pst->ubackoff * 2;
+		}
+
+		inline bool compressible(const void* pd, size_t size) const // for the callers without stats
+		{
+			return size >= _args.uminsize && entropy(pd, size) <= _args.umaxentropy;
+		}
+
+		static bool packed(const uint8_t* p, size_t size) // signatures of compressed files and streams
+		{
+			if (size < 8)
+				return false;
+			if ((p[0] == 0x1F && p[1] == 0x8B) // gzip
+				|| (p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF) // jpeg
+				|| (p[0] == 'P' && p[1] == 'K' && p[2] == 3 && p[3] == 4) // zip,docx,xlsx,jar
+				|| !memcmp(p, "\x89PNG", 4)
+				|| !memcmp(p, "GIF8", 4)
+				|| !memcmp(p, "\x28\xB5\x2F\xFD", 4) // zstd
+				|| !memcmp(p, "\x04\x22\x4D\x18", 4) // lz4 frame
+				|| !memcmp(p, "\xFD" "7zXZ", 5) // xz
+				|| !memcmp(p, "7z\xBC\xAF", 4)
+				|| !memcmp(p, "BZh", 3)
+				|| !memcmp(p + 4, "ftyp", 4) // mp4,mov
+				|| (!memcmp(p, "RIFF", 4) && size >= 12 && !memcmp(p + 8, "WEBP", 4)))
+				return true;
+			return false;
+		}
+	private:
+		static const float* dnlog2n() // (n + 1) * log2(n + 1) - n * log2(n), n = 0 to COMP_SAMPLE_MAX - 1
+		{
+			struct t_table {
+				float v[COMP_SAMPLE_MAX];
+				t_table() {
+					double d0 = 0, d1;
+					for (int i = 0; i < COMP_SAMPLE_MAX; i++) {
+						d1 = (i + 1) * log2((double)i + 1);
+						v[i] = (float)(d1 - d0);
+						d0 = d1;
+					}
+				}
+			};
+			static t_table tab;
+			return tab.v;
+		}
+	};
+}
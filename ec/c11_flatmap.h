@@ -0,0 +1,384 @@
+﻿/*!
+\file c11_flatmap.h
+\author	jiangyong
+\email  kipway@outlook.com
+\update 2018.8.19
+
+eclib class flatmap with c++11. open addressing unordered hashmap (Robin Hood hashing),
+values inline in a power of 2 slot array, grow automatically with incremental rehash.
+same interface as ec::map (set/get/erase/next/for_each), use the same key_equal, del_node and hash.
+
+warning: values are moved when insert, erase and rehash, the pointer returned by get() is valid only
+until the next set or erase.
+
+class flatmap
+
+eclib Copyright (c) 2017-2018, kipway
+source repository : https://github.com/kipway/eclib
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <functional>
+#include <utility>
+#include "c11_memory.h"
+#include "c11_hash.h"
+#include "c11_map.h"
+
+#ifndef FLATMAP_MIGRATE_STEP
+#	define FLATMAP_MIGRATE_STEP 8 // min slots moved from the old table by each set and erase while rehashing
+#endif
+
+namespace ec
+{
+	template<class _Kty,
+		class _Ty,
+		class _Keyeq = key_equal<_Kty, _Ty>,
+		class _DelVal = del_node<_Ty>,
+		class _Hasher = hash<_Kty> >
+		class flatmap
+	{
+	public:
+		typedef uint64_t iterator;  // high 32 bits table(0 current, 1 old), low 32 bits slot
+		typedef _Ty		value_type;
+		typedef _Kty	key_type;
+		typedef size_t	size_type;
+		struct t_slot
+		{
+			uint32_t   udist; // 0: empty; probe distance + 1
+			uint32_t   uhash;
+			value_type value;
+		};
+	protected:
+		struct t_table
+		{
+			t_slot*   ps;
+			uint32_t  ucap;   // power of 2
+			uint32_t  ushift; // 32 - log2(ucap)
+			size_type usize;
+		};
+		t_table  _tab; // insert to
+		t_table  _old; // moving to _tab while rehash, ps is nullptr if not rehash
+		uint32_t _umigstart, _umigpos; // rehash from _umigstart(an empty slot of _old), _umigpos slots done
+		uint32_t _uinitcap;
+	private:
+		ec::memory* _pmem;
+	public:
+		flatmap(unsigned int ucapacity = 16, ec::memory* pmem = nullptr) : _umigstart(0), _umigpos(0), _pmem(pmem)
+		{
+			memset(&_tab, 0, sizeof(_tab));
+			memset(&_old, 0, sizeof(_old));
+			_uinitcap = 16;
+			while (_uinitcap < 0x40000000u && (size_t)_uinitcap * 4 < (size_t)ucapacity * 5) // load factor 0.8
+				_uinitcap <<= 1;
+		}
+		~flatmap()
+		{
+			clear();
+		}
+		flatmap(const flatmap&) = delete;
+		flatmap& operator = (const flatmap&) = delete;
+
+		inline static size_t size_node() {
+			return sizeof(t_slot);
+		}
+		inline size_type size() const noexcept
+		{
+			return _tab.usize + _old.usize;
+		}
+		inline bool empty() const noexcept
+		{
+			return !size();
+		}
+		inline size_type capacity() const noexcept
+		{
+			return _tab.ucap;
+		}
+		inline bool rehashing() const noexcept
+		{
+			return nullptr != _old.ps;
+		}
+		iterator begin() noexcept
+		{
+			iterator i = 0;
+			return _nexti(i);
+		}
+		inline iterator end() const noexcept
+		{
+			return ~0;
+		}
+		bool set(key_type key, const value_type& Value) noexcept
+		{
+			uint32_t h = hash32(key);
+			value_type* pv = find(key, h);
+			if (pv) {
+				_DelVal()(*pv);
+				*pv = Value;
+				return true;
+			}
+			value_type v(Value);
+			return add(h, v);
+		}
+		bool set(key_type key, value_type&& Value) noexcept
+		{
+			uint32_t h = hash32(key);
+			value_type* pv = find(key, h);
+			if (pv) {
+				_DelVal()(*pv);
+				*pv = std::move(Value);
+				return true;
+			}
+			return add(h, Value);
+		}
+		value_type* get(key_type key) noexcept
+		{
+			if (!size())
+				return nullptr;
+			return find(key, hash32(key));
+		}
+		bool get(key_type key, value_type& Value) noexcept
+		{
+			value_type* pv = get(key);
+			if (nullptr == pv)
+				return false;
+			Value = *pv;
+			return true;
+		}
+		bool erase(key_type key) noexcept
+		{
+			if (!size())
+				return false;
+			uint32_t h = hash32(key);
+			int64_t i = findpos(_tab, key, h);
+			if (i >= 0) {
+				_DelVal()(_tab.ps[i].value);
+				erase_at(_tab, (uint32_t)i);
+			}
+			else if (_old.ps && (i = findpos(_old, key, h)) >= 0) {
+				_DelVal()(_old.ps[i].value);
+				erase_at(_old, (uint32_t)i);
+			}
+			else
+				return false;
+			migrate(FLATMAP_MIGRATE_STEP);
+			return true;
+		}
+		void clear() noexcept
+		{
+			free_table(_old);
+			free_table(_tab);
+			_umigstart = 0;
+			_umigpos = 0;
+		}
+		value_type* next(iterator& i) noexcept
+		{
+			i = _nexti(i);
+			if (end() == i)
+				return nullptr;
+			value_type* pv = &((i >> 32) ? _old : _tab).ps[(uint32_t)i].value;
+			i++;
+			return pv;
+		}
+		inline bool next(iterator& i, value_type* &pv) noexcept
+		{
+			pv = next(i);
+			return pv != nullptr;
+		}
+		bool next(iterator& i, value_type &rValue) noexcept
+		{
+			value_type* pv = next(i);
+			if (pv)
+				rValue = *pv;
+			return pv != nullptr;
+		}
+		void for_each(std::function<void(value_type& val)> fun) noexcept
+		{
+			iterator i = begin();
+			value_type* pv = next(i);
+			while (pv) {
+				fun(*pv);
+				pv = next(i);
+			}
+		}
+	private:
+		static inline uint32_t hash32(key_type key)
+		{
+			uint64_t u = (uint64_t)_Hasher()(key);
+			return (uint32_t)(u ^ (u >> 32));
+		}
+		static inline uint32_t home(const t_table& t, uint32_t h) // fibonacci hashing, use the high bits
+		{
+			return (uint32_t)((h * 2654435769U) >> t.ushift);
+		}
+		int64_t findpos(const t_table& t, key_type key, uint32_t h) noexcept
+		{
+			if (!t.usize)
+				return -1;
+			uint32_t umask = t.ucap - 1, i = home(t, h), d = 1;
+			for (;;) {
+				const t_slot& s = t.ps[i];
+				if (s.udist < d) // empty or a richer slot, key not here
+					return -1;
+				if (s.uhash == h && _Keyeq()(key, s.value))
+					return i;
+				i = (i + 1) & umask;
+				d++;
+			}
+		}
+		value_type* find(key_type key, uint32_t h) noexcept
+		{
+			int64_t i = findpos(_tab, key, h);
+			if (i >= 0)
+				return &_tab.ps[i].value;
+			if (_old.ps && (i = findpos(_old, key, h)) >= 0)
+				return &_old.ps[i].value;
+			return nullptr;
+		}
+		bool add(uint32_t h, value_type& v) noexcept // v is moved to table
+		{
+			if (!_tab.ps && !alloc_table(_tab, _uinitcap))
+				return false;
+			if ((size() + 1) * 5 > (size_t)_tab.ucap * 4) {
+				if (_old.ps)
+					migrate(_old.ucap); // finish last rehash first
+				if (!rehash())
+					return false;
+			}
+			insert(_tab, h, v);
+			migrate(FLATMAP_MIGRATE_STEP);
+			return true;
+		}
+		void insert(t_table& t, uint32_t h, value_type& v) noexcept // Robin Hood, the poorer takes the slot
+		{
+			uint32_t umask = t.ucap - 1, i = home(t, h), d = 1;
+			for (;;) {
+				t_slot& s = t.ps[i];
+				if (!s.udist) {
+					new(&s.value)value_type(std::move(v));
+					s.udist = d;
+					s.uhash = h;
+					t.usize++;
+					return;
+				}
+				if (s.udist < d) {
+					std::swap(s.value, v);
+					std::swap(s.udist, d);
+					std::swap(s.uhash, h);
+				}
+				i = (i + 1) & umask;
+				d++;
+			}
+		}
+		void erase_at(t_table& t, uint32_t i) noexcept // backward shift, no tombstones
+		{
+			uint32_t umask = t.ucap - 1, j = (i + 1) & umask;
+			t.ps[i].value.~value_type();
+			while (t.ps[j].udist > 1) {
+				new(&t.ps[i].value)value_type(std::move(t.ps[j].value));
+				t.ps[j].value.~value_type();
+				t.ps[i].udist = t.ps[j].udist - 1;
+				t.ps[i].uhash = t.ps[j].uhash;
+				i = j;
+				j = (j + 1) & umask;
+			}
+			t.ps[i].udist = 0;
+			t.usize--;
+		}
+		bool rehash() noexcept // double, _tab become _old and moved by later set/erase
+		{
+			t_table tn;
+			if (_tab.ucap >= 0x80000000u || !alloc_table(tn, _tab.ucap * 2))
+				return false;
+			_old = _tab;
+			_tab = tn;
+			_umigstart = 0;
+			_umigpos = 0;
+			while (_old.ps[_umigstart].udist) // load < 1, always has an empty slot
+				_umigstart++;
+			return true;
+		}
+		/*!
+		\brief move at least n slots from _old to _tab, stop only after an empty slot,
+		so the slots not moved are whole clusters and lookup in _old is still right.
+		*/
+		void migrate(uint32_t n) noexcept
+		{
+			uint32_t umask = _old.ucap - 1;
+			while (_old.ps) {
+				t_slot& s = _old.ps[(_umigstart + _umigpos) & umask];
+				bool bempty = !s.udist;
+				if (!bempty) {
+					insert(_tab, s.uhash, s.value);
+					s.value.~value_type();
+					s.udist = 0;
+					_old.usize--;
+				}
+				if (++_umigpos >= _old.ucap) {
+					free_table(_old);
+					break;
+				}
+				if (n)
+					n--;
+				if (!n && bempty)
+					break;
+			}
+		}
+		bool alloc_table(t_table& t, uint32_t ucap) noexcept
+		{
+			size_t zsize = sizeof(t_slot) * ucap, zout = zsize;
+			t.ps = (t_slot*)(_pmem ? _pmem->malloc(zsize, zout) : ::malloc(zsize));
+			if (!t.ps)
+				return false;
+			for (uint32_t i = 0; i < ucap; i++)
+				t.ps[i].udist = 0;
+			t.ucap = ucap;
+			t.ushift = 32;
+			while (ucap > 1) {
+				ucap >>= 1;
+				t.ushift--;
+			}
+			t.usize = 0;
+			return true;
+		}
+		void free_table(t_table& t) noexcept
+		{
+			if (!t.ps)
+				return;
+			for (uint32_t i = 0; t.usize && i < t.ucap; i++) {
+				if (t.ps[i].udist) {
+					_DelVal()(t.ps[i].value);
+					t.ps[i].value.~value_type();
+					t.usize--;
+				}
+			}
+			if (_pmem)
+				_pmem->mem_free(t.ps);
+			else
+				::free(t.ps);
+			memset(&t, 0, sizeof(t));
+		}
+		iterator _nexti(iterator i) noexcept // first not empty slot from i
+		{
+			for (uint32_t it = (uint32_t)(i >> 32); it < 2; it++) {
+				const t_table& t = it ? _old : _tab;
+				uint32_t u = it == (uint32_t)(i >> 32) ? (uint32_t)i : 0;
+				for (; t.ps && u < t.ucap; u++) {
+					if (t.ps[u].udist)
+						return ((iterator)it << 32) | u;
+				}
+			}
+			return ~0;
+		}
+	};
+}
@@ -41,7 +41,7 @@ namespace ec {
 		{
 		}
 		inline void InitHttpsArgs(_THREAD* pthread) {
-			http_pargs arg1(&_cfg, &_clients);
+			http_pargs arg1(&_cfg, &_clients, &_compolicy);
 			pthread->InitWsArgs(&arg1);
 			base_::InitTlsArgs(pthread);
 		}
@@ -52,15 +52,20 @@ namespace ec {
 	public:
 		cHttpCfg _cfg;
 		cHttpClientMap _clients;
+		comp_policy _compolicy; // copied to threads by InitHttpsArgs
 	public:
-		bool start(const char* cfgfile, unsigned int uThreads, const char* sip = nullptr)
+		inline void set_comp_policy(const t_comp_args& args) { // call before start, websocket and http deflate only for compressible data
+			_compolicy.set(args);
+		}
+		bool start(const char* cfgfile, unsigned int uThreads, const char* sip = nullptr, int reactors = 1)
 		{
 			if (!_cfg.fromfile(cfgfile)) {
 				if (base_::_plog)
 					base_::_plog->add(CLOG_DEFAULT_ERR, "https server load config file %s failed", cfgfile);
 				return false;
 			}
-			return base_::start(_cfg._ca_server, _cfg._ca_root, _cfg._private_key, _cfg._wport_wss, uThreads, sip);
+			_clients.SetAffinity(base_::is_affinity());
+			return base_::start(_cfg._ca_server, _cfg._ca_root, _cfg._private_key, _cfg._wport_wss, uThreads, sip, reactors);
 		}		
 	};
 
@@ -80,6 +85,8 @@ namespace ec {
 		void InitWsArgs(http_pargs* pargs) {
 			basews_::_pcfg = pargs->_pcfg;
 			basews_::_pclis = pargs->_pmap;
+			if (pargs->_pcompolicy)
+				basews_::_compolicy = *pargs->_pcompolicy;
 		}
 	protected: //cWebsocket
 		void onwsread(uint32_t ucid, int bFinal, int wsopcode, const void* pdata, size_t size)
@@ -95,14 +102,25 @@ namespace ec {
 				return -1;
 			return (int)pvd->size();
 		}
+		int  dosend_shared(uint32_t ucid, shared_buffer* pbuf) // tls encrypt for each session
+		{
+			if (!base_::tls_post(ucid, pbuf->data(), pbuf->size(), 0))
+				return -1;
+			return (int)pbuf->size();
+		}
 		bool onhttprequest(uint32_t ucid, cHttpPacket* pPkg)
 		{
 			return static_cast<_CLS*>(this)->onhttprequest(ucid, pPkg);
 		}
+		inline void onwsupgrade(uint32_t ucid) { // websocket has no http keep-alive timeout, the idle timeout set by application stay
+			base_::kill_timer(ucid, XPOLL_TIMER_KEEPALIVE);
+		}
 	protected: //AioTlsSrvThread
 		inline void onconnect(uint32_t ucid, const char* sip)//connect event
 		{
 			basews_::_pclis->Add(ucid, sip);
+			if (basews_::_pcfg->_keepalive)
+				base_::set_timer(ucid, XPOLL_TIMER_KEEPALIVE, basews_::_pcfg->_keepalive * 1000);
 			static_cast<_CLS*>(this)->onconnect(ucid, sip);
 		}
 		inline void onhandshake(uint32_t ucid)
@@ -42,7 +42,7 @@ namespace ec {
 		{
 		}
 		inline void InitHttpArgs(_THREAD* pthread) {
-			http_pargs arg1(&_cfg, &_clients);
+			http_pargs arg1(&_cfg, &_clients, &_compolicy);
 			pthread->InitWsArgs(&arg1);
 		}
 	protected:
@@ -52,15 +52,20 @@ namespace ec {
 	public:
 		cHttpCfg        _cfg;
 		cHttpClientMap	_clients;
+		comp_policy _compolicy; // copied to threads by InitHttpArgs
 	public:
-		bool start(const char* cfgfile, unsigned int uThreads)
+		inline void set_comp_policy(const t_comp_args& args) { // call before start, websocket and http deflate only for compressible data
+			_compolicy.set(args);
+		}
+		bool start(const char* cfgfile, unsigned int uThreads, int reactors = 1)
 		{
 			if (!_cfg.fromfile(cfgfile)) {
 				if (base_::_plog)
 					base_::_plog->add(CLOG_DEFAULT_ERR, "http server load config file %s failed", cfgfile);
 				return false;
 			}
-			return base_::start(_cfg._wport, uThreads);
+			_clients.SetAffinity(base_::is_affinity());
+			return base_::start(_cfg._wport, uThreads, nullptr, reactors);
 		}		
 	};
 
@@ -80,6 +85,8 @@ namespace ec {
 		void InitWsArgs(http_pargs* pargs) {
 			basews_::_pcfg = pargs->_pcfg;
 			basews_::_pclis = pargs->_pmap;
+			if (pargs->_pcompolicy)
+				basews_::_compolicy = *pargs->_pcompolicy;
 		}
 	protected: // cWebsocket
 		inline void onwsread(uint32_t ucid, int bFinal, int wsopcode, const void* pdata, size_t size)
@@ -96,14 +103,25 @@ namespace ec {
 				return -1;
 			return size;
 		}
+		int  dosend_shared(uint32_t ucid, shared_buffer* pbuf)
+		{
+			if (XPOLL_POST_QUEUED != base_::tcp_trypost(ucid, pbuf))
+				return -1;
+			return (int)pbuf->size();
+		}
 		bool onhttprequest(uint32_t ucid, cHttpPacket* pPkg)
 		{
 			return static_cast<_CLS*>(this)->onhttprequest(ucid, pPkg);
 		}
+		inline void onwsupgrade(uint32_t ucid) { // websocket has no http keep-alive timeout, the idle timeout set by application stay
+			base_::kill_timer(ucid, XPOLL_TIMER_KEEPALIVE);
+		}
 	protected: //AioTcpSrvThread
 		void onconnect(uint32_t ucid, const char* sip)//connect event
 		{
 			basews_::_pclis->Add(ucid, sip);
+			if (basews_::_pcfg->_keepalive)
+				base_::set_timer(ucid, XPOLL_TIMER_KEEPALIVE, basews_::_pcfg->_keepalive * 1000);
 			static_cast<_CLS*>(this)->onconnect(ucid, sip);
 		}
 		void onrecv(uint32_t ucid, const void* pdata, size_t size)
@@ -0,0 +1,291 @@
+﻿/*!
+\file c11_iobuf.h
+\author	jiangyong
+\email  kipway@outlook.com
+\update 2018.8.19
+
+eclib class iobuf with c++11. chained segments buffer for stream reassembly.
+append to the tail segment, consume from the head in O(1) without memmove, empty segments are freed.
+parsers peek the head, read one frame to a vector, get iovec views, or linearize the first n bytes.
+
+class iobuf
+
+eclib Copyright (c) 2017-2018, kipway
+source repository : https://github.com/kipway/eclib
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <cstdint>
+#include <string.h>
+#include "c11_memory.h"
+#include "c11_vector.h"
+
+#ifndef IOBUF_SEGSIZE
+#	define IOBUF_SEGSIZE (1024 * 16) // default segment data size
+#endif
+
+namespace ec
+{
+	struct t_iobuf_iov // one contiguous piece
+	{
+		const void* pd;
+		size_t size;
+	};
+
+	class iobuf
+	{
+	public:
+		iobuf(size_t usegsize = IOBUF_SEGSIZE, memory* pmem = nullptr) : _phead(nullptr), _ptail(nullptr), _pspare(nullptr),
+			_usize(0), _usegsize(usegsize ? usegsize : IOBUF_SEGSIZE), _pmem(pmem)
+		{
+		}
+		iobuf(iobuf&& v) : _phead(v._phead), _ptail(v._ptail), _pspare(v._pspare), _usize(v._usize), _usegsize(v._usegsize), _pmem(v._pmem)
+		{
+			v._phead = v._ptail = v._pspare = nullptr;
+			v._usize = 0;
+		}
+		~iobuf()
+		{
+			clear();
+		}
+		iobuf& operator = (iobuf&& v)
+		{
+			if (this == &v)
+				return *this;
+			clear();
+			_phead = v._phead;
+			_ptail = v._ptail;
+			_pspare = v._pspare;
+			_usize = v._usize;
+			_usegsize = v._usegsize;
+			_pmem = v._pmem;
+			v._phead = v._ptail = v._pspare = nullptr;
+			v._usize = 0;
+			return *this;
+		}
+		iobuf(const iobuf&) = delete;
+		iobuf& operator = (const iobuf&) = delete;
+	private:
+		struct t_seg
+		{
+			t_seg* pnext;
+			size_t ubegin; // read pos
+			size_t uend;   // write pos
+			size_t ucap;
+			inline uint8_t* data() {
+				return (uint8_t*)(this + 1);
+			}
+		};
+		t_seg* _phead;
+		t_seg* _ptail;
+		t_seg* _pspare; // one free default segment, reused by next append
+		size_t _usize;
+		size_t _usegsize;
+		memory* _pmem;
+	public:
+		inline size_t size() const
+		{
+			return _usize;
+		}
+		inline bool empty() const
+		{
+			return !_usize;
+		}
+		void clear() // free all segments
+		{
+			while (_phead) {
+				t_seg* pn = _phead->pnext;
+				free_seg(_phead);
+				_phead = pn;
+			}
+			if (_pspare) {
+				free_seg(_pspare);
+				_pspare = nullptr;
+			}
+			_ptail = nullptr;
+			_usize = 0;
+		}
+		bool append(const void* pd, size_t size)
+		{
+			const uint8_t* ps = (const uint8_t*)pd;
+			while (size) {
+				if (!_ptail || _ptail->uend == _ptail->ucap) {
+					t_seg* pn = new_seg(size);
+					if (!pn)
+						return false;
+					if (_ptail)
+						_ptail->pnext = pn;
+					else
+						_phead = pn;
+					_ptail = pn;
+				}
+				size_t n = _ptail->ucap - _ptail->uend;
+				if (n > size)
+					n = size;
+				memcpy(_ptail->data() + _ptail->uend, ps, n);
+				_ptail->uend += n;
+				_usize += n;
+				ps += n;
+				size -= n;
+			}
+			return true;
+		}
+		size_t peek(void* pout, size_t size, size_t off = 0) const // copy without consume, return bytes copied
+		{
+			uint8_t* po = (uint8_t*)pout;
+			size_t ncp = 0;
+			for (t_seg* p = _phead; p && ncp < size; p = p->pnext) {
+				size_t n = p->uend - p->ubegin;
+				if (off >= n) {
+					off -= n;
+					continue;
+				}
+				n -= off;
+				if (n > size - ncp)
+					n = size - ncp;
+				memcpy(po + ncp, p->data() + p->ubegin + off, n);
+				ncp += n;
+				off = 0;
+			}
+			return ncp;
+		}
+		inline void* front(size_t size) // first size bytes if they are in one segment, else nullptr
+		{
+			if (!_phead || _phead->uend - _phead->ubegin < size)
+				return nullptr;
+			return _phead->data() + _phead->ubegin;
+		}
+		/*!
+		\brief make the first size bytes contiguous and return the pointer, for parsers need continuous text.
+		merge into one segment with the same size free space, the next append fill it.
+		*/
+		void* linearize(size_t size)
+		{
+			if (size > _usize)
+				return nullptr;
+			void* pr = front(size);
+			if (pr || !size)
+				return pr;
+			t_seg* pn = alloc_seg(2 * size > _usegsize ? 2 * size : _usegsize);
+			if (!pn)
+				return nullptr;
+			pn->uend = peek(pn->data(), size);
+			consume(size);
+			pn->pnext = _phead;
+			_phead = pn;
+			if (!_ptail)
+				_ptail = pn;
+			_usize += size;
+			return pn->data();
+		}
+		size_t consume(size_t size) // drop from head, return bytes consumed
+		{
+			size_t ndo = 0;
+			while (_phead && ndo < size) {
+				size_t n = _phead->uend - _phead->ubegin;
+				if (n > size - ndo) {
+					_phead->ubegin += size - ndo;
+					_usize -= size - ndo;
+					return size;
+				}
+				ndo += n;
+				_usize -= n;
+				t_seg* pn = _phead->pnext;
+				release_seg(_phead);
+				_phead = pn;
+			}
+			if (!_phead)
+				_ptail = nullptr;
+			return ndo;
+		}
+		size_t read(void* pout, size_t size) // copy and consume
+		{
+			return consume(peek(pout, size));
+		}
+		template<class _Tp>
+		bool readto(vector<_Tp>* pout, size_t size) // add size bytes to pout and consume, false if not enough
+		{
+			if (size > _usize || !pout->expand(pout->size() + size / sizeof(_Tp)))
+				return false;
+			size_t ndo = 0;
+			for (t_seg* p = _phead; p && ndo < size; p = p->pnext) {
+				size_t n = p->uend - p->ubegin;
+				if (n > size - ndo)
+					n = size - ndo;
+				if (!pout->add((const _Tp*)(p->data() + p->ubegin), n / sizeof(_Tp)))
+					return false;
+				ndo += n;
+			}
+			consume(size);
+			return true;
+		}
+		size_t getiov(t_iobuf_iov* piov, size_t niov, size_t size) const // pieces of the first size bytes, return pieces used
+		{
+			size_t i = 0, ndo = 0;
+			for (t_seg* p = _phead; p && i < niov && ndo < size; p = p->pnext) {
+				size_t n = p->uend - p->ubegin;
+				if (!n)
+					continue;
+				if (n > size - ndo)
+					n = size - ndo;
+				piov[i].pd = p->data() + p->ubegin;
+				piov[i].size = n;
+				ndo += n;
+				i++;
+			}
+			return i;
+		}
+	private:
+		t_seg* alloc_seg(size_t ucap)
+		{
+			size_t zout = sizeof(t_seg) + ucap;
+			t_seg* p = (t_seg*)(_pmem ? _pmem->malloc(zout, zout) : ::malloc(zout));
+			if (!p)
+				return nullptr;
+			p->pnext = nullptr;
+			p->ubegin = 0;
+			p->uend = 0;
+			p->ucap = zout - sizeof(t_seg);
+			return p;
+		}
+		t_seg* new_seg(size_t sizehint) // for append
+		{
+			if (_pspare && (_pspare->ucap >= sizehint || !_phead)) {
+				t_seg* p = _pspare;
+				_pspare = nullptr;
+				return p;
+			}
+			return alloc_seg(_usegsize);
+		}
+		void release_seg(t_seg* p) // consumed, keep one default segment
+		{
+			if (!_pspare && p->ucap <= 2 * _usegsize) {
+				p->pnext = nullptr;
+				p->ubegin = 0;
+				p->uend = 0;
+				_pspare = p;
+				return;
+			}
+			free_seg(p);
+		}
+		inline void free_seg(t_seg* p)
+		{
+			if (_pmem)
+				_pmem->mem_free(p);
+			else
+				::free(p);
+		}
+	};
+}
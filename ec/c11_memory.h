@@ -2,9 +2,22 @@
 \file c11_memory.h
 \author	jiangyong
 \email  kipway@outlook.com
-\update 2018.7.22
+\update 2018.8.18
 
 eclib class fast memory allocator with c++11.
+size classes 16B-1MB (4 classes per power of 2) in 2MB slabs, slabs are carved from one address space
+reserved at first use, grow on demand up to the capacity and empty slabs are returned to the OS.
+larger blocks and blocks after the capacity is used up come from ::malloc.
+optional per thread magazine cache (set_tlcache) in front of the locked slabs,
+alloc/free without lock, exchange half magazine with the slabs when empty or full.
+always on statistics (stat), build with MEM_DEBUG=1 to tag blocks with call site (return address) and leak_dump.
+arena options (set_arena): transparent huge pages or hugetlb, prefault at startup and NUMA node.
+scratch_arena: per worker bump allocator for temporary buffers, reset after each event.
+
+class memory
+class auto_buffer
+class scratch_arena
+class shared_buffer
 
 eclib Copyright (c) 2017-2018, kipway
 source repository : https://github.com/kipway/eclib
@@ -23,138 +36,813 @@ limitations under the License.
 */
 #pragma once
 #include <cstdint>
+#include <stdlib.h>
 #include <memory.h>
+#include <mutex>
+#include <atomic>
+#include <new>
 #include "c11_mutex.h"
-#include "c11_stack.h"
+
+#ifdef _WIN32
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	include <windows.h>
+#	include <intrin.h>
+#else
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	include <sys/syscall.h>
+#endif
+
+#define MEM_SLAB_BITS   21 // 2MB
+#define MEM_SLAB_SIZE   ((size_t)1 << MEM_SLAB_BITS)
+#define MEM_CLASSES     60 // 16,32,48,64,80,96,112,128,160 ... 1MB
+#define MEM_MAX_BLKSIZE ((size_t)1 << 20)
+#define MEM_NIL         0xFFFFFFFF
+
+#define MEM_ARENA_HUGEPAGE 0x01 // linux transparent huge pages, madvise(MADV_HUGEPAGE)
+#define MEM_ARENA_HUGETLB  0x02 // linux explicit 2MB hugetlb pages reserved by vm.nr_hugepages, use normal pages if failed
+
+#ifndef MEM_SLAB_MINCAP // min address space for slabs of one memory object
+#	if defined(_WIN64) || defined(__LP64__)
+#		define MEM_SLAB_MINCAP ((size_t)256 << 20)
+#	else
+#		define MEM_SLAB_MINCAP ((size_t)32 << 20)
+#	endif
+#endif
+
+#ifndef MEM_TLCACHE_SLOTS
+#	define MEM_TLCACHE_SLOTS 4 // memory objects cached by one thread
+#endif
+
+#ifndef MEM_TLCACHE_BYTES
+#	define MEM_TLCACHE_BYTES (64 * 1024) // max bytes of half magazine of one size class
+#endif
+
+#ifndef MEM_SCRATCH_BLKSIZE
+#	define MEM_SCRATCH_BLKSIZE (64 * 1024) // default block size of scratch_arena
+#endif
+
+#ifndef MEM_SCRATCH_MAXKEEP
+#	define MEM_SCRATCH_MAXKEEP MEM_MAX_BLKSIZE // max block size kept by scratch_arena::reset
+#endif
+
+#ifndef MEM_DEBUG
+#	define MEM_DEBUG 0 // 1: tag blocks with call site for leak_dump
+#endif
+
+#if MEM_DEBUG
+#	include <unordered_map>
+#	include <vector>
+#	include <algorithm>
+#	ifdef _WIN32
+#		define MEM_NOINLINE __declspec(noinline)
+#		define MEM_CALLSITE() ((uintptr_t)_ReturnAddress())
+#	else
+#		define MEM_NOINLINE __attribute__((noinline))
+#		define MEM_CALLSITE() ((uintptr_t)__builtin_return_address(0))
+#	endif
+#else
+#	define MEM_NOINLINE
+#	define MEM_CALLSITE() ((uintptr_t)0)
+#endif
+
 namespace ec {
 	class memory
 	{
 	public:
+		struct t_stat_class {
+			size_t   usize;  // block size
+			uint64_t ualloc; // with thread cache, counters in threads are added when they exchange blocks with the slabs
+			uint64_t ufree;
+			uint32_t uout;   // blocks out of slabs, include blocks in thread caches
+			uint32_t upeak;  // peak of uout
+			uint32_t uslabs;
+		};
+		struct t_stat {
+			uint64_t ufallback;      // ::malloc for size > MEM_MAX_BLKSIZE or capacity used up
+			uint64_t ufallback_bytes;
+			uint64_t ufallback_free;
+			uint64_t ucapfull;       // fallbacks because capacity used up
+			uint64_t ufailed;        // ::malloc return null
+			size_t   ubytes;         // bytes out of slabs
+			size_t   upeakbytes;
+			uint32_t uslabs, upeakslabs, umaxslabs;
+			t_stat_class cls[MEM_CLASSES];
+		};
+		/*!
+		\brief the block size and number parameters are only used to estimate the capacity,
+		capacity is 2 times of the total, at least MEM_SLAB_MINCAP, can be changed by set_cap before first use.
+		*/
 		memory(size_t sblksize, size_t sblknum,
 			size_t mblksize = 0, size_t mblknum = 0,
 			size_t lblksize = 0, size_t lblknum = 0,
 			std::mutex* pmutex = nullptr
-		) : _ps(nullptr),_pm(nullptr), _pl(nullptr), _pmutex(pmutex), _stks(sblknum), _stkm(mblknum), _stkl(lblknum)
-		{
-			_sz_s = sblksize;// small memory blocks,Pre-allocation
-			if (_sz_s % (sizeof(size_t) * 2))
-				_sz_s += (sizeof(size_t) * 2) - sblksize % (sizeof(size_t) * 2);
-			_blk_s = sblknum;
-			malloc_block(_sz_s, _blk_s, _ps, _stks);
-			
-			_sz_m = mblksize; // medium memory blocks, malloc at the time of use
-			if (_sz_m % (sizeof(size_t)*2))
-				_sz_m += (sizeof(size_t) * 2) - mblksize % (sizeof(size_t) * 2);
-			_blk_m = mblknum;
-			
-			_sz_l = lblksize; // large memory blocks, malloc at the time of use
-			if (_sz_l % (sizeof(size_t) * 2))
-				_sz_l += (sizeof(size_t) * 2) - lblksize % (sizeof(size_t) * 2);
-			_blk_l = lblknum;
+		) : _pmutex(pmutex), _preserve(nullptr), _pbase(nullptr), _ucap(0), _pslabs(nullptr), _uslabs(0), _utop(0), _ufreeslab(MEM_NIL),
+			_umag(0), _userial(0), _preg_prev(nullptr), _preg_next(nullptr),
+			_ubytes(0), _upeakbytes(0), _uslabsout(0), _upeakslabs(0), _ufallback(0), _ufallback_bytes(0), _ufallback_free(0), _ucapfull(0), _ufailed(0),
+			_uarena(0), _uprefault(0), _nnumanode(-1), _bhugetlb(false), _ukeepslabs(0)
+		{
+			size_t ucap = (sblksize * sblknum + mblksize * mblknum + lblksize * lblknum) * 2;
+			set_cap(ucap > MEM_SLAB_MINCAP ? ucap : MEM_SLAB_MINCAP);
+			for (int i = 0; i < MEM_CLASSES; i++) {
+				_cls[i].usize = class_size(i);
+				_cls[i].ublks = (uint32_t)(MEM_SLAB_SIZE / _cls[i].usize);
+				_cls[i].upartial = MEM_NIL;
+				_cls[i].uempty = MEM_NIL;
+				_cls[i].ualloc = 0;
+				_cls[i].ufree = 0;
+				_cls[i].uout = 0;
+				_cls[i].upeak = 0;
+				_cls[i].uslabs = 0;
+			}
 		}
 		~memory()
 		{
-			_stks.clear();
-			_stkm.clear();
-			_stkl.clear();
-			if (_ps)
-				::free(_ps);
-			if (_pm)
-				::free(_pm);
-			if (_pl)
-				::free(_pl);
+			if (_umag) { // thread caches of this object become stale
+				std::unique_lock<std::mutex> lck(reg_mutex());
+				if (_preg_prev)
+					_preg_prev->_preg_next = _preg_next;
+				else
+					reg_head() = _preg_next;
+				if (_preg_next)
+					_preg_next->_preg_prev = _preg_prev;
+			}
+			if (_pslabs) {
+#if MEM_DEBUG
+				for (uint32_t i = 0; i < _utop; i++) {
+					if (_pslabs[i].ptags)
+						delete[] _pslabs[i].ptags;
+				}
+#endif
+				::free(_pslabs);
+				_pslabs = nullptr;
+			}
+			if (_preserve) {
+#ifdef _WIN32
+				VirtualFree(_preserve, 0, MEM_RELEASE);
+#else
+				munmap(_preserve, _ucap + MEM_SLAB_SIZE);
+#endif
+				_preserve = nullptr;
+			}
+		}
+		bool set_cap(size_t ucap) // set slabs capacity in bytes before first use
+		{
+			if (_preserve)
+				return false;
+			_ucap = (ucap + MEM_SLAB_SIZE - 1) & ~(MEM_SLAB_SIZE - 1);
+			return true;
 		}
-		void *mem_malloc(size_t size)
+		/*!
+		\brief set arena options and reserve the address space now, call before first use and after set_cap
+		\param uflags MEM_ARENA_XXX, windows ignore
+		\param uprefault bytes from the arena head touched now, these slabs are never returned to the OS
+		\param nnumanode prefer NUMA node for the pages, -1 none
+		\return false if already reserved or reserve failed
+		*/
+		bool set_arena(uint32_t uflags, size_t uprefault = 0, int nnumanode = -1)
 		{
 			unique_lock lck(_pmutex);
-			void* pr = nullptr;
-			if (size <= _sz_s) {
-				if (_stks.pop(pr))
-					return pr;
-			}
-			else if (size <= _sz_m)	{
-				if (!_pm)
-					malloc_block(_sz_m, _blk_m, _pm, _stkm);
-				if (_stkm.pop(pr))
-					return pr;
+			if (_preserve)
+				return false;
+			_uarena = uflags;
+			_uprefault = uprefault;
+			_nnumanode = nnumanode;
+			return reserve();
+		}
+		inline bool is_hugetlb() const
+		{
+			return _bhugetlb;
+		}
+		/*!
+		\brief enable per thread magazine cache, call before the memory is shared by threads
+		\param umagsize blocks exchanged with the slabs at one time, one thread caches at most 2*umagsize blocks per size class,
+			and not more than 2*MEM_TLCACHE_BYTES bytes for big size classes
+		\return false if already enabled or the address space can not be reserved
+		\remark the address space is reserved here, so the lock free path only reads fixed slab range.
+		blocks freed by other threads go into the freeing thread's cache, cache of exited thread is returned to the slabs.
+		*/
+		bool set_tlcache(size_t umagsize)
+		{
+			if (_umag || !umagsize)
+				return false;
+			{
+				unique_lock lck(_pmutex);
+				if (!reserve())
+					return false;
 			}
-			else if (size <= _sz_l)	{
-				if (!_pl)
-					malloc_block(_sz_l, _blk_l, _pl, _stkl);
-				if (_stkl.pop(pr))
-					return pr;
+			std::unique_lock<std::mutex> lck(reg_mutex());
+			_umag = umagsize;
+			_userial = ++reg_serial();
+			_preg_prev = nullptr;
+			_preg_next = reg_head();
+			if (_preg_next)
+				_preg_next->_preg_prev = this;
+			reg_head() = this;
+			return true;
+		}
+		void tlcache_flush() // return current thread's cached blocks to the slabs
+		{
+			if (!_umag)
+				return;
+			t_tlslots& ts = tlslots();
+			for (int i = 0; i < MEM_TLCACHE_SLOTS; i++) {
+				if (ts.pc[i] && ts.pc[i]->powner == this && ts.pc[i]->userial == _userial) {
+					tlc_flush(ts.pc[i]);
+					break;
+				}
 			}
-			return ::malloc(size);
+		}
+		MEM_NOINLINE void *mem_malloc(size_t size)
+		{
+			size_t zout;
+			return do_malloc(size, zout, MEM_CALLSITE());
+		}
+		MEM_NOINLINE void *malloc(size_t size, size_t &outsize)
+		{
+			return do_malloc(size, outsize, MEM_CALLSITE());
 		}
 		void mem_free(void *pmem)
 		{
 			if (!pmem)
 				return;
+#if MEM_DEBUG
+			untag(pmem);
+#endif
+			if (_umag) {
+				if (!inslab(pmem)) {
+					_ufallback_free.fetch_add(1, std::memory_order_relaxed);
+					::free(pmem);
+					return;
+				}
+				if (tlc_push(pmem))
+					return;
+			}
 			unique_lock lck(_pmutex);
-			size_t pa = (size_t)pmem;
-			if (_ps && pa >= (size_t)_ps  && pa < (size_t)_ps + _sz_s * _blk_s)
-				_stks.push(pmem);
-			else if (_pm &&  pa >= (size_t)_pm  && pa < (size_t)_pm + _sz_m * _blk_m)
-				_stkm.push(pmem);
-			else if (_pl &&  pa >= (size_t)_pl  && pa < (size_t)_pl + _sz_l* _blk_l)
-				_stkl.push(pmem);
-			else
-				free(pmem);
+			if (inslab(pmem)) {
+				_cls[_pslabs[((uint8_t*)pmem - _pbase) >> MEM_SLAB_BITS].uclass].ufree++;
+				free_blk(pmem);
+			}
+			else {
+				_ufallback_free.fetch_add(1, std::memory_order_relaxed);
+				::free(pmem);
+			}
 		}
-
-		void *malloc(size_t size,size_t &outsize)
+		void stat(t_stat &st) // snapshot
 		{
 			unique_lock lck(_pmutex);
-			void* pr = nullptr;
-			if (size <= _sz_s) {
-				if (_stks.pop(pr)) {
-					outsize = _sz_s;
-					return pr;
+			st.ufallback = _ufallback.load(std::memory_order_relaxed);
+			st.ufallback_bytes = _ufallback_bytes.load(std::memory_order_relaxed);
+			st.ufallback_free = _ufallback_free.load(std::memory_order_relaxed);
+			st.ucapfull = _ucapfull.load(std::memory_order_relaxed);
+			st.ufailed = _ufailed.load(std::memory_order_relaxed);
+			st.ubytes = _ubytes;
+			st.upeakbytes = _upeakbytes;
+			st.uslabs = _uslabsout;
+			st.upeakslabs = _upeakslabs;
+			st.umaxslabs = (uint32_t)(_ucap >> MEM_SLAB_BITS);
+			for (int i = 0; i < MEM_CLASSES; i++) {
+				st.cls[i].usize = _cls[i].usize;
+				st.cls[i].ualloc = _cls[i].ualloc;
+				st.cls[i].ufree = _cls[i].ufree;
+				st.cls[i].uout = _cls[i].uout;
+				st.cls[i].upeak = _cls[i].upeak;
+				st.cls[i].uslabs = _cls[i].uslabs;
+			}
+		}
+#if MEM_DEBUG
+		/*!
+		\brief group blocks not freed by call site, the site is the return address of mem_malloc/malloc, use addr2line to locate
+		\param fun void fun(uintptr_t site, size_t blocks, size_t bytes), called in bytes descending order
+		\return blocks not freed
+		\remark blocks allocated or freed by other threads at the same time may be missed or counted
+		*/
+		template<class _Fun>
+		size_t leak_dump(_Fun fun)
+		{
+			std::unordered_map<uintptr_t, std::pair<size_t, size_t>> sites;
+			size_t ublks = 0;
+			{
+				unique_lock lck(_pmutex);
+				for (uint32_t i = 0; i < _utop; i++) {
+					t_slab& s = _pslabs[i];
+					if (!s.ptags)
+						continue;
+					for (uint32_t k = 0; k < s.ucarved; k++) {
+						uintptr_t u = s.ptags[k].load(std::memory_order_relaxed);
+						if (u) {
+							std::pair<size_t, size_t>& v = sites[u];
+							v.first++;
+							v.second += _cls[s.uclass].usize;
+							ublks++;
+						}
+					}
 				}
 			}
-			else if (size <= _sz_m) {
-				if (!_pm)
-					malloc_block(_sz_m, _blk_m, _pm, _stkm);
-				if (_stkm.pop(pr)) {
-					outsize = _sz_m;
-					return pr;
+			{
+				std::unique_lock<std::mutex> lck(_dbglock);
+				for (auto& i : _dbgmap) {
+					std::pair<size_t, size_t>& v = sites[i.second.first];
+					v.first++;
+					v.second += i.second.second;
+					ublks++;
 				}
 			}
-			else if (size <= _sz_l) {
-				if (!_pl)
-					malloc_block(_sz_l, _blk_l, _pl, _stkl);
-				if (_stkl.pop(pr)) {
-					outsize = _sz_l;
+			std::vector<std::pair<uintptr_t, std::pair<size_t, size_t>>> vs(sites.begin(), sites.end());
+			std::sort(vs.begin(), vs.end(), [](const std::pair<uintptr_t, std::pair<size_t, size_t>>& a, const std::pair<uintptr_t, std::pair<size_t, size_t>>& b) {
+				return a.second.second > b.second.second;
+			});
+			for (auto& i : vs)
+				fun(i.first, i.second.first, i.second.second);
+			return ublks;
+		}
+#endif
+		static inline int class_index(size_t size) // -1 if size > MEM_MAX_BLKSIZE
+		{
+			if (size <= 64)
+				return size ? (int)((size - 1) >> 4) : 0;
+			if (size > MEM_MAX_BLKSIZE)
+				return -1;
+			int b = highbit(size - 1); // size in (2^b, 2^(b+1)]
+			return 4 + (b - 6) * 4 + (int)((size - 1 - ((size_t)1 << b)) >> (b - 2));
+		}
+		static inline size_t class_size(int nc)
+		{
+			if (nc < 4)
+				return (size_t)(nc + 1) * 16;
+			int b = 6 + (nc - 4) / 4;
+			return ((size_t)1 << b) + (size_t)((nc - 4) % 4 + 1) * ((size_t)1 << (b - 2));
+		}
+	private:
+		void* do_malloc(size_t size, size_t &outsize, uintptr_t usite)
+		{
+#if !MEM_DEBUG
+			(void)usite;
+#endif
+			void* pr = nullptr;
+			int nc = class_index(size);
+			if (nc >= 0) {
+				if (_umag)
+					pr = tlc_pop(nc);
+				if (!pr) {
+					unique_lock lck(_pmutex);
+					pr = alloc_blk(nc);
+					if (pr)
+						_cls[nc].ualloc++;
+					else
+						_ucapfull.fetch_add(1, std::memory_order_relaxed);
+				}
+				if (pr) {
+					outsize = _cls[nc].usize;
+#if MEM_DEBUG
+					tag(pr, size, usite);
+#endif
 					return pr;
 				}
 			}
-			outsize = size;
 			pr = ::malloc(size);
-			if (!pr)
-				outsize = 0;
+			if (pr) {
+				_ufallback.fetch_add(1, std::memory_order_relaxed);
+				_ufallback_bytes.fetch_add(size, std::memory_order_relaxed);
+#if MEM_DEBUG
+				tag(pr, size, usite);
+#endif
+			}
+			else
+				_ufailed.fetch_add(1, std::memory_order_relaxed);
+			outsize = pr ? size : 0;
 			return pr;
 		}
-	private:		
-		void *_ps, *_pm, *_pl;
+		struct t_slab {
+			uint32_t uclass;
+			uint32_t uprev, unext; // partial list of class, unext also for free slab list
+			uint32_t uused;   // blocks out, include blocks in thread caches
+			uint32_t ucarved; // blocks carved from slab head, never touch the rest pages
+			void* pfree;      // freed blocks list
+#if MEM_DEBUG
+			std::atomic<uintptr_t>* ptags; // call site of blocks out
+#endif
+		};
+		struct t_class {
+			size_t usize;
+			uint32_t ublks;    // blocks per slab
+			uint32_t upartial; // slabs with free blocks
+			uint32_t uempty;   // keep one empty slab, release others
+			uint64_t ualloc, ufree;
+			uint32_t uout, upeak, uslabs;
+		};
 		std::mutex* _pmutex;
-		size_t _sz_s, _sz_m, _sz_l;  //blocks size
-		size_t _blk_s, _blk_m, _blk_l; // blocks number
-		ec::stack<void*> _stks;     // small memory blocks
-		ec::stack<void*> _stkm; // medium memory blocks
-		ec::stack<void*> _stkl; // large memory blocks		
+		void* _preserve;  // reserved address space
+		uint8_t* _pbase;  // slab aligned base
+		size_t _ucap;     // capacity in bytes
+		t_slab* _pslabs;
+		uint32_t _uslabs;    // max slabs
+		uint32_t _utop;      // slabs used ever
+		uint32_t _ufreeslab; // released slabs list
+		t_class _cls[MEM_CLASSES];
+		size_t _umag; // magazine size, 0 no thread cache
+		uint64_t _userial; // distinguish objects reuse the same address
+		memory *_preg_prev, *_preg_next; // live objects with thread cache
+
+		size_t _ubytes, _upeakbytes; // out of slabs
+		uint32_t _uslabsout, _upeakslabs;
+		std::atomic<uint64_t> _ufallback, _ufallback_bytes, _ufallback_free, _ucapfull, _ufailed;
+		uint32_t _uarena;   // MEM_ARENA_XXX
+		size_t _uprefault;  // bytes touched at reserve
+		int _nnumanode;     // -1 none
+		bool _bhugetlb;     // mapped with hugetlb pages
+		uint32_t _ukeepslabs; // prefaulted slabs, not return to OS
+#if MEM_DEBUG
+		std::mutex _dbglock;
+		std::unordered_map<void*, std::pair<uintptr_t, size_t>> _dbgmap; // fallback blocks, site and size
+
+		void tag(void* p, size_t size, uintptr_t usite)
+		{
+			if (inslab(p)) {
+				size_t off = (uint8_t*)p - _pbase;
+				t_slab& s = _pslabs[off >> MEM_SLAB_BITS];
+				s.ptags[(off & (MEM_SLAB_SIZE - 1)) / _cls[s.uclass].usize].store(usite ? usite : 1, std::memory_order_relaxed);
+				return;
+			}
+			std::unique_lock<std::mutex> lck(_dbglock);
+			_dbgmap[p] = std::pair<uintptr_t, size_t>(usite ? usite : 1, size);
+		}
+		void untag(void* p)
+		{
+			if (inslab(p)) {
+				size_t off = (uint8_t*)p - _pbase;
+				t_slab& s = _pslabs[off >> MEM_SLAB_BITS];
+				s.ptags[(off & (MEM_SLAB_SIZE - 1)) / _cls[s.uclass].usize].store(0, std::memory_order_relaxed);
+				return;
+			}
+			std::unique_lock<std::mutex> lck(_dbglock);
+			_dbgmap.erase(p);
+		}
+#endif
+
+		static inline int highbit(size_t v) // v > 0
+		{
+#ifdef _WIN32
+			unsigned long n;
+#	ifdef _WIN64
+			_BitScanReverse64(&n, v);
+#	else
+			_BitScanReverse(&n, (unsigned long)v);
+#	endif
+			return (int)n;
+#else
+			return (int)(sizeof(unsigned long long) * 8 - 1) - __builtin_clzll((unsigned long long)v);
+#endif
+		}
+		inline bool inslab(void* p) const
+		{
+			return _pbase && (uint8_t*)p >= _pbase && (uint8_t*)p < _pbase + ((size_t)_uslabs << MEM_SLAB_BITS);
+		}
+		bool reserve() // lock before call
+		{
+			if (_preserve)
+				return true;
+			if (!_ucap)
+				return false;
+#ifdef _WIN32
+			if (_nnumanode >= 0)
+				_preserve = VirtualAllocExNuma(GetCurrentProcess(), NULL, _ucap + MEM_SLAB_SIZE, MEM_RESERVE, PAGE_READWRITE, (DWORD)_nnumanode);
+			else
+				_preserve = VirtualAlloc(NULL, _ucap + MEM_SLAB_SIZE, MEM_RESERVE, PAGE_READWRITE);
+#else
+			_preserve = MAP_FAILED;
+#	ifdef MAP_HUGETLB
+			if (_uarena & MEM_ARENA_HUGETLB) { // no MAP_NORESERVE, fail here rather than SIGBUS when pages used up
+				_preserve = mmap(nullptr, _ucap + MEM_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				_bhugetlb = MAP_FAILED != _preserve;
+			}
+#	endif
+			if (MAP_FAILED == _preserve)
+				_preserve = mmap(nullptr, _ucap + MEM_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (MAP_FAILED == _preserve)
+				_preserve = nullptr;
+#endif
+			if (_preserve)
+				_pslabs = (t_slab*)::malloc(sizeof(t_slab) * (_ucap >> MEM_SLAB_BITS));
+			if (!_pslabs) {
+				if (_preserve) {
+#ifdef _WIN32
+					VirtualFree(_preserve, 0, MEM_RELEASE);
+#else
+					munmap(_preserve, _ucap + MEM_SLAB_SIZE);
+#endif
+					_preserve = nullptr;
+				}
+				_ucap = 0; // use ::malloc only
+				return false;
+			}
+			_uslabs = (uint32_t)(_ucap >> MEM_SLAB_BITS);
+#if MEM_DEBUG
+			for (uint32_t i = 0; i < _uslabs; i++)
+				_pslabs[i].ptags = nullptr;
+#endif
+			_pbase = (uint8_t*)(((size_t)_preserve + MEM_SLAB_SIZE - 1) & ~(MEM_SLAB_SIZE - 1));
+#ifndef _WIN32
+#	ifdef MADV_HUGEPAGE
+			if ((_uarena & MEM_ARENA_HUGEPAGE) && !_bhugetlb)
+				madvise(_pbase, _ucap, MADV_HUGEPAGE);
+#	endif
+#	ifdef SYS_mbind
+			if (_nnumanode >= 0 && _nnumanode < (int)sizeof(unsigned long) * 8) {
+				unsigned long umask = 1UL << _nnumanode;
+				syscall(SYS_mbind, _pbase, _ucap, 1, &umask, sizeof(umask) * 8 + 1, 0); // MPOL_PREFERRED
+			}
+#	endif
+#endif
+			if (_uprefault) {
+				size_t i, n = (_uprefault + MEM_SLAB_SIZE - 1) & ~(MEM_SLAB_SIZE - 1);
+				if (n > _ucap)
+					n = _ucap;
+#ifdef _WIN32
+				if (!VirtualAlloc(_pbase, n, MEM_COMMIT, PAGE_READWRITE))
+					n = 0;
+#endif
+				for (i = 0; i < n; i += 4096)
+					((volatile uint8_t*)_pbase)[i] = 0;
+				_ukeepslabs = (uint32_t)(n >> MEM_SLAB_BITS);
+			}
+			return true;
+		}
+		void partial_link(t_class& c, uint32_t is)
+		{
+			_pslabs[is].uprev = MEM_NIL;
+			_pslabs[is].unext = c.upartial;
+			if (MEM_NIL != c.upartial)
+				_pslabs[c.upartial].uprev = is;
+			c.upartial = is;
+		}
+		void partial_unlink(t_class& c, uint32_t is)
+		{
+			t_slab& s = _pslabs[is];
+			if (MEM_NIL != s.uprev)
+				_pslabs[s.uprev].unext = s.unext;
+			else
+				c.upartial = s.unext;
+			if (MEM_NIL != s.unext)
+				_pslabs[s.unext].uprev = s.uprev;
+		}
+		uint32_t new_slab(int nc)
+		{
+			uint32_t is;
+			if (!reserve())
+				return MEM_NIL;
+			if (MEM_NIL != _ufreeslab) {
+				is = _ufreeslab;
+				_ufreeslab = _pslabs[is].unext;
+			}
+			else if (_utop < _uslabs)
+				is = _utop++;
+			else
+				return MEM_NIL; // capacity used up
+#ifdef _WIN32
+			if (!VirtualAlloc(_pbase + ((size_t)is << MEM_SLAB_BITS), MEM_SLAB_SIZE, MEM_COMMIT, PAGE_READWRITE)) {
+				_pslabs[is].unext = _ufreeslab;
+				_ufreeslab = is;
+				return MEM_NIL;
+			}
+#endif
+			t_slab& s = _pslabs[is];
+#if MEM_DEBUG
+			s.ptags = new std::atomic<uintptr_t>[_cls[nc].ublks];
+			for (uint32_t i = 0; i < _cls[nc].ublks; i++)
+				s.ptags[i].store(0, std::memory_order_relaxed);
+#endif
+			s.uclass = (uint32_t)nc;
+			s.uused = 0;
+			s.ucarved = 0;
+			s.pfree = nullptr;
+			partial_link(_cls[nc], is);
+			_cls[nc].uslabs++;
+			if (++_uslabsout > _upeakslabs)
+				_upeakslabs = _uslabsout;
+			return is;
+		}
+		void release_slab(t_class& c, uint32_t is) // return pages to OS, except prefaulted slabs
+		{
+			partial_unlink(c, is);
+			uint8_t* p = _pbase + ((size_t)is << MEM_SLAB_BITS);
+			if (is >= _ukeepslabs) {
+#ifdef _WIN32
+				VirtualFree(p, MEM_SLAB_SIZE, MEM_DECOMMIT);
+#else
+				madvise(p, MEM_SLAB_SIZE, MADV_DONTNEED);
+#endif
+			}
+#if MEM_DEBUG
+			delete[] _pslabs[is].ptags;
+			_pslabs[is].ptags = nullptr;
+#endif
+			c.uslabs--;
+			_uslabsout--;
+			_pslabs[is].unext = _ufreeslab;
+			_ufreeslab = is;
+		}
+		void* alloc_blk(int nc) // lock before call
+		{
+			t_class& c = _cls[nc];
+			uint32_t is = c.upartial;
+			if (MEM_NIL == is && MEM_NIL == (is = new_slab(nc)))
+				return nullptr;
+			t_slab& s = _pslabs[is];
+			void* p = s.pfree;
+			if (p)
+				s.pfree = *(void**)p;
+			else
+				p = _pbase + ((size_t)is << MEM_SLAB_BITS) + (size_t)s.ucarved++ * c.usize;
+			if (c.uempty == is)
+				c.uempty = MEM_NIL;
+			if (++s.uused == c.ublks)
+				partial_unlink(c, is);
+			if (++c.uout > c.upeak)
+				c.upeak = c.uout;
+			_ubytes += c.usize;
+			if (_ubytes > _upeakbytes)
+				_upeakbytes = _ubytes;
+			return p;
+		}
+		void free_blk(void* p) // lock before call
+		{
+			uint32_t is = (uint32_t)(((uint8_t*)p - _pbase) >> MEM_SLAB_BITS);
+			t_slab& s = _pslabs[is];
+			t_class& c = _cls[s.uclass];
+			*(void**)p = s.pfree;
+			s.pfree = p;
+			c.uout--;
+			_ubytes -= c.usize;
+			if (s.uused-- == c.ublks)
+				partial_link(c, is);
+			if (!s.uused) {
+				if (MEM_NIL == c.uempty)
+					c.uempty = is;
+				else
+					release_slab(c, is);
+			}
+		}
 
-		bool malloc_block(size_t blksize, size_t blknum, void * &ph, ec::stack<void*> &stk)
+		struct t_tlcache {
+			memory* powner;
+			uint64_t userial;
+			size_t umag;
+			uint32_t uhalf[MEM_CLASSES]; // half magazine size
+			uint32_t un[MEM_CLASSES];    // cached blocks
+			uint32_t ualloc[MEM_CLASSES], ufree[MEM_CLASSES]; // not added to class counters
+			void** pmag[MEM_CLASSES];    // capacity 2 * uhalf
+		};
+		class t_tlslots // per thread
+		{
+		public:
+			t_tlcache* pc[MEM_TLCACHE_SLOTS];
+			t_tlslots()
+			{
+				memset(pc, 0, sizeof(pc));
+			}
+			~t_tlslots()
+			{
+				std::unique_lock<std::mutex> lck(reg_mutex()); // keep owner alive while flush
+				for (int i = 0; i < MEM_TLCACHE_SLOTS; i++) {
+					if (!pc[i])
+						continue;
+					if (alive(pc[i]))
+						pc[i]->powner->tlc_flush(pc[i]);
+					::free(pc[i]);
+					pc[i] = nullptr;
+				}
+			}
+		};
+		static t_tlslots& tlslots()
+		{
+			static thread_local t_tlslots ts;
+			return ts;
+		}
+		static std::mutex& reg_mutex()
+		{
+			static std::mutex m;
+			return m;
+		}
+		static memory*& reg_head()
+		{
+			static memory* p = nullptr;
+			return p;
+		}
+		static uint64_t& reg_serial()
+		{
+			static uint64_t u = 0;
+			return u;
+		}
+		static bool alive(const t_tlcache* pc) // lock reg_mutex before call
+		{
+			for (memory* p = reg_head(); p; p = p->_preg_next) {
+				if (p == pc->powner && p->_userial == pc->userial)
+					return true;
+			}
+			return false;
+		}
+		t_tlcache* tlcache()
 		{
-			if (!blknum || !blksize)
+			t_tlslots& ts = tlslots();
+			for (int i = 0; i < MEM_TLCACHE_SLOTS; i++) {
+				if (ts.pc[i] && ts.pc[i]->powner == this && ts.pc[i]->userial == _userial)
+					return ts.pc[i];
+			}
+			std::unique_lock<std::mutex> lck(reg_mutex()); // first use in this thread, bind a free or stale slot
+			int n = -1;
+			for (int i = 0; i < MEM_TLCACHE_SLOTS; i++) {
+				if (!ts.pc[i] || !alive(ts.pc[i])) {
+					n = i;
+					break;
+				}
+			}
+			if (n < 0)
+				return nullptr; // all slots used by live objects, use locked path
+			t_tlcache* pc = ts.pc[n]; // blocks in stale cache were freed with the owner
+			if (pc && pc->umag != _umag) {
+				::free(pc);
+				pc = ts.pc[n] = nullptr;
+			}
+			uint32_t uhalf[MEM_CLASSES];
+			size_t i, utotal = 0;
+			for (i = 0; i < MEM_CLASSES; i++) {
+				size_t u = MEM_TLCACHE_BYTES / _cls[i].usize;
+				uhalf[i] = (uint32_t)(u > _umag ? _umag : (u ? u : 1));
+				utotal += uhalf[i] * 2;
+			}
+			if (!pc) {
+				pc = (t_tlcache*)::malloc(sizeof(t_tlcache) + sizeof(void*) * utotal);
+				if (!pc)
+					return nullptr;
+				ts.pc[n] = pc;
+			}
+			pc->powner = this;
+			pc->userial = _userial;
+			pc->umag = _umag;
+			void** pm = (void**)(pc + 1);
+			for (i = 0; i < MEM_CLASSES; i++) {
+				pc->uhalf[i] = uhalf[i];
+				pc->un[i] = 0;
+				pc->ualloc[i] = 0;
+				pc->ufree[i] = 0;
+				pc->pmag[i] = pm;
+				pm += uhalf[i] * 2;
+			}
+			return pc;
+		}
+		void* tlc_pop(int nc)
+		{
+			t_tlcache* pc = tlcache();
+			if (!pc)
+				return nullptr;
+			if (!pc->un[nc]) { // refill half magazine
+				unique_lock lck(_pmutex);
+				tlc_count(pc, nc);
+				void* p;
+				while (pc->un[nc] < pc->uhalf[nc] && nullptr != (p = alloc_blk(nc)))
+					pc->pmag[nc][pc->un[nc]++] = p;
+				if (!pc->un[nc])
+					return nullptr;
+			}
+			pc->ualloc[nc]++;
+			return pc->pmag[nc][--pc->un[nc]];
+		}
+		bool tlc_push(void* pmem)
+		{
+			t_tlcache* pc = tlcache();
+			if (!pc)
 				return false;
-			size_t i;
-			ph = ::malloc(blksize * blknum);
-			if (ph)	{
-				uint8_t *p = (uint8_t *)ph;
-				for (i = 0; i < blknum; i++)
-					stk.add(p + (blknum - 1 - i) * blksize);
+			uint32_t nc = _pslabs[((uint8_t*)pmem - _pbase) >> MEM_SLAB_BITS].uclass; // fixed while block is out
+			if (pc->un[nc] >= pc->uhalf[nc] * 2) { // return the older half, keep the hot blocks
+				unique_lock lck(_pmutex);
+				tlc_count(pc, nc);
+				for (uint32_t i = 0; i < pc->uhalf[nc]; i++)
+					free_blk(pc->pmag[nc][i]);
+				memmove(pc->pmag[nc], pc->pmag[nc] + pc->uhalf[nc], sizeof(void*) * pc->uhalf[nc]);
+				pc->un[nc] = pc->uhalf[nc];
+			}
+			pc->pmag[nc][pc->un[nc]++] = pmem;
+			pc->ufree[nc]++;
+			return true;
+		}
+		inline void tlc_count(t_tlcache* pc, uint32_t nc) // lock before call
+		{
+			_cls[nc].ualloc += pc->ualloc[nc];
+			_cls[nc].ufree += pc->ufree[nc];
+			pc->ualloc[nc] = 0;
+			pc->ufree[nc] = 0;
+		}
+		void tlc_flush(t_tlcache* pc)
+		{
+			unique_lock lck(_pmutex);
+			for (int nc = 0; nc < MEM_CLASSES; nc++) {
+				tlc_count(pc, nc);
+				while (pc->un[nc])
+					free_blk(pc->pmag[nc][--pc->un[nc]]);
 			}
-			return ph != nullptr;
 		}
 	};
 
@@ -208,4 +896,179 @@ namespace ec {
 			return _pbuf;
 		}
 	};
+
+	/*!
+	\brief bump allocator for temporary buffers of one thread, alloc move a pointer, no free.
+	reset() after each request give all back in O(1), the first block is kept for next request.
+	when one request overflow the first block, reset replace the chain with one larger block up to MEM_SCRATCH_MAXKEEP.
+	*/
+	class scratch_arena
+	{
+	public:
+		scratch_arena(memory* pmem = nullptr, size_t blksize = MEM_SCRATCH_BLKSIZE) : _pmem(pmem), _phead(nullptr), _ublksize(blksize), _uoverflow(0)
+		{
+		}
+		~scratch_arena()
+		{
+			free_chain(_phead);
+			_phead = nullptr;
+		}
+		void* alloc(size_t size) // align 16, return nullptr if no memory
+		{
+			size = (size + 15) & ~(size_t)15;
+			if (_phead && _phead->usize - _phead->upos >= size) {
+				void* pr = _phead->data() + _phead->upos;
+				_phead->upos += size;
+				return pr;
+			}
+			size_t zblk = _phead ? _ublksize : (_ublksize > size ? _ublksize : size);
+			if (zblk < size)
+				zblk = size;
+			t_blk* pb = new_blk(zblk);
+			if (!pb)
+				return nullptr;
+			if (_phead)
+				_uoverflow += size;
+			pb->pnext = _phead;
+			pb->upos = size;
+			_phead = pb;
+			return pb->data();
+		}
+		void reset()
+		{
+			if (!_phead)
+				return;
+			if (!_phead->pnext) {
+				_phead->upos = 0;
+				return;
+			}
+			size_t zkeep = _ublksize + _uoverflow;
+			_uoverflow = 0;
+			if (zkeep > MEM_SCRATCH_MAXKEEP)
+				zkeep = MEM_SCRATCH_MAXKEEP;
+			t_blk* pfirst = _phead;
+			while (pfirst->pnext)
+				pfirst = pfirst->pnext;
+			if (pfirst->usize >= zkeep) { // keep the first block
+				t_blk* p = _phead;
+				while (p != pfirst) {
+					t_blk* pn = p->pnext;
+					free_blk(p);
+					p = pn;
+				}
+				pfirst->upos = 0;
+				_phead = pfirst;
+				return;
+			}
+			free_chain(_phead);
+			_ublksize = zkeep;
+			_phead = new_blk(zkeep);
+			if (_phead)
+				_phead->pnext = nullptr;
+		}
+		/*!
+		\brief the arena of current thread, set by worker threads before handle events.
+		\return nullptr in other threads, then use memory
+		*/
+		static scratch_arena*& current()
+		{
+			static thread_local scratch_arena* p = nullptr;
+			return p;
+		}
+	private:
+		struct t_blk {
+			t_blk* pnext;
+			size_t usize; // data size
+			size_t upos;
+			size_t ures;  // keep data align 16
+			inline uint8_t* data() {
+				return (uint8_t*)(this + 1);
+			}
+		};
+		memory* _pmem;
+		t_blk* _phead; // current block, pnext to older blocks
+		size_t _ublksize;
+		size_t _uoverflow; // bytes allocated out of the first block after last reset
+	private:
+		t_blk* new_blk(size_t size)
+		{
+			size_t zout = sizeof(t_blk) + size;
+			t_blk* pb = (t_blk*)(_pmem ? _pmem->malloc(sizeof(t_blk) + size, zout) : ::malloc(zout));
+			if (!pb)
+				return nullptr;
+			pb->pnext = nullptr;
+			pb->usize = zout - sizeof(t_blk);
+			pb->upos = 0;
+			return pb;
+		}
+		inline void free_blk(t_blk* pb)
+		{
+			if (_pmem)
+				_pmem->mem_free(pb);
+			else
+				::free(pb);
+		}
+		void free_chain(t_blk* pb)
+		{
+			while (pb) {
+				t_blk* pn = pb->pnext;
+				free_blk(pb);
+				pb = pn;
+			}
+		}
+	};
+
+	/*!
+	\brief immutable reference counted buffer, header and data in one block from memory.
+	encode one message then post to many ucids, each queued package hold one reference, released when send complete
+	*/
+	class shared_buffer
+	{
+	public:
+		static shared_buffer* create(memory* pmem, const void* pd, size_t size) // pd nullptr: fill data() before post, refcount 1
+		{
+			size_t zout;
+			void* p = pmem ? pmem->malloc(sizeof(shared_buffer) + size, zout) : ::malloc(sizeof(shared_buffer) + size);
+			if (!p)
+				return nullptr;
+			shared_buffer* pb = new(p) shared_buffer(pmem, size);
+			if (pd && size)
+				memcpy(pb->data(), pd, size);
+			return pb;
+		}
+		static inline shared_buffer* from_data(void* pd)
+		{
+			return (shared_buffer*)pd - 1;
+		}
+		inline uint8_t* data()
+		{
+			return (uint8_t*)(this + 1);
+		}
+		inline size_t size() const
+		{
+			return _size;
+		}
+		inline void addref()
+		{
+			_nref.fetch_add(1, std::memory_order_relaxed);
+		}
+		void release()
+		{
+			if (1 != _nref.fetch_sub(1, std::memory_order_acq_rel))
+				return;
+			memory* pmem = _pmem;
+			this->~shared_buffer();
+			if (pmem)
+				pmem->mem_free(this);
+			else
+				::free(this);
+		}
+	private:
+		shared_buffer(memory* pmem, size_t size) : _pmem(pmem), _nref(1), _size(size)
+		{
+		}
+		memory* _pmem;
+		std::atomic<uint32_t> _nref;
+		size_t _size;
+	};
 }
\ No newline at end of file
@@ -0,0 +1,209 @@
+﻿/*!
+\file c11_mpmc.h
+\author	jiangyong
+\email  kipway@outlook.com
+\update 2018.8.12
+
+bounded lock-free multi-producer multi-consumer queue for windows & linux.
+Dmitry Vyukov's array queue, capacity is power of 2. consumers spin first then park,
+producers only notify when there are parked consumers.
+
+class mpmc_queue
+
+eclib Copyright (c) 2017-2018, kipway
+source repository : https://github.com/kipway/eclib
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#ifndef MPMC_CACHELINE_SIZE
+#	define MPMC_CACHELINE_SIZE 64
+#endif
+
+#ifndef MPMC_SPIN_COUNT
+#	define MPMC_SPIN_COUNT 256 // spin times before park
+#endif
+
+namespace ec
+{
+	template<class _Ty>
+	class mpmc_queue
+	{
+	public:
+		typedef _Ty	value_type;
+		mpmc_queue(size_t usize) : _pcells(nullptr), _umask(0), _nwaiters(0)
+		{
+			size_t n = 2;
+			while (n < usize)
+				n <<= 1;
+			_pcells = new t_cell[n];
+			if (_pcells) {
+				_umask = n - 1;
+				for (size_t i = 0; i < n; i++)
+					_pcells[i].seq.store(i, std::memory_order_relaxed);
+			}
+			_utail.store(0, std::memory_order_relaxed);
+			_uhead.store(0, std::memory_order_relaxed);
+		}
+		~mpmc_queue()
+		{
+			if (_pcells) {
+				delete[] _pcells;
+				_pcells = nullptr;
+			}
+		}
+	private:
+		struct t_cell {
+			std::atomic<size_t> seq;
+			value_type data;
+		};
+		t_cell* _pcells;
+		size_t _umask;
+		char _pad0[MPMC_CACHELINE_SIZE];
+		std::atomic<size_t> _utail; // add position
+		char _pad1[MPMC_CACHELINE_SIZE];
+		std::atomic<size_t> _uhead; // get position
+		char _pad2[MPMC_CACHELINE_SIZE];
+		std::atomic<int> _nwaiters; // parked consumers
+		std::mutex _mtx; // only for park
+		std::condition_variable _cv;
+	public:
+		inline size_t capacity() const noexcept
+		{
+			return _pcells ? _umask + 1 : 0;
+		}
+		bool empty() const noexcept
+		{
+			return _uhead.load(std::memory_order_acquire) >= _utail.load(std::memory_order_acquire);
+		}
+		size_t count() const noexcept
+		{
+			size_t t = _utail.load(std::memory_order_acquire), h = _uhead.load(std::memory_order_acquire);
+			return t > h ? t - h : 0;
+		}
+		bool try_add(const value_type &item) noexcept // return false if full
+		{
+			if (!_pcells)
+				return false;
+			t_cell* pc;
+			size_t pos = _utail.load(std::memory_order_relaxed);
+			for (;;) {
+				pc = &_pcells[pos & _umask];
+				size_t seq = pc->seq.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+				if (!dif) {
+					if (_utail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false; // full
+				else
+					pos = _utail.load(std::memory_order_relaxed);
+			}
+			pc->data = item;
+			pc->seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+		bool try_get(value_type &item) noexcept // return false if empty
+		{
+			if (!_pcells)
+				return false;
+			t_cell* pc;
+			size_t pos = _uhead.load(std::memory_order_relaxed);
+			for (;;) {
+				pc = &_pcells[pos & _umask];
+				size_t seq = pc->seq.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+				if (!dif) {
+					if (_uhead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false; // empty
+				else
+					pos = _uhead.load(std::memory_order_relaxed);
+			}
+			item = pc->data;
+			pc->seq.store(pos + _umask + 1, std::memory_order_release);
+			return true;
+		}
+		size_t try_get(value_type *pout, size_t n) noexcept // get max n items, return items number
+		{
+			size_t i = 0;
+			while (i < n && try_get(pout[i]))
+				i++;
+			return i;
+		}
+		/*!
+		\brief add and wake one parked consumer
+		\param waitmsec wait time when full, yield and sleep 1ms step
+		\return false if full after waitmsec
+		*/
+		bool add(const value_type &item, int waitmsec = 0)
+		{
+			int i = 0;
+			while (!try_add(item)) {
+				if (i >= waitmsec)
+					return false;
+				notify();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				i++;
+			}
+			std::atomic_thread_fence(std::memory_order_seq_cst); // publish before check _nwaiters
+			if (_nwaiters.load(std::memory_order_relaxed) > 0)
+				notify();
+			return true;
+		}
+		/*!
+		\brief get max n items, spin MPMC_SPIN_COUNT times then park until add or waitmsec timeout
+		\return items number
+		*/
+		size_t get(value_type *pout, size_t n, int waitmsec)
+		{
+			size_t nr;
+			for (int i = 0; i < MPMC_SPIN_COUNT; i++) {
+				nr = try_get(pout, n);
+				if (nr)
+					return nr;
+				if (i > MPMC_SPIN_COUNT / 2)
+					std::this_thread::yield();
+			}
+			std::unique_lock<std::mutex> lck(_mtx);
+			_nwaiters.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst); // check empty after add _nwaiters
+			nr = try_get(pout, n);
+			if (!nr) {
+				_cv.wait_for(lck, std::chrono::milliseconds(waitmsec));
+				nr = try_get(pout, n);
+			}
+			_nwaiters.fetch_sub(1, std::memory_order_relaxed);
+			return nr;
+		}
+		inline bool get(value_type &item, int waitmsec)
+		{
+			return get(&item, 1, waitmsec) > 0;
+		}
+		void notify()
+		{
+			std::unique_lock<std::mutex> lck(_mtx); // lock to avoid lost wakeup between check and wait
+			_cv.notify_one();
+		}
+	};
+}
@@ -2,13 +2,17 @@
 \file c11_rpc.h
 \author	jiangyong
 \email  kipway@outlook.com
-\update 2018.7.19
+\update 2018.8.19
 
 eclibe Asynchronous Remote Procedure Call  template class for windows & linux
 
 class AioRpcClient
 class AioRpcSrv
 class AioRpcSrvThread
+class rpc_pending
+class rpc_batch
+class rpc_lz4s
+class rpc_sendlock
 
 eclib Copyright (c) 2017-2018, kipway
 source repository : https://github.com/kipway/eclib
@@ -30,8 +34,11 @@ limitations under the License.
 #pragma once
 #include "c11_event.h"
 #include "c11_vector.h"
+#include "c11_iobuf.h"
 #include "c11_tcp.h"
 #include "c11_map.h"
+#include "c11_shardmap.h"
+#include "c11_compress.h"
 #include "c_crc32.h"
 #include "c_sha1.h"
 #include "c_lz4s.h"   //LZ4 src
@@ -47,7 +54,8 @@ namespace ec {
 		rpcmsg_sh = 1,  //handshake message
 		rpcmsg_request = 10, //client request
 		rpcmsg_put = 11,	 //server put
-		rpcmsg_response = 12 //server response
+		rpcmsg_response = 12, //server response
+		rpcmsg_batch = 13    //request, put or response messages coalesced in one frame
 	};
 
 	enum RPCCOMPRESS // compression
@@ -57,6 +65,8 @@ namespace ec {
 #ifdef RPC_USE_ZLIB
 		rpccomp_zlib = 2, //ZLIB
 #endif
+		rpccomp_lz4s = 3, //LZ4 stream with the history of the connection, negotiated in connect
+		rpccomp_lz4hc = 4 //LZ4HC for MakePkg only, the package is rpccomp_lz4
 	};
 
 	enum RPCUSRST // client status
@@ -77,12 +87,114 @@ namespace ec {
 		rpc_c_disconnected_msgerr = -5
 	};
 #define RPC_SYNC_BYTE 0xA9
+#define RPC_BATCH_HEAD 9 // head of one message in rpcmsg_batch frame, type(1),seqno(4),size(4), big-endian
+
+#ifndef RPC_LOGIN_TIMEOUT
+#	define RPC_LOGIN_TIMEOUT (60 * 1000) // default login timeout milliseconds of server, disconnect if not login
+#endif
+
+#ifndef RPC_MSGR_KEEPSIZE
+#	define RPC_MSGR_KEEPSIZE (16 * 1024) // message buffer kept by server worker, shrink to this after a larger message
+#endif
+
+#ifndef RPC_CALL_SLOTS
+#	define RPC_CALL_SLOTS 8192 // max async calls in flight per client, power of 2
+#endif
+
+#define RPC_CALL_SEQFLAG 0x80000000u // seqno of async rpc_call has the high bit, the seqno of rpc_request should not
+
+#ifndef RPC_CALL_TIMEOUT
+#	define RPC_CALL_TIMEOUT 5000 // default async call timeout milliseconds
+#endif
+
+#ifndef RPC_CALL_SWEEP_MSEC
+#	define RPC_CALL_SWEEP_MSEC 100 // async call timeout check interval milliseconds
+#endif
+
+#ifndef RPC_CRC32C
+#	define RPC_CRC32C 1 // negotiate CRC-32C for message data, hardware crc32 instruction on x86, 0 always CRC-32
+#endif
+
+#ifndef RPC_BATCH_MSGMAX
+#	define RPC_BATCH_MSGMAX 2048 // max message bytes coalesced to rpcmsg_batch frame, larger sent alone
+#endif
+
+#ifndef RPC_BATCH_DELAY
+#	define RPC_BATCH_DELAY 10 // default max milliseconds a coalesced message wait for flush
+#endif
+
+#ifndef RPC_LZ4HC_LEVEL
+#	define RPC_LZ4HC_LEVEL 9 // LZ4HC level when RPC_USE_LZ4HC defined(link lz4hc.c), large messages may use LZ4HC
+#endif
+
+#ifndef RPC_LZ4S_MINSIZE
+#	define RPC_LZ4S_MINSIZE 32 // min message bytes compressed by LZ4 stream, larger than LZ4S_BLOCK_MAX compressed alone
+#endif
+
+	enum RPC_CALL_ST // async call status
+	{
+		rpc_call_ok = 0,
+		rpc_call_timeout = -1,
+		rpc_call_disconnected = -2,
+		rpc_call_msgerr = -3
+	};
+	inline RPCCOMPRESS rpc_comp(int method) // COMPMETHOD to RPCCOMPRESS
+	{
+		switch (method) {
+		case comp_lz4:
+			return rpccomp_lz4;
+		case comp_lz4hc:
+			return rpccomp_lz4hc;
+#ifdef RPC_USE_ZLIB
+		case comp_zlib:
+			return rpccomp_zlib;
+#endif
+		default:
+			return rpccomp_none;
+		}
+	}
+	inline int rpc_comp_method(RPCCOMPRESS comp) // RPCCOMPRESS to COMPMETHOD
+	{
+		switch (comp) {
+		case rpccomp_lz4:
+		case rpccomp_lz4s:
+			return comp_lz4;
+		case rpccomp_lz4hc:
+			return comp_lz4hc;
+#ifdef RPC_USE_ZLIB
+		case rpccomp_zlib:
+			return comp_zlib;
+#endif
+		default:
+			return comp_none;
+		}
+	}
+	inline uint32_t rpc_comp_methods(bool bzlib) // COMP_MASK of the methods can be sent, bzlib: the peer can decode zlib
+	{
+		uint32_t u = COMP_MASK(comp_lz4);
+#ifdef RPC_USE_LZ4HC
+		u |= COMP_MASK(comp_lz4hc);
+#endif
+#ifdef RPC_USE_ZLIB
+		if (bzlib)
+			u |= COMP_MASK(comp_zlib);
+#else
+		(void)bzlib;
+#endif
+		return u;
+	}
+
+	inline int64_t rpc_comp_nowns() // steady clock nanoseconds, for the CPU cost of compression
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
 	struct t_rpcpkg // rpc package
 	{
 		unsigned char sync;      //start char,0xA9
 		char          type;      //msg type,
-		char          comp;      //compress,0:none;1:LZ4;2:ZLIB;
-		unsigned char cflag;     // D0=1: not encryption
+		char          comp;      //compress,0:none;1:LZ4;2:ZLIB;3:LZ4 stream
+		unsigned char cflag;     // D0=1: not encryption; D1=1: crc32msg is CRC-32C; D2=1: first block of LZ4 stream, reset decoder
 		unsigned int  seqno;     // msg seqno(big-endian)
 
 		unsigned int  size_en;   // encode size(big-endian)
@@ -118,6 +230,55 @@ namespace ec {
 		inline static  short NetShort(short v) { return (short)NetUShort(v); }
 	};
 
+	struct t_rpcbatchmsg // one message in rpcmsg_batch frame
+	{
+		RPCMSGTYPE     type;
+		uint32_t       seqno;
+		uint32_t       size;
+		const uint8_t* pd;
+	};
+
+	/*!
+	\brief rpcmsg_batch frame payload, messages one by one, each is type(1),seqno(4),size(4) and data.
+	the frame is compressed, encrypted and checked as one package with seqno 0.
+	*/
+	class rpc_batch
+	{
+	public:
+		static bool append(vector<uint8_t>* pv, RPCMSGTYPE type, uint32_t seqno, const void* pd, size_t size)
+		{
+			uint8_t* p = pv->append_uninitialized(RPC_BATCH_HEAD + size);
+			if (!p)
+				return false;
+			uint32_t u = CNetInt::NetUInt(seqno);
+			p[0] = (uint8_t)type;
+			memcpy(p + 1, &u, 4);
+			u = CNetInt::NetUInt((uint32_t)size);
+			memcpy(p + 5, &u, 4);
+			if (size)
+				memcpy(p + RPC_BATCH_HEAD, pd, size);
+			return true;
+		}
+		static bool next(const uint8_t* &pd, size_t &len, t_rpcbatchmsg* pmsg) // false: end, format error if len not 0
+		{
+			if (len < RPC_BATCH_HEAD)
+				return false;
+			uint32_t u;
+			memcpy(&u, pd + 5, 4);
+			u = CNetInt::NetUInt(u);
+			if (len - RPC_BATCH_HEAD < u)
+				return false;
+			pmsg->type = (RPCMSGTYPE)pd[0];
+			pmsg->size = u;
+			memcpy(&u, pd + 1, 4);
+			pmsg->seqno = CNetInt::NetUInt(u);
+			pmsg->pd = pd + RPC_BATCH_HEAD;
+			pd += RPC_BATCH_HEAD + pmsg->size;
+			len -= RPC_BATCH_HEAD + pmsg->size;
+			return true;
+		}
+	};
+
 	struct t_msg_notify
 	{
 		uint32_t seqno;
@@ -199,6 +360,122 @@ namespace ec {
 		ec::map<uint32_t, t_msg_notify> _map;
 	};
 
+	/*!
+	\brief async call completion, called once in client thread(or in stop()).
+	nst is RPC_CALL_ST, pmsg is the decoded response when rpc_call_ok else nullptr,
+	the callback may std::move(*pmsg) to keep the buffer without copy.
+	*/
+	typedef std::function<void(int nst, uint32_t seqno, vector<uint8_t>* pmsg)> rpc_callback;
+
+	/*!
+	\brief lock-free pending async calls, one slot per seqno & (RPC_CALL_SLOTS - 1).
+	caller threads add, the client thread takes by response, timeout sweep or disconnect.
+	*/
+	class rpc_pending
+	{
+	public:
+		rpc_pending() : _nwait(0) {
+			_slots = new t_slot[RPC_CALL_SLOTS];
+		}
+		~rpc_pending() {
+			delete[] _slots;
+		}
+		rpc_pending(const rpc_pending&) = delete;
+		rpc_pending& operator = (const rpc_pending&) = delete;
+	private:
+		enum {
+			st_free = 0,
+			st_busy = 1, // writing or taking
+			st_wait = 2
+		};
+		struct t_slot
+		{
+			t_slot() : ust(st_free), seqno(0), expire(0) {
+			}
+			std::atomic_uint  ust;
+			std::atomic_uint  seqno;
+			int64_t      expire; // steady clock milliseconds
+			rpc_callback fun;
+		};
+		t_slot* _slots;
+		std::atomic_int _nwait;
+	public:
+		static inline int64_t nowms()
+		{
+			return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+		inline int size() const
+		{
+			return _nwait;
+		}
+		bool add(uint32_t seqno, rpc_callback& fun, int timeoutmsec) // false: slot of seqno in use, fun not moved
+		{
+			t_slot& s = _slots[seqno & (RPC_CALL_SLOTS - 1)];
+			unsigned int ust = st_free;
+			if (!s.ust.compare_exchange_strong(ust, st_busy))
+				return false;
+			s.seqno.store(seqno, std::memory_order_relaxed);
+			s.expire = nowms() + timeoutmsec;
+			s.fun = std::move(fun);
+			_nwait++;
+			s.ust.store(st_wait, std::memory_order_release);
+			return true;
+		}
+		bool take(uint32_t seqno, rpc_callback& fun) // remove seqno and move out the callback
+		{
+			t_slot& s = _slots[seqno & (RPC_CALL_SLOTS - 1)];
+			if (s.seqno.load(std::memory_order_relaxed) != seqno)
+				return false;
+			unsigned int ust = st_wait;
+			if (!s.ust.compare_exchange_strong(ust, st_busy))
+				return false;
+			if (s.seqno.load(std::memory_order_relaxed) != seqno) { // reused by another call
+				s.ust.store(st_wait, std::memory_order_release);
+				return false;
+			}
+			release(s, fun);
+			return true;
+		}
+		/*!
+		\brief complete the calls expired(bexpire) or all with nst, callbacks called out of slots.
+		\return number completed
+		*/
+		int sweep(int nst, bool bexpire)
+		{
+			if (!_nwait)
+				return 0;
+			int n = 0;
+			int64_t tcur = nowms();
+			rpc_callback fun;
+			for (uint32_t i = 0; i < RPC_CALL_SLOTS && _nwait; i++) {
+				t_slot& s = _slots[i];
+				if (s.ust.load(std::memory_order_acquire) != st_wait)
+					continue;
+				unsigned int ust = st_wait;
+				if (!s.ust.compare_exchange_strong(ust, st_busy))
+					continue;
+				if (bexpire && s.expire > tcur) {
+					s.ust.store(st_wait, std::memory_order_release);
+					continue;
+				}
+				uint32_t seqno = s.seqno.load(std::memory_order_relaxed);
+				release(s, fun);
+				fun(nst, seqno, nullptr);
+				fun = nullptr;
+				n++;
+			}
+			return n;
+		}
+	private:
+		void release(t_slot& s, rpc_callback& fun)
+		{
+			fun = std::move(s.fun);
+			s.fun = nullptr;
+			_nwait--;
+			s.ust.store(st_free, std::memory_order_release);
+		}
+	};
+
 	struct t_rpcuserinfo
 	{
 		unsigned int    _ucid;	     //UCID
@@ -207,13 +484,68 @@ namespace ec {
 		char            _psw[40];
 		unsigned char   _pswsha1[20];//pass word sha1
 		char			_sip[32];    //ip addr
+		bool            _bcrc32c;    //CRC-32C for message data
+	};
+
+	/*!
+	\brief LZ4 stream of one connection, negotiated by the "lz4s" option in connect.
+	senders compress and post with _cs locked, so the packages are queued in the order compressed,
+	_dec is used by the reader only. reference counted, one by the session and one by each sender using it.
+	*/
+	class rpc_lz4s
+	{
+	public:
+		rpc_lz4s(const void* pdict, size_t dictsize) : _enc(pdict, dictsize), _dec(pdict, dictsize), _nref(1) {
+		}
+		std::mutex   _cs; // lock for _enc and post
+		lz4s_encoder _enc;
+		lz4s_decoder _dec;
+		inline void addref()
+		{
+			_nref++;
+		}
+		inline void release()
+		{
+			if (!--_nref)
+				delete this;
+		}
+	private:
+		std::atomic_int _nref;
+	};
+
+	/*!
+	\brief send lock of one connection for coalesced messages, the rpcmsg_batch frame is taken and posted with _cs locked,
+	so the frames of the flush timer, rpc_flush and the large message after them are queued in order.
+	reference counted like rpc_lz4s.
+	*/
+	class rpc_sendlock
+	{
+	public:
+		rpc_sendlock() : _nref(1) {
+		}
+		std::mutex _cs; // lock for take and post
+		inline void addref()
+		{
+			_nref++;
+		}
+		inline void release()
+		{
+			if (!--_nref)
+				delete this;
+		}
+	private:
+		std::atomic_int _nref;
 	};
 
 	class cRpcCon // client session
 	{
 	public:
-		cRpcCon() :_ucid(0), _pmem(nullptr), _rbuf(16384, nullptr) {
+		cRpcCon() :_ucid(0), _plz4s(nullptr), _psendlock(nullptr), _pmem(nullptr), _rbuf(16384, nullptr), _vbatch(1024, nullptr) {
 			_timeconnect = ::time(0);
+			_bbatch = false;
+			_bcrc32c = false;
+			_bzlib = false;
+			_tkbatch = 0;
 			memset(_sip, 0, sizeof(_sip));
 			memset(_susr, 0, sizeof(_susr));
 			_nstatus = 0;
@@ -221,9 +553,13 @@ namespace ec {
 			memset(_pswsha1, 0, sizeof(_pswsha1));
 			memset(_srandominfo, 0, sizeof(_srandominfo));
 		}
-		cRpcCon(unsigned int ucid, const char* sip, memory* pmem) : _pmem(pmem), _rbuf(16384, pmem)
+		cRpcCon(unsigned int ucid, const char* sip, memory* pmem) : _plz4s(nullptr), _psendlock(nullptr), _pmem(pmem), _rbuf(16384, pmem), _vbatch(1024, pmem)
 		{
 			_timeconnect = ::time(0);
+			_bbatch = false;
+			_bcrc32c = false;
+			_bzlib = false;
+			_tkbatch = 0;
 			memset(_sip, 0, sizeof(_sip));
 			memset(_susr, 0, sizeof(_susr));
 			_ucid = ucid;
@@ -245,9 +581,28 @@ namespace ec {
 			memcpy(_sip, v._sip, sizeof(_sip));
 			memcpy(_srandominfo, v._srandominfo, sizeof(_srandominfo));
 			_rbuf = std::move(v._rbuf);
+			_bbatch = v._bbatch;
+			_bcrc32c = v._bcrc32c;
+			_bzlib = v._bzlib;
+			_cst = v._cst;
+			_tkbatch = v._tkbatch;
+			_vbatch = std::move(v._vbatch);
+			if (_plz4s)
+				_plz4s->release();
+			_plz4s = v._plz4s; // moved
+			v._plz4s = nullptr;
+			if (_psendlock)
+				_psendlock->release();
+			_psendlock = v._psendlock; // moved
+			v._psendlock = nullptr;
 			return *this;
 		}
-		~cRpcCon() {};
+		~cRpcCon() {
+			if (_plz4s)
+				_plz4s->release();
+			if (_psendlock)
+				_psendlock->release();
+		};
 	public:
 		uint32_t _ucid;	     //UCID
 		int32_t	_nstatus;    //0:no login; 1:logined
@@ -257,16 +612,52 @@ namespace ec {
 		uint8_t	_pswsha1[20];// password sha1
 		char	_sip[32];    //ip addr
 		char	_srandominfo[48];//random info,40 bytes
+		bool	_bbatch;     // client can read rpcmsg_batch
+		bool	_bcrc32c;    // CRC-32C for message data
+		bool	_bzlib;      // client can decode zlib
+		rpc_lz4s* _plz4s;    // LZ4 stream, nullptr not negotiated
+		rpc_sendlock* _psendlock; // lock to send coalesced messages in order, nullptr batch not negotiated
+		comp_stats _cst;     // compression results of the messages sent
 	private:
 		memory * _pmem;
-		vector<uint8_t>	_rbuf; // read buffer
+		iobuf	_rbuf; // read buffer
+		vector<uint8_t> _vbatch; // coalesced messages to send
+		int64_t	_tkbatch;    // time of the first message in _vbatch
 	public:
+		/*!
+		\brief coalesce one message to send
+		\return -1: not added; 0: added; 1: added as the first, start flush timer; 2: added and the frame moved to pout, send now
+		*/
+		int BatchAdd(RPCMSGTYPE type, uint32_t seqno, const void* pd, size_t size, size_t uflush, uint32_t udelay, vector<uint8_t>* pout)
+		{
+			if (!_bbatch || size > RPC_BATCH_MSGMAX)
+				return -1;
+			int64_t tcur = rpc_pending::nowms();
+			bool bfirst = _vbatch.empty();
+			if (!rpc_batch::append(&_vbatch, type, seqno, pd, size))
+				return -1;
+			if (bfirst)
+				_tkbatch = tcur;
+			if (_vbatch.size() >= uflush || tcur - _tkbatch >= (int64_t)udelay) {
+				*pout = std::move(_vbatch);
+				return 2;
+			}
+			return bfirst ? 1 : 0;
+		}
+		bool BatchTake(vector<uint8_t>* pout) // move out the coalesced messages
+		{
+			if (_vbatch.empty())
+				return false;
+			*pout = std::move(_vbatch);
+			return true;
+		}
 		int DoReadData(const uint8_t* pdata, size_t usize, vector<uint8_t>* pout) //return -1:err will diconnect; 0:no message; 1:one message in pout
 		{
 			pout->clear();
 			if (!pdata || !usize || !pout)
 				return -1;
-			_rbuf.add(pdata, usize);
+			if (!_rbuf.append(pdata, usize))
+				return -1;
 			return DoLeftData(pout);
 		}
 		int DoLeftData(vector<uint8_t>* pout)//return -1:error will disconnect ; 0: wait ; 1: one msg checked and Decrypt.
@@ -275,16 +666,17 @@ namespace ec {
 			size_t ulen = _rbuf.size();
 			if (ulen < sizeof(t_rpcpkg))
 				return 0;
-			t_rpcpkg* pkg = (t_rpcpkg*)_rbuf.data();//check head
-			unsigned int c1 = crc32(_rbuf.data(), 20);
-			if (pkg->sync != RPC_SYNC_BYTE || c1 != CNetInt::NetUInt(pkg->crc32head))
+			t_rpcpkg head;
+			_rbuf.peek(&head, sizeof(head));//check head
+			unsigned int c1 = crc32(&head, 20);
+			if (head.sync != RPC_SYNC_BYTE || c1 != CNetInt::NetUInt(head.crc32head))
 				return -1;
-			unsigned int sizemsg = CNetInt::NetUInt(pkg->size_en);
+			unsigned int sizemsg = CNetInt::NetUInt(head.size_en);
 			if (ulen < sizemsg + sizeof(t_rpcpkg))
 				return 0;
-			pout->add(_rbuf.data(), sizemsg + sizeof(t_rpcpkg));
-			_rbuf.erase(0, sizemsg + sizeof(t_rpcpkg));
-			_rbuf.shrink(0);
+			if (!_rbuf.readto(pout, sizemsg + sizeof(t_rpcpkg)))
+				return -1;
+			t_rpcpkg* pkg = (t_rpcpkg*)pout->data();
 			unsigned char* puc = pout->data() + sizeof(t_rpcpkg);
 			if (pkg->type >= rpcmsg_request) {
 				register unsigned int i;
@@ -296,10 +688,8 @@ namespace ec {
 					for (i = u4 * 4; i < sizemsg; i++)
 						puc[i] ^= _pswsha1[i % 20];
 				}
-				register unsigned int	crc = 0xffffffff;
-				for (i = 0; i < sizemsg; i++) //check CRC32
-					crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ puc[i]];
-				if (pkg->crc32msg != CNetInt::NetUInt(crc ^ 0xffffffff))
+				unsigned int crc = (pkg->cflag & 0x02) ? crc32c(puc, sizemsg) : crc32(puc, sizemsg); //check data CRC
+				if (pkg->crc32msg != CNetInt::NetUInt(crc))
 					return -1;
 			}
 			else {
@@ -322,12 +712,14 @@ namespace ec {
 	class cRpcClientMap // client sessions map
 	{
 	public:
-		cRpcClientMap(size_t maxconect, memory* pmem) : _memmap(map<uint32_t, cRpcCon>::size_node(), maxconect),
-			_map(11 + (uint32_t)(maxconect / 3), &_memmap), _pmem(pmem)
+		cRpcClientMap(size_t maxconect, memory* pmem) : _map(maxconect), _pmem(pmem), _lz4sdict(1024 * 16, nullptr)
 		{
 			_bEncryptData = false;
-			_tks = ::time(nullptr);
-			_tks <<= 24;
+			_bAffinity = false;
+			_blz4s = false;
+			_ulz4sdictid = 0;
+			uint64_t tks = ::time(nullptr);
+			_tks = tks << 24;
 			_lseqno = 1;
 		}
 		~cRpcClientMap() {
@@ -342,47 +734,93 @@ namespace ec {
 		{
 			return _bEncryptData;
 		}
+		inline void SetAffinity(bool bAffinity) // the read data of one ucid only done by one worker, parse without lock
+		{
+			_bAffinity = bAffinity;
+		}
 		inline memory* get_memory() {
 			return _pmem;
 		}
+		/*!
+		\brief call before start, LZ4 stream for the clients ask "lz4s" in connect, pdict is the preloaded
+		dictionary both ends have, used when the clients have the same one(id is the crc32 of it).
+		*/
+		bool SetLz4Stream(bool benable, const void* pdict = nullptr, size_t dictsize = 0)
+		{
+			_blz4s = benable;
+			_lz4sdict.clear();
+			_ulz4sdictid = 0;
+			if (!pdict || !dictsize)
+				return true;
+			if (!_lz4sdict.add((const uint8_t*)pdict, dictsize))
+				return false;
+			_ulz4sdictid = crc32(pdict, (unsigned int)dictsize);
+			return true;
+		}
+		inline bool IsLz4Stream()
+		{
+			return _blz4s;
+		}
+		inline uint32_t GetLz4sDictId() // 0: no dictionary
+		{
+			return _ulz4sdictid;
+		}
 	protected:
 		bool _bEncryptData;
-		uint64_t _tks;
-		std::mutex _cs;
-		memory _memmap;
-		map<uint32_t, cRpcCon> _map;
+		bool _bAffinity;
+		std::atomic<uint64_t> _tks;
+		shardmap<cRpcCon> _map; // lock-striped by ucid
 		memory* _pmem; //memory for read data
+		bool _blz4s; // LZ4 stream for the clients ask
+		vector<uint8_t> _lz4sdict; // preloaded dictionary of LZ4 stream
+		uint32_t _ulz4sdictid; // crc32 of _lz4sdict
+	public:
+	protected:
+		cRpcCon* getcon(uint32_t ucid) // lock only map lookup, the node keep until Del by the same worker
+		{
+			return _map.getnode(ucid);
+		}
 	public:
 		void Add(uint32_t ucid, const char* sip)
 		{
-			unique_lock lck(&_cs);
 			_map.set(ucid, cRpcCon(ucid, sip, _pmem));
 		}
 		bool Del(unsigned int ucid)
 		{
-			unique_lock lck(&_cs);
 			return _map.erase(ucid);
 		}
 		int DoReadData(uint32_t ucid, const uint8_t* pdata, size_t usize, vector<uint8_t>* pout)
 		{
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(ucid);
+			if (_bAffinity) {
+				cRpcCon* pcli = getcon(ucid);
+				if (!pcli)
+					return -1;
+				return pcli->DoReadData(pdata, usize, pout);
+			}
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
 			if (!pcli)
 				return -1;
 			return pcli->DoReadData(pdata, usize, pout);
 		}
 		int DoLeftData(uint32_t ucid, vector<uint8_t>* pout)
 		{
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(ucid);
+			if (_bAffinity) {
+				cRpcCon* pcli = getcon(ucid);
+				if (!pcli)
+					return -1;
+				return pcli->DoLeftData(pout);
+			}
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
 			if (!pcli)
 				return -1;
 			return pcli->DoLeftData(pout);
 		}
 		bool GetUserInfo(t_rpcuserinfo* puser)
 		{
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(puser->_ucid);
+			unique_lock lck(_map.getcs(puser->_ucid));
+			cRpcCon* pcli = _map.get_nolock(puser->_ucid);
 			if (!pcli)
 				return false;
 			puser->_nstatus = pcli->_nstatus;
@@ -390,12 +828,13 @@ namespace ec {
 			memcpy(puser->_psw, pcli->_psw, sizeof(puser->_psw));
 			memcpy(puser->_pswsha1, pcli->_pswsha1, sizeof(puser->_pswsha1));
 			memcpy(puser->_sip, pcli->_sip, sizeof(puser->_sip));
+			puser->_bcrc32c = pcli->_bcrc32c;
 			return true;
 		}
 		bool SetUserPsw(const char* susr, unsigned int ucid, const char* spsw)
 		{
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(ucid);
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
 			if (!pcli)
 				return false;
 			if (!spsw || !(*spsw))
@@ -409,13 +848,13 @@ namespace ec {
 		}
 		bool SetUserRandomInfo(unsigned int ucid, char* sout) //sout > 40 bytes
 		{
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(ucid);
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
 			if (!pcli)
 				return false;
-			_tks++;
+			uint64_t tks = ++_tks;
 			unsigned char usha1[20], uc;
-			encode_sha1(&_tks, 8, usha1);// random data
+			encode_sha1(&tks, 8, usha1);// random data
 			int i;
 			for (i = 0; i < 20; i++) {
 				uc = usha1[i] >> 4;
@@ -431,8 +870,8 @@ namespace ec {
 		bool GetUsrInfoSha1(unsigned int ucid, char* pout, char* outusr) // pout >40 bytes,outusr >= 32 bytes
 		{
 			char sbuf[80] = { 0 };
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(ucid);
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
 			if (!pcli)
 				return false;
 			memcpy(sbuf, pcli->_srandominfo, 40);
@@ -451,115 +890,200 @@ namespace ec {
 			memcpy(outusr, pcli->_susr, sizeof(pcli->_susr));
 			return true;
 		}
+		void SetPeerOptions(uint32_t ucid, bool bbatch, bool bcrc32c, bool bzlib, bool blz4s, bool blz4sdict) // options negotiated in connect
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (pcli) {
+				pcli->_bbatch = bbatch;
+				pcli->_bcrc32c = bcrc32c;
+				pcli->_bzlib = bzlib;
+				if (blz4s && !pcli->_plz4s)
+					pcli->_plz4s = new rpc_lz4s(blz4sdict ? _lz4sdict.data() : nullptr, blz4sdict ? _lz4sdict.size() : 0);
+				if (bbatch && !pcli->_psendlock)
+					pcli->_psendlock = new rpc_sendlock();
+			}
+		}
+		/*!
+		\brief choose the compression for one message to ucid with the results of this connection
+		\param uentropy return of comp_policy::entropy()
+		\return COMPMETHOD
+		*/
+		int CompChoose(uint32_t ucid, const comp_policy* ppolicy, size_t size, uint32_t uentropy, size_t uminsize)
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (!pcli)
+				return comp_none;
+			return ppolicy->choose(size, uentropy, &pcli->_cst, rpc_comp_methods(pcli->_bzlib), uminsize);
+		}
+		void CompReport(uint32_t ucid, const comp_policy* ppolicy, int method, size_t usrc, size_t uout, uint64_t uns)
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (pcli)
+				ppolicy->report(&pcli->_cst, method, usrc, uout, uns);
+		}
+		bool GetCompStats(uint32_t ucid, comp_stats* pst)
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (!pcli)
+				return false;
+			*pst = pcli->_cst;
+			return true;
+		}
+		rpc_lz4s* GetLz4s(uint32_t ucid) // return the LZ4 stream with addref, call release() after used; nullptr: not negotiated
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (!pcli || !pcli->_plz4s)
+				return nullptr;
+			pcli->_plz4s->addref();
+			return pcli->_plz4s;
+		}
+		rpc_sendlock* GetSendLock(uint32_t ucid) // return the send lock with addref, call release() after used; nullptr: no ucid or batch not negotiated
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (!pcli || !pcli->_psendlock)
+				return nullptr;
+			pcli->_psendlock->addref();
+			return pcli->_psendlock;
+		}
+		/*!
+		\brief coalesce one message to ucid, pmask(20 bytes) and pcrc32c get the password sha1 and CRC option for package
+		\return -2: no ucid; others see cRpcCon::BatchAdd
+		*/
+		int BatchAdd(uint32_t ucid, RPCMSGTYPE type, uint32_t seqno, const void* pd, size_t size, size_t uflush, uint32_t udelay,
+			vector<uint8_t>* pout, uint8_t* pmask, bool* pcrc32c)
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (!pcli)
+				return -2;
+			memcpy(pmask, pcli->_pswsha1, sizeof(pcli->_pswsha1));
+			*pcrc32c = pcli->_bcrc32c;
+			return pcli->BatchAdd(type, seqno, pd, size, uflush, udelay, pout);
+		}
+		int BatchTake(uint32_t ucid, vector<uint8_t>* pout, uint8_t* pmask, bool* pcrc32c) // return -2: no ucid; -1: nothing; 2: moved to pout
+		{
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
+			if (!pcli)
+				return -2;
+			memcpy(pmask, pcli->_pswsha1, sizeof(pcli->_pswsha1));
+			*pcrc32c = pcli->_bcrc32c;
+			return pcli->BatchTake(pout) ? 2 : -1;
+		}
 		void SetUsrStatus(unsigned int ucid, RPCUSRST nst)
 		{
-			unique_lock lck(&_cs);
-			cRpcCon* pcli = _map.get(ucid);
+			unique_lock lck(_map.getcs(ucid));
+			cRpcCon* pcli = _map.get_nolock(ucid);
 			if (!pcli)
 				return;
 			pcli->_nstatus = nst;
 		}
 		int GetTimeOutNoLogin(time_t ltime, time_t timeoutsec, vector<uint32_t>*pucids)
 		{
-			unique_lock lck(&_cs);
-			cRpcCon *p;
-			map<uint32_t, cRpcCon>::iterator it = _map.begin();
 			pucids->clear();
-			while ((p = _map.next(it)) != nullptr) {
-				if (p->_nstatus == 0 && ltime - p->_timeconnect > timeoutsec)
-					pucids->add(p->_ucid);
-			}
+			_map.for_each([&](cRpcCon& v) {
+				if (v._nstatus == 0 && ltime - v._timeconnect > timeoutsec)
+					pucids->add(v._ucid);
+			});
 			return (int)pucids->size();
 		}
 	};
 
 	class args_rpc {
 	public:
-		args_rpc(cRpcClientMap* pssmap) : _pssmap(pssmap) {
+		args_rpc(cRpcClientMap* pssmap, uint32_t ulogintimeout = RPC_LOGIN_TIMEOUT) : _pssmap(pssmap), _ulogintimeout(ulogintimeout),
+			_ubatchsize(0), _ubatchdelay(RPC_BATCH_DELAY) {
 		}
 		cRpcClientMap * _pssmap;
-		static bool MakePkg(const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress, uint32_t seqno, const uint8_t* pmask, memory* pmem, bool bEncrypt, vector<uint8_t>* pPkg)
+		uint32_t _ulogintimeout; // login timeout milliseconds, 0 none
+		size_t   _ubatchsize;    // flush size of coalesced messages, 0 not coalesce
+		uint32_t _ubatchdelay;   // flush delay milliseconds of coalesced messages
+		comp_policy _compolicy;  // compression policy
+		/*!
+		\brief bcrc32c: CRC-32C for request, put, response and batch; penc: LZ4 stream of the connection for them,
+		the package must be posted in the order made. compressed data not smaller is sent as rpccomp_none, except stream.
+		*/
+		static bool MakePkg(const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress, uint32_t seqno, const uint8_t* pmask, memory* pmem, bool bEncrypt, vector<uint8_t>* pPkg,
+			bool bcrc32c = false, lz4s_encoder* penc = nullptr)
 		{
-			unsigned char shead[sizeof(t_rpcpkg)] = { 0 };
+			(void)pmem; // no temporary buffer now, kept for the callers
+#ifndef RPC_USE_LZ4HC
+			if (compress == rpccomp_lz4hc)
+				compress = rpccomp_lz4;
+#endif
+			if (penc && msgtype >= rpcmsg_request && size <= LZ4S_BLOCK_MAX && compress != rpccomp_none)
+				compress = rpccomp_lz4s;
+			size_t ubound = size; // compress into the package directly, no temporary buffer
+			if (compress == rpccomp_lz4 || compress == rpccomp_lz4s || compress == rpccomp_lz4hc)
+				ubound = LZ4_compressBound((int)size);
+#ifdef RPC_USE_ZLIB
+			else if (compress == rpccomp_zlib)
+				ubound = size + (size / 1024) * 16 + 1024;
+#endif
 			pPkg->clear();
-			pPkg->add(shead, sizeof(t_rpcpkg));
-			t_rpcpkg* ph = (t_rpcpkg*)pPkg->data();
-
+			if (!pPkg->reserve_exact(sizeof(t_rpcpkg) + ubound))
+				return false;
+			t_rpcpkg* ph = (t_rpcpkg*)pPkg->append_uninitialized(sizeof(t_rpcpkg));
+			memset(ph, 0, sizeof(t_rpcpkg));
 			ph->sync = RPC_SYNC_BYTE;
 			ph->type = (char)msgtype;
 
-			void* pdata; // compress first
-			size_t ulen = size;
-			auto_buffer vtmp(pmem);
-			if (compress == rpccomp_lz4) {
-				ulen = LZ4_compressBound((int)size);
-				if (!vtmp.resize(ulen))
-					return false;
-				if (encode_lz4(pd, size, vtmp.data(), &ulen)) {
-					pdata = vtmp.data();
-					ph->comp = rpccomp_lz4;
-				}
-				else {
-					pdata = (void*)pd;
-					ph->comp = rpccomp_none;
-					ulen = size;
-				}
-			}
+			uint8_t* pdata = pPkg->data() + sizeof(t_rpcpkg);
+			size_t ulen = ubound;
+			bool bnew = false;
+			if (compress == rpccomp_lz4s && (ulen = penc->encode(pd, size, pdata, ubound, &bnew)) > 0)
+				ph->comp = rpccomp_lz4s;
+			else if (compress == rpccomp_lz4 && encode_lz4(pd, size, pdata, &ulen) && ulen < size)
+				ph->comp = rpccomp_lz4;
+#ifdef RPC_USE_LZ4HC
+			else if (compress == rpccomp_lz4hc && encode_lz4hc(pd, size, pdata, &ulen, RPC_LZ4HC_LEVEL) && ulen < size)
+				ph->comp = rpccomp_lz4;
+#endif
 #ifdef RPC_USE_ZLIB
-			else if (compress == rpccomp_zlib)
-			{
-				ulen = size + (size / 1024) * 16 + 1024;
-				if (!vtmp.resize(ulen))
-					return false;
-				if (encode_zlib(pd, size, vtmp.data(), &ulen)) {
-					pdata = vtmp.data();
-					ph->comp = rpccomp_zlib;
-				}
-				else {
-					pdata = (void*)pd;
-					ph->comp = rpccomp_none;
-					ulen = size;
-				}
-			}
+			else if (compress == rpccomp_zlib && encode_zlib(pd, size, pdata, &ulen) && ulen < size)
+				ph->comp = rpccomp_zlib;
 #endif
 			else {
-				pdata = (void*)pd;
+				if (size)
+					memcpy(pdata, pd, size);
 				ph->comp = rpccomp_none;
 				ulen = size;
 			}
+			pPkg->set_size(sizeof(t_rpcpkg) + ulen);
 			if (bEncrypt && pmask)
 				ph->cflag = 0;
 			else
 				ph->cflag = 1;
+			if (bnew)
+				ph->cflag |= 0x04;
 
 			ph->seqno = CNetInt::NetUInt(seqno);
 			ph->size_en = CNetInt::NetUInt((unsigned int)ulen);
 			ph->size_dn = CNetInt::NetUInt((unsigned int)size);
 
-			if (!pPkg->add((const uint8_t*)pdata, ulen))
-				return false;
-
-			ph = (t_rpcpkg*)pPkg->data();
 			unsigned char* puc = pPkg->data() + sizeof(t_rpcpkg);
-			if (pmask && msgtype >= rpcmsg_request) {
-				unsigned int ul = (unsigned int)ulen;
-				register unsigned int	crc = 0xffffffff;
-				register unsigned int i;
-
-				for (i = 0; i < ul; i++) // make data crc32
-					crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ puc[i]];
-				ph->crc32msg = CNetInt::NetUInt(crc ^ 0xffffffff);
-				if (bEncrypt) {
-					unsigned int *pu4 = (unsigned int *)puc, ul4 = ul / 4; //Encrypt
-					unsigned int *pmk4 = (unsigned int*)pmask;
-					for (i = 0; i < ul4; i++)
-						pu4[i] ^= pmk4[i % 5];
-					for (i = ul4 * 4; i < ul; i++)
-						puc[i] ^= pmask[i % 20];
-				}
+			if (bcrc32c && msgtype >= rpcmsg_request) {
+				ph->cflag |= 0x02;
+				ph->crc32msg = CNetInt::NetUInt(crc32c(puc, ulen));// make data crc32c
 			}
 			else
 				ph->crc32msg = CNetInt::NetUInt(crc32(puc, (unsigned int)ulen));// make data crc32
+			if (pmask && bEncrypt && msgtype >= rpcmsg_request) {
+				unsigned int ul = (unsigned int)ulen;
+				register unsigned int i;
+				unsigned int *pu4 = (unsigned int *)puc, ul4 = ul / 4; //Encrypt
+				unsigned int *pmk4 = (unsigned int*)pmask;
+				for (i = 0; i < ul4; i++)
+					pu4[i] ^= pmk4[i % 5];
+				for (i = ul4 * 4; i < ul; i++)
+					puc[i] ^= pmask[i % 20];
+			}
 			ph->crc32head = CNetInt::NetUInt(crc32(ph, 20)); // make head crc32
 			return true;
 		}
@@ -572,22 +1096,58 @@ namespace ec {
 		typedef AioTcpSrv<_THREAD, AioRpcSrv<_THREAD, _CLS>> base_;
 		friend  base_;
 		AioRpcSrv(uint32_t maxconnum, cLog* plog, memory* pmem)
-			: base_(maxconnum, plog, pmem), _mapss(maxconnum, pmem)
+			: base_(maxconnum, plog, pmem), _mapss(maxconnum, pmem), _ulogintimeout(RPC_LOGIN_TIMEOUT),
+			_ubatchsize(0), _ubatchdelay(RPC_BATCH_DELAY)
 		{
 			_mapss.SetEncryptData(false);
 		}
 		void InitRpcArgs(_THREAD* pthread) {
-			args_rpc arg(&_mapss);
+			args_rpc arg(&_mapss, _ulogintimeout);
+			arg._ubatchsize = _ubatchsize;
+			arg._ubatchdelay = _ubatchdelay;
+			arg._compolicy = _compolicy;
 			pthread->InitRpcArgs(&arg);
 		}
+		inline void set_login_timeout(uint32_t umsec) { // call before start, disconnect the client not login in umsec, 0 none
+			_ulogintimeout = umsec;
+		}
+		/*!
+		\brief call before start, coalesce put and response not larger than RPC_BATCH_MSGMAX to rpcmsg_batch frame
+		for the clients can read it, the frame send when over flushsize bytes, after delaymsec(timer tick XPOLL_TIMER_TICK)
+		or when the messages read from this client done. flushsize 0 not coalesce.
+		*/
+		inline void set_batch(size_t flushsize, uint32_t delaymsec = RPC_BATCH_DELAY) {
+			_ubatchsize = flushsize;
+			_ubatchdelay = delaymsec;
+		}
+		/*!
+		\brief call before start, LZ4 stream compression for the clients ask it in connect, request, put, response
+		and batch messages not larger than LZ4S_BLOCK_MAX are compressed with the history of the connection,
+		and the preloaded dictionary pdict if the client has the same. memory of each stream connection is about
+		two LZ4S_RING_SIZE. the packages can not be dropped, do not use with XPOLL_POST_DROPOLDEST.
+		*/
+		inline bool set_lz4s(bool benable, const void* pdict = nullptr, size_t dictsize = 0) {
+			return _mapss.SetLz4Stream(benable, pdict, dictsize);
+		}
+		/*!
+		\brief call before start, knobs of the compression policy for request, put, response and batch messages.
+		LZ4HC is used only when RPC_USE_LZ4HC defined, zlib when RPC_USE_ZLIB defined and the client can decode it.
+		*/
+		inline void set_comp_policy(const t_comp_args& args) {
+			_compolicy.set(args);
+		}
+		inline bool get_compstats(uint32_t ucid, comp_stats* pst) { // compression results of the messages sent to ucid
+			return _mapss.GetCompStats(ucid, pst);
+		}
 	protected:
 		inline void InitArgs(_THREAD* pthread) {
 			static_cast<_CLS*>(this)->InitArgs(pthread);
 		}
 	public:
-		bool start(uint16_t port, int workthreadnum, const char* sip = nullptr)
+		bool start(uint16_t port, int workthreadnum, const char* sip = nullptr, int reactors = 1)
 		{
-			if (!base_::start(port, workthreadnum, sip)) {
+			_mapss.SetAffinity(base_::is_affinity());
+			if (!base_::start(port, workthreadnum, sip, reactors)) {
 				if (base_::_plog)
 					base_::_plog->add(CLOG_DEFAULT_ERR, "Start server port(%u) failed!", port);
 				return false;
@@ -596,6 +1156,10 @@ namespace ec {
 		}
 	protected:
 		cRpcClientMap _mapss;  //map for  sessions
+		uint32_t _ulogintimeout; // login timeout milliseconds
+		size_t   _ubatchsize;    // flush size of coalesced messages, 0 not coalesce
+		uint32_t _ubatchdelay;   // flush delay milliseconds
+		comp_policy _compolicy;  // compression policy
 	};
 
 	template<class _CLS>
@@ -605,33 +1169,173 @@ namespace ec {
 		typedef AioTcpSrvThread<AioRpcSrvThread<_CLS>> base_;
 		friend  base_;
 		AioRpcSrvThread(xpoll* ppoll, cLog* plog, memory* pmem, int threadno, uint16_t srvport) :
-			base_(ppoll, plog, pmem, threadno, srvport)
+			base_(ppoll, plog, pmem, threadno, srvport), _pssmap(nullptr), _ulogintimeout(RPC_LOGIN_TIMEOUT),
+			_ubatchsize(0), _ubatchdelay(RPC_BATCH_DELAY), _msgr(RPC_MSGR_KEEPSIZE, pmem)
 		{
 		}
 		inline void InitRpcArgs(args_rpc* pargs) {
 			_pssmap = pargs->_pssmap;
+			_ulogintimeout = pargs->_ulogintimeout;
+			_compolicy = pargs->_compolicy;
+			set_batch(pargs->_ubatchsize, pargs->_ubatchdelay);
+		}
+		inline void set_batch(size_t flushsize, uint32_t delaymsec = RPC_BATCH_DELAY) { // see AioRpcSrv::set_batch
+			_ubatchsize = flushsize;
+			_ubatchdelay = delaymsec;
 		}
 		bool rpc_send(uint32_t ucid, const void* pdata, size_t bytesize, RPCMSGTYPE msgtype,
-			uint32_t seqno, int timeovermsec = 100) // post send data
+			uint32_t seqno, int timeovermsec = 100) // post send data, put and response may be coalesced by set_batch
 		{
+			if (_ubatchsize && (msgtype == rpcmsg_put || msgtype == rpcmsg_response))
+				return BatchSend(ucid, pdata, bytesize, msgtype, seqno, timeovermsec);
 			t_rpcuserinfo usrinfo;
 			usrinfo._ucid = ucid;
 			if (!_pssmap->GetUserInfo(&usrinfo))
 				return false;
-			if (bytesize > 80)
-				return SendRpcMsg(ucid, pdata, bytesize, msgtype, rpccomp_lz4, seqno, usrinfo._pswsha1, timeovermsec);
-			else
-				return SendRpcMsg(ucid, pdata, bytesize, msgtype, rpccomp_none, seqno, usrinfo._pswsha1, timeovermsec);
+			return SendRpcMsg(ucid, pdata, bytesize, msgtype, rpccomp_lz4, seqno, usrinfo._pswsha1, timeovermsec, usrinfo._bcrc32c);
+		}
+		/*!
+		\brief send one message to many ucids, encode and compress once and post one shared package,
+		encrypted data is per user, then make package for each ucid
+		\return number of ucids queued
+		*/
+		size_t rpc_broadcast(const uint32_t* pucids, size_t n, const void* pdata, size_t bytesize, RPCMSGTYPE msgtype = rpcmsg_put, uint32_t seqno = 0)
+		{
+			size_t i, nq = 0;
+			if (_ubatchsize && !_pssmap->IsEncryptData()) { // keep order with the coalesced
+				for (i = 0; i < n; i++)
+					rpc_flush(pucids[i]);
+			}
+			if (_pssmap->IsEncryptData()) {
+				for (i = 0; i < n; i++) {
+					if (rpc_send(pucids[i], pdata, bytesize, msgtype, seqno, 0))
+						nq++;
+				}
+				return nq;
+			}
+			small_vector<uint8_t, 512> pkg(bytesize + sizeof(t_rpcpkg), base_::_pmem); // copied to shared_buffer
+			RPCCOMPRESS comp = rpc_comp(_compolicy.choose(bytesize, _compolicy.entropy(pdata, bytesize), nullptr, rpc_comp_methods(false)));
+			if (!args_rpc::MakePkg(pdata, bytesize, msgtype, comp, seqno, nullptr, base_::_pmem, false, &pkg))
+				return 0;
+			shared_buffer* pbuf = shared_buffer::create(base_::_pmem, pkg.data(), pkg.size());
+			if (!pbuf)
+				return 0;
+			nq = base_::tcp_post_shared(pucids, n, pbuf);
+			pbuf->release();
+			return nq;
+		}
+		inline bool rpc_compstats(uint32_t ucid, comp_stats* pst) // compression results of the messages sent to ucid
+		{
+			return _pssmap->GetCompStats(ucid, pst);
+		}
+		bool rpc_flush(uint32_t ucid, int timeovermsec = 100) // send the coalesced messages of ucid now
+		{
+			rpc_sendlock* psl = _pssmap->GetSendLock(ucid);
+			bool br;
+			{
+				unique_lock lck(psl ? &psl->_cs : nullptr); // take and post in order with other senders of ucid
+				br = FlushBatch(ucid, timeovermsec);
+			}
+			if (psl)
+				psl->release();
+			return br;
 		}
 	protected:
 		cRpcClientMap * _pssmap;
+		uint32_t _ulogintimeout; // login timeout milliseconds, 0 none
+		size_t   _ubatchsize;    // flush size of coalesced messages, 0 not coalesce
+		uint32_t _ubatchdelay;   // flush delay milliseconds
+		comp_policy _compolicy;  // compression policy
 	private:
+		vector<uint8_t> _msgr; // one checked message, reused by onrecv
+		bool FlushBatch(uint32_t ucid, int timeovermsec) // lock with rpc_sendlock of ucid
+		{
+			uint8_t pswsha1[20];
+			bool bcrc32c = false;
+			vector<uint8_t> vb(1024, base_::_pmem);
+			int nr = _pssmap->BatchTake(ucid, &vb, pswsha1, &bcrc32c);
+			if (nr == -2)
+				return false;
+			if (nr == 2)
+				return SendBatch(ucid, &vb, pswsha1, bcrc32c, timeovermsec);
+			return true;
+		}
+		bool BatchSend(uint32_t ucid, const void* pdata, size_t bytesize, RPCMSGTYPE msgtype, uint32_t seqno, int timeovermsec)
+		{
+			rpc_sendlock* psl = _pssmap->GetSendLock(ucid);
+			bool br;
+			{
+				unique_lock lck(psl ? &psl->_cs : nullptr); // coalesce, take and post in order with other senders of ucid
+				br = BatchSendLocked(ucid, pdata, bytesize, msgtype, seqno, timeovermsec);
+			}
+			if (psl)
+				psl->release();
+			return br;
+		}
+		bool BatchSendLocked(uint32_t ucid, const void* pdata, size_t bytesize, RPCMSGTYPE msgtype, uint32_t seqno, int timeovermsec)
+		{
+			uint8_t pswsha1[20];
+			bool bcrc32c = false;
+			vector<uint8_t> vb(1024, base_::_pmem);
+			int nr;
+			if (bytesize > RPC_BATCH_MSGMAX) { // send the coalesced first, keep order
+				nr = _pssmap->BatchTake(ucid, &vb, pswsha1, &bcrc32c);
+				if (nr == 2)
+					SendBatch(ucid, &vb, pswsha1, bcrc32c, timeovermsec);
+			}
+			else
+				nr = _pssmap->BatchAdd(ucid, msgtype, seqno, pdata, bytesize, _ubatchsize, _ubatchdelay, &vb, pswsha1, &bcrc32c);
+			if (nr == -2)
+				return false;
+			else if (nr == 0)
+				return true;
+			else if (nr == 1) {
+				if (!base_::set_timer(ucid, XPOLL_TIMER_FLUSH, _ubatchdelay))
+					return FlushBatch(ucid, timeovermsec);
+				return true;
+			}
+			else if (nr == 2 && bytesize <= RPC_BATCH_MSGMAX)
+				return SendBatch(ucid, &vb, pswsha1, bcrc32c, timeovermsec);
+			return SendRpcMsg(ucid, pdata, bytesize, msgtype, rpccomp_lz4, seqno, pswsha1, timeovermsec, bcrc32c);
+		}
+		inline bool SendBatch(uint32_t ucid, vector<uint8_t>* pv, const uint8_t* pmask, bool bcrc32c, int timeovermsec)
+		{
+			return SendRpcMsg(ucid, pv->data(), pv->size(), rpcmsg_batch, rpccomp_lz4, 0, pmask, timeovermsec, bcrc32c);
+		}
+		/*!
+		\brief post one message, request, put, response and batch with compress not rpccomp_none are compressed
+		by the policy and the results of this connection.
+		*/
 		bool SendRpcMsg(uint32_t ucid, const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress,
-			uint32_t seqno, const uint8_t* pmask, int timeovermsec = 100)
+			uint32_t seqno, const uint8_t* pmask, int timeovermsec = 100, bool bcrc32c = false)
+		{
+			rpc_lz4s* pzs = (msgtype >= rpcmsg_request && _pssmap->IsLz4Stream()) ? _pssmap->GetLz4s(ucid) : nullptr;
+			if (compress != rpccomp_none && msgtype >= rpcmsg_request)
+				compress = rpc_comp(_pssmap->CompChoose(ucid, &_compolicy, size, _compolicy.entropy(pd, size), pzs ? RPC_LZ4S_MINSIZE : 0));
+			if (!pzs)
+				return PostPkg(ucid, pd, size, msgtype, compress, seqno, pmask, timeovermsec, bcrc32c, nullptr);
+			bool br;
+			{
+				unique_lock lck(&pzs->_cs); // compress and post in order
+				br = PostPkg(ucid, pd, size, msgtype, compress, seqno, pmask, timeovermsec, bcrc32c, &pzs->_enc);
+				if (!br)
+					pzs->_enc.reset(); // the client not get it, start a new stream
+			}
+			pzs->release();
+			return br;
+		}
+		bool PostPkg(uint32_t ucid, const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress,
+			uint32_t seqno, const uint8_t* pmask, int timeovermsec, bool bcrc32c, lz4s_encoder* penc)
 		{
-			vector<uint8_t> pkg(size, base_::_pmem);
-			if (args_rpc::MakePkg(pd, size, msgtype, compress, seqno, pmask, base_::_pmem, _pssmap->IsEncryptData(), &pkg)) {
+			vector<uint8_t> pkg(size + sizeof(t_rpcpkg), base_::_pmem); // one allocation, MakePkg reserves the exact size
+			int64_t tks = compress != rpccomp_none ? rpc_comp_nowns() : 0;
+			if (args_rpc::MakePkg(pd, size, msgtype, compress, seqno, pmask, base_::_pmem, _pssmap->IsEncryptData(), &pkg, bcrc32c, penc)) {
 				size_t pkglen = pkg.size();
+				if (tks) { // time includes CRC
+					t_rpcpkg* ph = (t_rpcpkg*)pkg.data();
+					_pssmap->CompReport(ucid, &_compolicy, rpc_comp_method(compress), size,
+						ph->comp == rpccomp_none ? size : pkglen - sizeof(t_rpcpkg), rpc_comp_nowns() - tks);
+				}
 				return base_::tcp_post(ucid, pkg.detach_buf(), pkglen, timeovermsec);
 			}
 			return false;
@@ -659,43 +1363,64 @@ namespace ec {
 			t_rpcpkg* pkg = (t_rpcpkg*)pin->data();
 			void* pmsg = 0;
 			size_t ulen = 0;
+			rpc_lz4s* pzs = nullptr; // LZ4 stream of the message, keep the reference while pmsg in its ring buffer is used
 
-			auto_buffer vtmp(base_::_pmem);
 			if (pkg->comp == rpccomp_none) {
 				pmsg = pkg->msg;
 				ulen = CNetInt::NetUInt(pkg->size_en);
 			}
 			else if (pkg->comp == rpccomp_lz4) {
 				size_t uen = CNetInt::NetUInt(pkg->size_en), udn = CNetInt::NetUInt(pkg->size_dn);
-				if (!vtmp.resize(udn)) {
+				void* ptmp = base_::scratch_alloc(udn); // valid until this message done, onrecv reset the arena after each message
+				if (!ptmp) {
 					base_::close_ucid(ucid);
 					return -1;
 				}
-				if (!decode_lz4(pkg->msg, uen, vtmp.data(), &udn))
+				if (!decode_lz4(pkg->msg, uen, ptmp, &udn))
 					return RetSysMsg(ucid, "msgsys,-1,decode lz4 error!", CNetInt::NetUInt(pkg->seqno), true);
-				pmsg = vtmp.data();
+				pmsg = ptmp;
+				ulen = udn;
+			}
+			else if (pkg->comp == rpccomp_lz4s) {
+				size_t uen = CNetInt::NetUInt(pkg->size_en), udn = CNetInt::NetUInt(pkg->size_dn);
+				pzs = _pssmap->GetLz4s(ucid); // the session may be deleted by ondisconnect in other worker, release after the message done
+				if (pzs)
+					pmsg = (void*)pzs->_dec.decode(pkg->msg, uen, udn, 0 != (pkg->cflag & 0x04));
+				if (!pmsg) {
+					if (pzs)
+						pzs->release();
+					return RetSysMsg(ucid, "msgsys,-1,decode lz4s error!", CNetInt::NetUInt(pkg->seqno), true);
+				}
 				ulen = udn;
 			}
 #ifdef RPC_USE_ZLIB
 			else if (pkg->comp == rpccomp_zlib) {
 				size_t uen = CNetInt::NetUInt(pkg->size_en), udn = CNetInt::NetUInt(pkg->size_dn);
-				if (!vtmp.resize(udn)) {
+				void* ptmp = base_::scratch_alloc(udn);
+				if (!ptmp) {
 					base_::close_ucid(ucid);
 					return -1;
 				}
-				if (!decode_zlib(pkg->msg, uen, vtmp.data(), &udn))
+				if (!decode_zlib(pkg->msg, uen, ptmp, &udn))
 					return RetSysMsg(ucid, "msgsys,-1,decode lz4 error!", CNetInt::NetUInt(pkg->seqno), true);
-				pmsg = vtmp.data();
+				pmsg = ptmp;
 				ulen = udn;
 			}
 #endif
 			else
 				return RetSysMsg(ucid, "msgsys,-1,unkown compress type!", CNetInt::NetUInt(pkg->seqno), true);
+			int nr;
 			if (pkg->type == rpcmsg_sh)
-				return Do_shmsg(ucid, pmsg, (unsigned int)ulen, CNetInt::NetUInt(pkg->seqno));
+				nr = Do_shmsg(ucid, pmsg, (unsigned int)ulen, CNetInt::NetUInt(pkg->seqno));
 			else if (pkg->type == rpcmsg_request || pkg->type == rpcmsg_put)
-				return Do_appMsg(ucid, (RPCMSGTYPE)pkg->type, pmsg, (unsigned int)ulen, CNetInt::NetUInt(pkg->seqno));
-			return RetSysMsg(ucid, "msgsys,-1,unkown msgtype!", CNetInt::NetUInt(pkg->seqno), true);
+				nr = Do_appMsg(ucid, (RPCMSGTYPE)pkg->type, pmsg, (unsigned int)ulen, CNetInt::NetUInt(pkg->seqno));
+			else if (pkg->type == rpcmsg_batch)
+				nr = Do_batchMsg(ucid, (const uint8_t*)pmsg, ulen); // all sub-messages point into pmsg
+			else
+				nr = RetSysMsg(ucid, "msgsys,-1,unkown msgtype!", CNetInt::NetUInt(pkg->seqno), true);
+			if (pzs)
+				pzs->release();
+			return nr;
 		}
 		int  Do_shmsg(uint32_t ucid, const void* pmsg, uint32_t msglen, uint32_t seqno)
 		{
@@ -710,14 +1435,34 @@ namespace ec {
 			{
 				if (usri._nstatus != rpcusr_connect)
 					return RetShMsg(ucid, "onconnect,-1,usr status error!", seqno, true);
-				char susr[32], spsw[40] = { 0 }, sinfo[44], sret[128];//"connect,username"
+				char susr[32], spsw[40] = { 0 }, sinfo[44], sret[128], sopt[16], slz4s[16] = { 0 };//"connect,username[,batch][,crc32c][,zlib][,lz4s[-dictid]]"
 				if (!str_getnextstring(',', sd, msglen, pos, susr, sizeof(susr)))
 					return RetShMsg(ucid, "onconnect,-1,msg format error!", seqno, true);
+				bool bbatch = false, bcrc32c = false, bzlib = false, blz4s = false, blz4sdict = false;
+				while (str_getnextstring(',', sd, msglen, pos, sopt, sizeof(sopt))) { // options client support
+					if (!strcmp(sopt, "batch"))
+						bbatch = true;
+					else if (!strcmp(sopt, "crc32c"))
+						bcrc32c = RPC_CRC32C != 0;
+#ifdef RPC_USE_ZLIB
+					else if (!strcmp(sopt, "zlib"))
+						bzlib = true;
+#endif
+					else if (!strncmp(sopt, "lz4s", 4) && _pssmap->IsLz4Stream()) {
+						blz4s = true; // use the dictionary only if the same
+						blz4sdict = sopt[4] == '-' && _pssmap->GetLz4sDictId() && strtoul(&sopt[5], nullptr, 16) == _pssmap->GetLz4sDictId();
+					}
+				}
+				if (blz4sdict)
+					snprintf(slz4s, sizeof(slz4s), ",lz4s-%08X", _pssmap->GetLz4sDictId());
+				else if (blz4s)
+					strcpy(slz4s, ",lz4s");
 				if (static_cast<_CLS*>(this)->getpswd(susr, spsw, sizeof(spsw)) != 0)
 					return RetShMsg(ucid, "onconnect,-1,nouser!", seqno, true);
 				if (!_pssmap->SetUserPsw(susr, ucid, spsw) || !_pssmap->SetUserRandomInfo(ucid, sinfo))
 					return RetShMsg(ucid, "onconnect,-1,system error!", seqno, true);
-				snprintf(sret, sizeof(sret), "onconnect,0,%s", sinfo);//send random info
+				_pssmap->SetPeerOptions(ucid, bbatch, bcrc32c, bzlib, blz4s, blz4sdict);
+				snprintf(sret, sizeof(sret), "onconnect,0,%s,batch%s%s%s", sinfo, bcrc32c ? ",crc32c" : "", bzlib ? ",zlib" : "", slz4s);//send random info and options
 				return RetShMsg(ucid, sret, seqno);
 			}
 			else if (!strcmp(sod, "sha1")) //"sha1,usrcalsha1,login info"
@@ -745,6 +1490,7 @@ namespace ec {
 					return RetShMsg(ucid, sret, seqno, true);
 				}
 				_pssmap->SetUsrStatus(ucid, rpcusr_pass);
+				base_::kill_timer(ucid, XPOLL_TIMER_LOGIN);
 				return RetShMsg(ucid, "onsha1,0", seqno);//success
 			}
 			return RetShMsg(ucid, "msgsh,-1,msg format error!", seqno, true);
@@ -759,12 +1505,35 @@ namespace ec {
 				return RetSysMsg(ucid, "msgsys,-1,please login!", seqno, true);
 			return static_cast<_CLS*>(this)->OnRpcMsg(type, ucid, usrinfo._susr, seqno, pmsg, msglen);
 		}
+		int Do_batchMsg(uint32_t ucid, const uint8_t* pd, size_t len) // unpack to OnRpcMsg one by one
+		{
+			t_rpcuserinfo usrinfo;
+			usrinfo._ucid = ucid;
+			if (!_pssmap->GetUserInfo(&usrinfo))
+				return RetSysMsg(ucid, "msgsys,-1,no ucid!", 0, true);
+			if (usrinfo._nstatus != rpcusr_pass)
+				return RetSysMsg(ucid, "msgsys,-1,please login!", 0, true);
+			t_rpcbatchmsg msg;
+			int nr;
+			while (rpc_batch::next(pd, len, &msg)) {
+				if (msg.type != rpcmsg_request && msg.type != rpcmsg_put)
+					return RetSysMsg(ucid, "msgsys,-1,unkown msgtype!", msg.seqno, true);
+				nr = static_cast<_CLS*>(this)->OnRpcMsg(msg.type, ucid, usrinfo._susr, msg.seqno, msg.pd, msg.size);
+				if (nr)
+					return nr;
+			}
+			if (len)
+				return RetSysMsg(ucid, "msgsys,-1,batch format error!", 0, true);
+			return 0;
+		}
 	protected:
 		void onconnect(uint32_t ucid, const char* sip)//connect event
 		{
 			if (base_::_plog)
 				base_::_plog->add(CLOG_DEFAULT_MSG, "ucid %u connect to port %d  from ip %s", ucid, base_::_srvport, sip);
 			_pssmap->Add(ucid, sip);
+			if (_ulogintimeout)
+				base_::set_timer(ucid, XPOLL_TIMER_LOGIN, _ulogintimeout);
 		}
 		void ondisconnect(uint32_t ucid)//disconnect  event
 		{
@@ -775,17 +1544,20 @@ namespace ec {
 		{
 			if (!pdata || !size)
 				return;
-			vector<uint8_t> msgr(1024 * 16, base_::_pmem);
 			int nr = 0, ndo = 0;
-			nr = _pssmap->DoReadData(ucid, (const unsigned char*)pdata, size, &msgr);
+			nr = _pssmap->DoReadData(ucid, (const unsigned char*)pdata, size, &_msgr);
 			while (nr == 1) {
-				ndo = DoMsg(ucid, &msgr);
+				ndo = DoMsg(ucid, &_msgr);
+				base_::scratch_reset(); // one read can carry many messages, do not grow the arena with all of them
 				if (ndo)
 					break; // error or close
-				nr = _pssmap->DoLeftData(ucid, &msgr);
+				nr = _pssmap->DoLeftData(ucid, &_msgr);
 			};
+			_msgr.clear((size_t)RPC_MSGR_KEEPSIZE);
 			if (nr < 0)
 				base_::close_ucid(ucid);
+			else if (_ubatchsize && !ndo)
+				rpc_flush(ucid); // responses of the messages read
 		}
 		void onsend(uint32_t ucid, int nstatus, void* pdata, size_t size) //send complete event
 		{
@@ -796,6 +1568,16 @@ namespace ec {
 		inline void onself(uint32_t ucid, int optcode, void* pdata, size_t size) {
 			static_cast<_CLS*>(this)->onself(ucid, optcode, pdata, size);
 		};
+		void ontimeout(uint32_t ucid, uint32_t ukind)
+		{
+			if (XPOLL_TIMER_FLUSH == ukind) {
+				rpc_flush(ucid);
+				return;
+			}
+			if (XPOLL_TIMER_LOGIN == ukind && base_::_plog)
+				base_::_plog->add(CLOG_DEFAULT_MSG, "ucid %u login timeout", ucid);
+			base_::ontimeout(ucid, ukind);
+		}
 	};
 #endif
 	template <class _CLS>
@@ -804,7 +1586,9 @@ namespace ec {
 	public:
 		typedef AioTcpClient<RpcAutoClient<_CLS>> base_;
 		friend  base_;
-		RpcAutoClient(cLog* plog, memory* _pmem) : base_(_pmem), _nstatus_con(-1), _bEncrypt(false), _plog(plog), _seqno(1), _rbuf(1024 * 16, _pmem)
+		RpcAutoClient(cLog* plog, memory* _pmem) : base_(_pmem), _nstatus_con(-1), _bEncrypt(false), _plog(plog), _seqno(1), _rbuf(1024 * 16, _pmem),
+			_bcalldiscon(false), _tksweep(0), _vbatch(1024 * 4, _pmem), _tkbatch(0), _ubatchsize(0), _ubatchdelay(RPC_BATCH_DELAY), _bsrvbatch(false),
+			_bcrc32c(false), _blz4s(false), _bzstream(false), _zdict(1024 * 16, nullptr), _uzdictid(0), _bsrvzlib(false)
 		{
 			_susr[0] = 0;
 			_spass[0] = 0;
@@ -824,19 +1608,93 @@ namespace ec {
 		inline void stop()
 		{
 			base_::close();
+			_pending.sweep(rpc_call_disconnected, false);
 		}
-		inline bool rpc_request(const void* pd, size_t size, uint32_t seqno, int timeovermsec = 100)
+		inline bool rpc_request(const void* pd, size_t size, uint32_t seqno, int timeovermsec = 100) // seqno with RPC_CALL_SEQFLAG may be taken by rpc_call
 		{
-			return SendRpcMsg(pd, size, rpcmsg_request, (size > 80) ? rpccomp_lz4 : rpccomp_none, seqno, _pswsha1, timeovermsec);
+			return PostRpcMsg(pd, size, rpcmsg_request, seqno, timeovermsec);
 		}
 		inline bool rpc_put(const void* pd, size_t size, uint32_t seqno, int timeovermsec = 100)
 		{
-			return SendRpcMsg(pd, size, rpcmsg_put, (size > 80) ? rpccomp_lz4 : rpccomp_none, _seqno++, _pswsha1, timeovermsec);
+			return PostRpcMsg(pd, size, rpcmsg_put, _seqno++, timeovermsec);
+		}
+		/*!
+		\brief call before start, coalesce request and put not larger than RPC_BATCH_MSGMAX to rpcmsg_batch frame
+		if the server can read it, the frame send when over flushsize bytes, after delaymsec(checked by the next
+		message and the client thread every 100ms at most), after the messages read done, or by rpc_flush.
+		flushsize 0 not coalesce.
+		*/
+		inline void SetBatch(size_t flushsize, uint32_t delaymsec = RPC_BATCH_DELAY)
+		{
+			_ubatchsize = flushsize;
+			_ubatchdelay = delaymsec;
+		}
+		bool rpc_flush(int timeovermsec = 100) // send the coalesced messages now
+		{
+			unique_lock lck(&_batchlock);
+			if (_vbatch.empty())
+				return true;
+			return SendBatch(false, timeovermsec);
+		}
+		/*!
+		\brief async request, fun is called once with the response, timeout or disconnect, no thread blocked per call.
+		the response of this call goes to fun and not to OnClientMsg.
+		\param pseqno [out] seqno of this call, can be nullptr
+		\return false: not sent and fun will not be called
+		*/
+		bool rpc_call(const void* pd, size_t size, rpc_callback fun, int timeoutmsec = RPC_CALL_TIMEOUT, uint32_t* pseqno = nullptr, int timeovermsec = 100)
+		{
+			if (!fun)
+				return false;
+			uint32_t seqno = 0;
+			int i;
+			for (i = 0; i < RPC_CALL_SLOTS; i++) { // seqno with a free slot
+				seqno = next_seqno() | RPC_CALL_SEQFLAG;
+				if (_pending.add(seqno, fun, timeoutmsec))
+					break;
+			}
+			if (i == RPC_CALL_SLOTS)
+				return false;
+			if (pseqno)
+				*pseqno = seqno;
+			if (PostRpcMsg(pd, size, rpcmsg_request, seqno, timeovermsec))
+				return true;
+			rpc_callback fr;
+			return !_pending.take(seqno, fr); // if taken by timeout or disconnect, fun has been called
+		}
+		inline int rpc_pendings() const
+		{
+			return _pending.size();
 		}
 		inline void SetEncrypt(bool bEncrypt)
 		{
 			_bEncrypt = bEncrypt;
 		}
+		/*!
+		\brief call before start, ask LZ4 stream compression in connect, see AioRpcSrv::set_lz4s.
+		pdict is the preloaded dictionary, used when the server has the same one.
+		*/
+		bool SetLz4Stream(bool benable, const void* pdict = nullptr, size_t dictsize = 0)
+		{
+			_blz4s = benable;
+			_zdict.clear();
+			_uzdictid = 0;
+			if (!pdict || !dictsize)
+				return true;
+			if (!_zdict.add((const uint8_t*)pdict, dictsize))
+				return false;
+			_uzdictid = crc32(pdict, (unsigned int)dictsize);
+			return true;
+		}
+		inline void SetCompPolicy(const t_comp_args& args) // call before start, see AioRpcSrv::set_comp_policy
+		{
+			_compolicy.set(args);
+		}
+		void GetCompStats(comp_stats* pst) // compression results of the messages sent
+		{
+			unique_lock lck(&_cstlock);
+			*pst = _cst;
+		}
 		inline bool IsEncrypt()
 		{
 			return _bEncrypt;
@@ -859,13 +1717,101 @@ namespace ec {
 		bool _bEncrypt;
 		cLog * _plog;
 		std::atomic_uint _seqno;
-		vector<uint8_t> _rbuf;
+		iobuf _rbuf;
+		rpc_pending _pending; // async calls
+		std::atomic_bool _bcalldiscon; // fail pending calls in client thread
+		int64_t _tksweep;
+		std::mutex _batchlock; // lock for _vbatch, send with lock to keep order
+		vector<uint8_t> _vbatch; // coalesced messages
+		int64_t _tkbatch; // time of the first message in _vbatch
+		size_t _ubatchsize; // flush size, 0 not coalesce
+		uint32_t _ubatchdelay; // flush delay milliseconds
+		std::atomic_bool _bsrvbatch; // server can read rpcmsg_batch
+		std::atomic_bool _bcrc32c; // CRC-32C for message data, negotiated in connect
+		bool _blz4s; // ask LZ4 stream in connect
+		std::atomic_bool _bzstream; // LZ4 stream negotiated
+		std::mutex _zlock; // lock for _zenc, compress and post with lock to keep order
+		lz4s_encoder _zenc;
+		lz4s_decoder _zdec; // used by the client thread only
+		vector<uint8_t> _zdict; // preloaded dictionary of LZ4 stream
+		uint32_t _uzdictid; // crc32 of _zdict
+		std::atomic_bool _bsrvzlib; // server can decode zlib
+		comp_policy _compolicy;
+		std::mutex _cstlock; // lock for _cst
+		comp_stats _cst; // compression results of the messages sent
 	protected:
-		bool SendRpcMsg(const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress, uint32_t seqno, const uint8_t* pmask, int timeovermsec = 100) {
-			vector<uint8_t> pkg(size + 64, base_::_pmem);
-			if (args_rpc::MakePkg(pd, size, msgtype, compress, seqno, pmask, base_::_pmem, _bEncrypt, &pkg)) {
+		virtual	void dojob()
+		{
+			if (_bcalldiscon.exchange(false)) // before reconnect
+				_pending.sweep(rpc_call_disconnected, false);
+			base_::dojob();
+			int64_t tcur = rpc_pending::nowms();
+			if (tcur - _tksweep >= RPC_CALL_SWEEP_MSEC) {
+				_tksweep = tcur;
+				_pending.sweep(rpc_call_timeout, true);
+			}
+			if (_ubatchsize) {
+				unique_lock lck(&_batchlock);
+				if (!_vbatch.empty() && tcur - _tkbatch >= (int64_t)_ubatchdelay)
+					SendBatch(true, 0);
+			}
+		}
+		bool PostRpcMsg(const void* pd, size_t size, RPCMSGTYPE msgtype, uint32_t seqno, int timeovermsec)
+		{
+			if (!_ubatchsize || !_bsrvbatch)
+				return SendRpcMsg(pd, size, msgtype, rpccomp_lz4, seqno, _pswsha1, timeovermsec);
+			unique_lock lck(&_batchlock);
+			if (size > RPC_BATCH_MSGMAX) { // send the coalesced first, keep order
+				if (!_vbatch.empty())
+					SendBatch(false, timeovermsec);
+				return SendRpcMsg(pd, size, msgtype, rpccomp_lz4, seqno, _pswsha1, timeovermsec);
+			}
+			int64_t tcur = rpc_pending::nowms();
+			if (_vbatch.empty())
+				_tkbatch = tcur;
+			if (!rpc_batch::append(&_vbatch, msgtype, seqno, pd, size))
+				return false;
+			if (_vbatch.size() >= _ubatchsize || tcur - _tkbatch >= (int64_t)_ubatchdelay)
+				return SendBatch(false, timeovermsec);
+			return true;
+		}
+		bool SendBatch(bool bonread, int timeovermsec) // lock with _batchlock, bonread: in client thread
+		{
+			bool br = SendRpcMsg(_vbatch.data(), _vbatch.size(), rpcmsg_batch, rpccomp_lz4, 0, _pswsha1, timeovermsec, bonread);
+			_vbatch.clear();
+			return br;
+		}
+		bool SendRpcMsg(const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress, uint32_t seqno, const uint8_t* pmask,
+			int timeovermsec = 100, bool bonread = false) { // compress not rpccomp_none is chosen by the policy
+			if (compress != rpccomp_none && msgtype >= rpcmsg_request) {
+				uint32_t uentropy = _compolicy.entropy(pd, size);
+				unique_lock lck(&_cstlock);
+				compress = rpc_comp(_compolicy.choose(size, uentropy, &_cst, rpc_comp_methods(_bsrvzlib), _bzstream ? RPC_LZ4S_MINSIZE : 0));
+			}
+			if (msgtype >= rpcmsg_request && _bzstream) {
+				unique_lock lck(&_zlock); // compress and post in order
+				if (_bzstream) {
+					if (PostPkg(pd, size, msgtype, compress, seqno, pmask, timeovermsec, bonread, &_zenc))
+						return true;
+					_zenc.reset(); // the server not get it, start a new stream
+					return false;
+				}
+			}
+			return PostPkg(pd, size, msgtype, compress, seqno, pmask, timeovermsec, bonread, nullptr);
+		}
+		bool PostPkg(const void* pd, size_t size, RPCMSGTYPE msgtype, RPCCOMPRESS compress, uint32_t seqno, const uint8_t* pmask,
+			int timeovermsec, bool bonread, lz4s_encoder* penc) {
+			small_vector<uint8_t, 512> pkg(size + 64, base_::_pmem); // small messages on stack, tcp_post copies
+			int64_t tks = compress != rpccomp_none ? rpc_comp_nowns() : 0;
+			if (args_rpc::MakePkg(pd, size, msgtype, compress, seqno, pmask, base_::_pmem, _bEncrypt, &pkg, _bcrc32c, penc)) {
 				size_t pkglen = pkg.size();
-				return base_::tcp_post(pkg.data(), pkglen, timeovermsec);
+				if (tks) { // time includes CRC
+					t_rpcpkg* ph = (t_rpcpkg*)pkg.data();
+					int64_t tns = rpc_comp_nowns() - tks;
+					unique_lock lck(&_cstlock);
+					_compolicy.report(&_cst, rpc_comp_method(compress), size, ph->comp == rpccomp_none ? size : pkglen - sizeof(t_rpcpkg), tns);
+				}
+				return bonread ? base_::post_onread(pkg.data(), pkglen) : base_::tcp_post(pkg.data(), pkglen, timeovermsec);
 			}
 			return false;
 		}
@@ -877,7 +1823,7 @@ namespace ec {
 		}
 		void  onrecv(const void* pdata, size_t bytesize)
 		{
-			_rbuf.add((const uint8_t*)pdata, bytesize);
+			_rbuf.append(pdata, bytesize);
 			vector<uint8_t> msgr(1024 * 16, base_::_pmem);
 			int nr = DoLeftData(&msgr);
 			while (nr > 0) {
@@ -885,16 +1831,42 @@ namespace ec {
 					break;
 				nr = DoLeftData(&msgr);
 			};
-			_rbuf.shrink(0);
+			if (_ubatchsize) { // messages posted by OnClientMsg and callbacks
+				unique_lock lck(&_batchlock);
+				if (!_vbatch.empty())
+					SendBatch(true, 0);
+			}
 		};
 		void onconnect() {
-			char msgsh[64];
-			snprintf(msgsh, sizeof(msgsh), "connect,%s", _susr);
+			char msgsh[80], slz4s[16] = { 0 };
+			_bsrvbatch = false;
+			_bcrc32c = false;
+			_bsrvzlib = false;
+			if (_ubatchsize) {
+				unique_lock lck(&_batchlock);
+				_vbatch.clear();
+			}
+			if (_blz4s) {
+				unique_lock lck(&_zlock);
+				_bzstream = false;
+				if (_uzdictid)
+					snprintf(slz4s, sizeof(slz4s), ",lz4s-%08X", _uzdictid);
+				else
+					strcpy(slz4s, ",lz4s");
+			}
+#ifdef RPC_USE_ZLIB
+			const char* szlib = ",zlib";
+#else
+			const char* szlib = "";
+#endif
+			snprintf(msgsh, sizeof(msgsh), "connect,%s,batch%s%s%s", _susr, RPC_CRC32C ? ",crc32c" : "", szlib, slz4s);
 			SendShMsg(msgsh, _seqno++);
 			_nstatus_con = 0;
 		}
-		inline void ondisconnect() {
+		inline void ondisconnect() { // called with socket lock, callbacks of pending calls are called later in dojob
 			_nstatus_con = -1;
+			if (_pending.size())
+				_bcalldiscon = true;
 			static_cast<_CLS*>(this)->ondisconnect();
 		}
 	private:
@@ -902,19 +1874,20 @@ namespace ec {
 		{
 			pout->clear();
 			size_t  ulen = _rbuf.size();
-			uint8_t* pu = _rbuf.data();
 			if (ulen < sizeof(t_rpcpkg))
 				return 0;
-			t_rpcpkg* pkg = (t_rpcpkg*)pu;// check head
-			unsigned int c1 = crc32(pu, 20);
-			if (pkg->sync != RPC_SYNC_BYTE || c1 != CNetInt::NetUInt(pkg->crc32head))
+			t_rpcpkg head;
+			_rbuf.peek(&head, sizeof(head));// check head
+			unsigned int c1 = crc32(&head, 20);
+			if (head.sync != RPC_SYNC_BYTE || c1 != CNetInt::NetUInt(head.crc32head))
 				return rpc_c_disconnected_msgerr;
 
-			unsigned int sizemsg = CNetInt::NetUInt(pkg->size_en);
+			unsigned int sizemsg = CNetInt::NetUInt(head.size_en);
 			if (ulen < sizemsg + sizeof(t_rpcpkg))
 				return 0;
-			pout->add(pu, sizemsg + sizeof(t_rpcpkg));
-			_rbuf.erase(0, sizemsg + sizeof(t_rpcpkg));
+			if (!_rbuf.readto(pout, sizemsg + sizeof(t_rpcpkg)))
+				return rpc_c_disconnected_msgerr;
+			t_rpcpkg* pkg = (t_rpcpkg*)pout->data();
 			unsigned char* puc = pout->data() + sizeof(t_rpcpkg);
 			if (pkg->type >= rpcmsg_request) {
 				if (!(pkg->cflag & 0x01)) { // Decrypt
@@ -925,10 +1898,8 @@ namespace ec {
 					for (auto i = u4 * 4u; i < sizemsg; i++)
 						puc[i] ^= _pswsha1[i % 20];
 				}
-				register unsigned int	crc = 0xffffffff;//check data CRC32
-				for (auto i = 0u; i < sizemsg; i++)
-					crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ puc[i]];
-				if (pkg->crc32msg != CNetInt::NetUInt(crc ^ 0xffffffff))
+				unsigned int crc = (pkg->cflag & 0x02) ? crc32c(puc, sizemsg) : crc32(puc, sizemsg); //check data CRC
+				if (pkg->crc32msg != CNetInt::NetUInt(crc))
 					return -1;
 			}
 			else {
@@ -940,6 +1911,11 @@ namespace ec {
 		int DoMsg(vector<uint8_t>* pin)// pin Already verified and decrypted
 		{
 			t_rpcpkg* pkg = (t_rpcpkg*)pin->data();
+			if (pkg->type == rpcmsg_response && (CNetInt::NetUInt(pkg->seqno) & RPC_CALL_SEQFLAG) && _pending.size()) {
+				rpc_callback fun;
+				if (_pending.take(CNetInt::NetUInt(pkg->seqno), fun))
+					return DoCallResponse(pin, fun);
+			}
 			void* pmsg = 0;
 			size_t ulen = 0;
 
@@ -959,6 +1935,12 @@ namespace ec {
 				pmsg = vtmp.data();
 				ulen = udn;
 			}
+			else if (pkg->comp == rpccomp_lz4s) { // decoded to the ring buffer, valid until the next decode
+				size_t uen = CNetInt::NetUInt(pkg->size_en), udn = CNetInt::NetUInt(pkg->size_dn);
+				if (!_bzstream || !(pmsg = (void*)_zdec.decode(pkg->msg, uen, udn, 0 != (pkg->cflag & 0x04))))
+					return rpc_c_disconnected_msgerr;
+				ulen = udn;
+			}
 #ifdef RPC_USE_ZLIB
 			else if (pkg->comp == rpccomp_zlib) {
 				size_t uen = CNetInt::NetUInt(pkg->size_en), udn = CNetInt::NetUInt(pkg->size_dn);
@@ -979,8 +1961,67 @@ namespace ec {
 				pin->add((unsigned char)0);
 				return 0;
 			}
+			else if (pkg->type == rpcmsg_batch)
+				return DoBatchMsg((const uint8_t*)pmsg, ulen);
 			return static_cast<_CLS*>(this)->OnClientMsg((RPCMSGTYPE)pkg->type, CNetInt::NetUInt(pkg->seqno), (unsigned char*)pmsg, ulen);
 		}
+		int DoBatchMsg(const uint8_t* pd, size_t len) // unpack to async calls and OnClientMsg one by one
+		{
+			t_rpcbatchmsg msg;
+			rpc_callback fun;
+			int nr;
+			while (rpc_batch::next(pd, len, &msg)) {
+				if (msg.type == rpcmsg_response && (msg.seqno & RPC_CALL_SEQFLAG) && _pending.size() && _pending.take(msg.seqno, fun)) {
+					vector<uint8_t> vr(1024 * 4, base_::_pmem);
+					if (vr.add(msg.pd, msg.size))
+						fun(rpc_call_ok, msg.seqno, &vr);
+					else
+						fun(rpc_call_msgerr, msg.seqno, nullptr);
+					fun = nullptr;
+					continue;
+				}
+				if (msg.type != rpcmsg_put && msg.type != rpcmsg_response)
+					return rpc_c_disconnected_msgerr;
+				nr = static_cast<_CLS*>(this)->OnClientMsg(msg.type, msg.seqno, msg.pd, msg.size);
+				if (nr)
+					return nr;
+			}
+			return len ? rpc_c_disconnected_msgerr : 0;
+		}
+		int DoCallResponse(vector<uint8_t>* pin, rpc_callback& fun) // hand off the decoded response to async call
+		{
+			t_rpcpkg* pkg = (t_rpcpkg*)pin->data();
+			uint32_t seqno = CNetInt::NetUInt(pkg->seqno);
+			size_t uen = CNetInt::NetUInt(pkg->size_en), udn = CNetInt::NetUInt(pkg->size_dn);
+			if (pkg->comp == rpccomp_none) {
+				pin->erase(0, sizeof(t_rpcpkg));
+				fun(rpc_call_ok, seqno, pin);
+				return 0;
+			}
+			vector<uint8_t> vr(1024 * 4, base_::_pmem); // decode to the buffer handed off
+			uint8_t* pd = vr.append_uninitialized(udn);
+			bool bok = false;
+			if (pd && pkg->comp == rpccomp_lz4)
+				bok = decode_lz4(pkg->msg, uen, pd, &udn);
+			else if (pd && pkg->comp == rpccomp_lz4s && _bzstream) {
+				const void* ps = _zdec.decode(pkg->msg, uen, udn, 0 != (pkg->cflag & 0x04));
+				if (ps) {
+					memcpy(pd, ps, udn);
+					bok = true;
+				}
+			}
+#ifdef RPC_USE_ZLIB
+			else if (pd && pkg->comp == rpccomp_zlib)
+				bok = decode_zlib(pkg->msg, uen, pd, &udn);
+#endif
+			if (!bok) {
+				fun(rpc_call_msgerr, seqno, nullptr);
+				return rpc_c_disconnected_msgerr;
+			}
+			vr.set_size(udn);
+			fun(rpc_call_ok, seqno, &vr);
+			return 0;
+		}
 		int DoMsgSh(const char* ps, size_t len)// return 0: ok ; !=0: error
 		{
 			char sod[32];
@@ -1003,6 +2044,24 @@ namespace ec {
 					static_cast<_CLS*>(this)->OnLoginEvent(rpc_c_disconnected_msgerr);
 					return rpc_c_disconnected_msgerr;
 				}
+				char sopt[16];
+				while (str_getnextstring(',', ps, len, pos, sopt, sizeof(sopt))) { // options server support
+					if (!strcmp(sopt, "batch"))
+						_bsrvbatch = true;
+					else if (!strcmp(sopt, "crc32c"))
+						_bcrc32c = true;
+					else if (!strcmp(sopt, "zlib"))
+						_bsrvzlib = true;
+					else if (!strncmp(sopt, "lz4s", 4) && _blz4s) { // dictionary used if the server echo its id
+						bool bdict = sopt[4] == '-' && _uzdictid && strtoul(&sopt[5], nullptr, 16) == _uzdictid;
+						unique_lock lck(&_zlock);
+						_zenc.setdict(bdict ? _zdict.data() : nullptr, bdict ? _zdict.size() : 0);
+						_zenc.reset();
+						_zdec.setdict(bdict ? _zdict.data() : nullptr, bdict ? _zdict.size() : 0);
+						_zdec.reset();
+						_bzstream = true;
+					}
+				}
 
 				unsigned char  hex[20], uc, sha[44];
 				strcat(sarg, _spass);
@@ -0,0 +1,170 @@
+﻿/*!
+\file c11_shardmap.h
+\author	jiangyong
+\email  kipway@outlook.com
+\update 2018.8.19
+
+eclib class shardmap with c++11. concurrent map for uint32_t ucid keyed sessions,
+N lock-striped shards, each shard is one ec::map and one mutex, different ucids seldom wait each other.
+node address is stable until erase, so the worker owning one ucid (affinity) can keep the pointer.
+
+class shardmap
+
+eclib Copyright (c) 2017-2018, kipway
+source repository : https://github.com/kipway/eclib
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#pragma once
+#include <mutex>
+#include <functional>
+#include "c11_mutex.h"
+#include "c11_memory.h"
+#include "c11_map.h"
+
+#ifndef SHARDMAP_SHARDS
+#	define SHARDMAP_SHARDS 16 // default shards, power of 2
+#endif
+
+namespace ec
+{
+	template<class _Ty,
+		class _Keyeq = key_equal<uint32_t, _Ty>,
+		class _DelVal = del_node<_Ty>,
+		uint32_t _Shards = SHARDMAP_SHARDS>
+		class shardmap
+	{
+		static_assert(_Shards && !(_Shards & (_Shards - 1)) && _Shards <= 1024, "shards must be power of 2");
+	public:
+		typedef _Ty value_type;
+		typedef map<uint32_t, _Ty, _Keyeq, _DelVal> map_type;
+		shardmap(size_t maxsize) : _mem(map_type::size_node(), maxsize, 0, 0, 0, 0, &_memlock)
+		{
+			_ubits = 0;
+			while ((1u << _ubits) < _Shards)
+				_ubits++;
+			unsigned int uhash = 11 + (unsigned int)(maxsize / 3 / _Shards);
+			for (uint32_t i = 0; i < _Shards; i++)
+				new(&_shards[i].m)map_type(uhash, &_mem);
+		}
+		~shardmap()
+		{
+			for (uint32_t i = 0; i < _Shards; i++)
+				_shards[i].m.~map_type();
+		}
+		shardmap(const shardmap&) = delete;
+		shardmap& operator = (const shardmap&) = delete;
+	private:
+		struct t_shard
+		{
+			std::mutex cs;
+			union { // constructed with memory in shardmap()
+				map_type m;
+			};
+			char res[64]; // not share cache line with next shard
+			t_shard() {}
+			~t_shard() {}
+		};
+		t_shard _shards[_Shards];
+		uint32_t _ubits;
+		std::mutex _memlock;
+		memory _mem; // nodes of all shards
+		inline t_shard& shard(uint32_t key)
+		{
+			return _shards[_ubits ? (key * 2654435769U) >> (32 - _ubits) : 0]; // ucids of one xpoll shard have the same low bits
+		}
+	public:
+		bool set(uint32_t key, value_type& v)
+		{
+			t_shard& s = shard(key);
+			unique_lock lck(&s.cs);
+			return s.m.set(key, v);
+		}
+		bool set(uint32_t key, value_type&& v)
+		{
+			t_shard& s = shard(key);
+			unique_lock lck(&s.cs);
+			return s.m.set(key, v);
+		}
+		bool erase(uint32_t key)
+		{
+			t_shard& s = shard(key);
+			unique_lock lck(&s.cs);
+			return s.m.erase(key);
+		}
+		bool get(uint32_t key, value_type& v) // copy out
+		{
+			t_shard& s = shard(key);
+			unique_lock lck(&s.cs);
+			return s.m.get(key, v);
+		}
+		/*!
+		\brief call fun(value_type&) with the shard locked
+		\return false if key not exist
+		*/
+		template<class _Fun>
+		bool apply(uint32_t key, _Fun fun)
+		{
+			t_shard& s = shard(key);
+			unique_lock lck(&s.cs);
+			value_type* pv = s.m.get(key);
+			if (!pv)
+				return false;
+			fun(*pv);
+			return true;
+		}
+		value_type* getnode(uint32_t key) // lock only lookup, the node keep until erase
+		{
+			t_shard& s = shard(key);
+			unique_lock lck(&s.cs);
+			return s.m.get(key);
+		}
+		inline std::mutex* getcs(uint32_t key) // lock of the shard of key, for get_nolock
+		{
+			return &shard(key).cs;
+		}
+		inline value_type* get_nolock(uint32_t key) // caller hold getcs(key)
+		{
+			return shard(key).m.get(key);
+		}
+		size_t size()
+		{
+			size_t n = 0;
+			for (uint32_t i = 0; i < _Shards; i++) {
+				unique_lock lck(&_shards[i].cs);
+				n += _shards[i].m.size();
+			}
+			return n;
+		}
+		void for_each(std::function<void(value_type& val)> fun) // lock shard by shard
+		{
+			for (uint32_t i = 0; i < _Shards; i++) {
+				unique_lock lck(&_shards[i].cs);
+				_shards[i].m.for_each(fun);
+			}
+		}
+		void clear()
+		{
+			for (uint32_t i = 0; i < _Shards; i++) {
+				unique_lock lck(&_shards[i].cs);
+				_shards[i].m.clear();
+			}
+		}
+		void memstat(memory::t_stat* pmap) // memory statistics snapshot of nodes
+		{
+			if (pmap)
+				_mem.stat(*pmap);
+		}
+	};
+}
@@ -2,13 +2,14 @@
 \file c11_tcp.h
 \author	jiangyong
 \email  kipway@outlook.com
-\update 2018.6.24
+\update 2018.8.10
 
 eclibe Asynchronous TCP template class for windows & linux
 
 class AioTcpClient
 class AioTcpSrv
 class AioTcpSrvThread
+class AioTcpAcceptor
 
 eclib Copyright (c) 2017-2018, kipway
 source repository : https://github.com/kipway/eclib
@@ -30,18 +31,28 @@ limitations under the License.
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include "c11_keyval.h"
 #include "c11_log.h"
 #include "c11_netio.h"
 #include "c11_xpoll.h"
 
+#ifndef AIOTCPSRV_EVT_BATCH
+#	define AIOTCPSRV_EVT_BATCH 8 // max complete events get once by worker
+#endif
+
+#ifndef AIOTCPSRV_ACCEPT_BATCH
+#	define AIOTCPSRV_ACCEPT_BATCH 256 // max accept per wakeup, then check thread stop
+#endif
+
 namespace ec
 {
 	template<class _CLS>
 	class AioTcpClient : public cThread // Asynchronous auto reconnect TCP client, for compatible with windows XP, use the select model
 	{
 	public:
-		AioTcpClient(memory* pmem) : _pmem(pmem), _delaytks(0), _cpevt(128, &_cpevtlock), _fd(INVALID_SOCKET), _bconnect(false)
+		AioTcpClient(memory* pmem) : _pmem(pmem), _delaytks(0), _cpevt(128, &_cpevtlock), _fd(INVALID_SOCKET), _bconnect(false),
+			_uhighwater(XPOLL_SEND_HIGH_WATER), _ulowwater(XPOLL_SEND_LOW_WATER), _npostpolicy(XPOLL_POST_BLOCK)
 		{
 			memset(_sip, 0, sizeof(_sip));
 			_port = 0;
@@ -54,7 +65,7 @@ namespace ec
 				return false;
 			if (IsRun())
 				return false;
-			if (!_udpevt.open())
+			if (!_pollevt.open())
 				return false;
 			_delaytks = 0;
 			strncpy(_sip, sip, sizeof(_sip) - 1);
@@ -66,11 +77,27 @@ namespace ec
 		{
 			StopThread();
 			_disconnect(XPOLL_EVT_ST_CLOSE);
-			_udpevt.close();
+			_pollevt.close();
+		}
+		bool set_send_watermark(size_t uhigh, size_t ulow) // send queue watermark bytes, call before open
+		{
+			if (!uhigh || ulow > uhigh || IsRun())
+				return false;
+			_uhighwater = uhigh;
+			_ulowwater = ulow;
+			return true;
+		}
+		void onwritable() // send queue drop below low watermark after post full, override in _CLS to post continue
+		{
+		}
+		inline void set_post_policy(int npolicy) { // XPOLL_POST_XXX, what tcp_post do when send queue full
+			_npostpolicy = npolicy;
 		}
-		bool tcp_post(const void* pdata, size_t bytesize, int timeovermsec = 100) // post send data
+		bool tcp_post(const void* pdata, size_t bytesize, int timeovermsec = 100) // post send data, wait only by XPOLL_POST_BLOCK
 		{
 			int nerr = post_msg(pdata, bytesize);
+			if (XPOLL_POST_BLOCK != _npostpolicy)
+				return nerr > 0;
 			if (nerr < 0)
 				return false;
 			int nt = timeovermsec / 2, i = 0;;
@@ -83,9 +110,11 @@ namespace ec
 			}
 			return nerr > 0;
 		}
-		bool tcp_post(ec::vector<uint8_t> *pd, int timeovermsec = 100) // post send data
+		bool tcp_post(ec::vector<uint8_t> *pd, int timeovermsec = 100) // post send data, wait only by XPOLL_POST_BLOCK
 		{
 			int nerr = post_msg(pd);
+			if (XPOLL_POST_BLOCK != _npostpolicy)
+				return nerr > 0;
 			if (nerr < 0)
 				return false;
 			int nt = timeovermsec / 2, i = 0;;
@@ -140,7 +169,7 @@ namespace ec
 			return true;
 		}
 	private:
-		udpevt _udpevt;
+		pollevt _pollevt;
 		std::mutex _cpevtlock;//lock for _cpevt
 		ec::fifo<t_xpoll_event> _cpevt;//completely event
 
@@ -152,37 +181,74 @@ namespace ec
 		t_xpoll_item _xitem;
 		uint32_t _ucid;
 		std::mutex _slock;//lock for socket
+		size_t _uhighwater, _ulowwater; // send queue watermark bytes
+		int _npostpolicy; // XPOLL_POST_XXX
 
-		int post_msg(const void *pd, size_t size) //return  -1:error; 0:full ; >0: post bytes
+		int check_room(size_t size) // lock with _slock, return -1: disconnect by XPOLL_POST_DISCONNECT; 0:full; 1:can add
+		{
+			t_xpoll_item* pi = &_xitem;
+			uint32_t usize;
+			void* pd;
+			if (XPOLL_POST_DROPOLDEST == _npostpolicy) { // keep head, it may be sending
+				while (pi->sq.full(size, _uhighwater) && nullptr != (pd = pi->sq.drop(1, &usize, _pmem)))
+					_pmem->mem_free(pd);
+			}
+			if (!pi->sq.full(size, _uhighwater))
+				return 1;
+			pi->uflag |= XPOLL_FLAG_WAITWRITABLE;
+			return XPOLL_POST_DISCONNECT == _npostpolicy ? -1 : 0;
+		}
+		int post_msg(const void *pd, size_t size) //return  -1:error; 0:full, over high watermark ; >0: post bytes
 		{
 			if (!_bconnect)
 				return -1;
-			ec::unique_lock lck(&_slock);
-			t_xpoll_item* pi = &_xitem;
-			if ((pi->utail + 1) % XPOLL_SEND_PKG_NUM == pi->uhead) //full
-				return 0;
-			pi->pkg[pi->utail].size = (uint32_t)size;
-			pi->pkg[pi->utail].pd = (uint8_t *)_pmem->mem_malloc(size); //(uint8_t*)pd;
-			if (!pi->pkg[pi->utail].pd)
+			_slock.lock();
+			int nr = check_room(size);
+			if (nr <= 0) {
+				_slock.unlock();
+				if (nr < 0)
+					_disconnect(XPOLL_EVT_ST_ERR);
+				return nr;
+			}
+			void* pmsg = _pmem->mem_malloc(size);
+			if (pmsg)
+				memcpy(pmsg, pd, size);
+			if (!pmsg || !_xitem.sq.add(pmsg, size, _pmem)) {
+				_slock.unlock();
+				if (pmsg)
+					_pmem->mem_free(pmsg);
 				return -1;
-			memcpy(pi->pkg[pi->utail].pd, pd, size);
-			pi->utail = (pi->utail + 1) % XPOLL_SEND_PKG_NUM;
-			_udpevt.set_event();
+			}
+			_slock.unlock();
+			_pollevt.set_event();
 			return (int)size;
 		}
-		int post_msg(ec::vector<uint8_t> *pd) //return  -1:error; 0:full ; >0: post bytes
+		int post_msg(ec::vector<uint8_t> *pd) //return  -1:error; 0:full, over high watermark ; >0: post bytes
 		{
+			if (pd->is_inline()) { // small_vector inline data, post a copy
+				int nr = post_msg(pd->data(), pd->size());
+				if (nr > 0)
+					pd->clear();
+				return nr;
+			}
 			if (!_bconnect)
 				return -1;
-			ec::unique_lock lck(&_slock);
-			t_xpoll_item* pi = &_xitem;
-			if ((pi->utail + 1) % XPOLL_SEND_PKG_NUM == pi->uhead) //full
-				return 0;
+			_slock.lock();
+			int nr = check_room(pd->size());
+			if (nr <= 0) {
+				_slock.unlock();
+				if (nr < 0)
+					_disconnect(XPOLL_EVT_ST_ERR);
+				return nr;
+			}
 			int nret = (int)pd->size();
-			pi->pkg[pi->utail].size = (uint32_t)pd->size();
-			pi->pkg[pi->utail].pd = (uint8_t*)pd->detach_buf();
-			pi->utail = (pi->utail + 1) % XPOLL_SEND_PKG_NUM;
-			_udpevt.set_event();
+			if (!_xitem.sq.add(pd->data(), pd->size(), _pmem)) {
+				_slock.unlock();
+				return -1;
+			}
+			pd->detach_buf();
+			_slock.unlock();
+			_pollevt.set_event();
 			return (int)nret;
 		}
 	protected:
@@ -191,6 +257,7 @@ namespace ec
 			t_xpoll_item t;
 			_slock.lock();
 			t = _xitem;
+			memset(&_xitem.sq, 0, sizeof(_xitem.sq)); // moved to t
 
 			if (INVALID_SOCKET != _xitem.fd) {
 #ifdef _WIN32
@@ -204,11 +271,11 @@ namespace ec
 				static_cast<_CLS*>(this)->ondisconnect();
 			}
 			_slock.unlock();
-			while (t.uhead != t.utail) {
-				add_event(_ucid, XPOLL_EVT_OPT_SEND, status, t.pkg[t.uhead].pd, 0);
-				_udpevt.set_event();
-				t.uhead = (t.uhead + 1) % XPOLL_SEND_PKG_NUM;
-			}		
+			uint32_t usize;
+			while (!t.sq.empty()) {
+				add_event(_ucid, XPOLL_EVT_OPT_SEND, status, t.sq.pop(&usize, _pmem), 0);
+				_pollevt.set_event();
+			}
 		}
 	protected:
 		virtual	void dojob()
@@ -239,7 +306,7 @@ namespace ec
 			FD_ZERO(&fde);
 			FD_ZERO(&fdw);
 
-			FD_SET(_udpevt.getfd(), &fdr);
+			FD_SET(_pollevt.getfd(), &fdr);
 			FD_SET(_fd, &fdr);
 			if(!isempty())
 				FD_SET(_fd, &fdw);
@@ -248,14 +315,14 @@ namespace ec
 			int nret = ::select(0, &fdr, &fdw, &fde, &tv01);
 #else
 			int nfdmax = _fd;
-			if (nfdmax < _udpevt.getfd())
-				nfdmax = _udpevt.getfd();
+			if (nfdmax < _pollevt.getfd())
+				nfdmax = _pollevt.getfd();
 			int nret = ::select(nfdmax + 1, &fdr, &fdw,  &fde, &tv01);
 #endif
 			if (nret <= 0)
 				return;
-			if (FD_ISSET(_udpevt.getfd(), &fdr))			
-				_udpevt.reset_event();
+			if (FD_ISSET(_pollevt.getfd(), &fdr))			
+				_pollevt.reset_event();
 			if (FD_ISSET(_fd, &fde)) {
 				_disconnect(XPOLL_EVT_ST_ERR);
 				return;
@@ -269,7 +336,7 @@ namespace ec
 	private:
 		bool isempty() {
 			ec::unique_lock lck(&_slock);
-			return _xitem.uhead == _xitem.utail;
+			return _xitem.sq.empty();
 		}
 		void add_event(uint32_t ucid, uint8_t opt, uint8_t st, void *pdata, size_t datasize)
 		{
@@ -286,14 +353,14 @@ namespace ec
 		{
 			ec::unique_lock lck(&_slock);
 			t_xpoll_item* p = &_xitem;
-			if (p->uhead != p->utail) //not empty
+			if (!p->sq.empty()) //not empty
 			{
 				ps->ucid = p->ucid;
 				ps->fd = p->fd;
-				ps->upos = p->uhead;
-				ps->usendsize = p->usendsize;
-				ps->pd = p->pkg[p->uhead].pd;
-				ps->usize = p->pkg[p->uhead].size;
+				ps->upos = 0;
+				ps->usendsize = p->sq.usendsize;
+				ps->pd = p->sq.phead->pd;
+				ps->usize = p->sq.phead->size;
 				return true;
 			}
 			return false;
@@ -336,15 +403,25 @@ namespace ec
 			if (nerr > 0) //success
 			{
 				pi->errnum = 0;// reset error counter
+				pi->lasterr = 0;
+				if (pi->sq.empty() || pi->sq.phead->pd != ps->pd) { // disconnected
+					_slock.unlock();
+					return 0;
+				}
+				pi->sq.sent(nerr);
 				if (ps->usendsize == ps->usize)//complete
 				{
-					pi->uhead = (pi->uhead + 1) % XPOLL_SEND_PKG_NUM;//next
-					pi->lasterr = 0;
-					pi->usendsize = 0;
-					_slock.unlock();
-					add_event(ps->ucid, XPOLL_EVT_OPT_SEND, XPOLL_EVT_ST_OK, ps->pd, ps->usendsize);					
-					if (pi->uhead != pi->utail)
+					uint32_t usize;
+					pi->sq.pop(&usize, _pmem);
+					bool bwritable = (pi->uflag & XPOLL_FLAG_WAITWRITABLE) && pi->sq.ubytes <= _ulowwater;
+					if (bwritable)
+						pi->uflag &= ~XPOLL_FLAG_WAITWRITABLE;
+					if (!pi->sq.empty())
 						nret = 1;
+					_slock.unlock();
+					add_event(ps->ucid, XPOLL_EVT_OPT_SEND, XPOLL_EVT_ST_OK, ps->pd, ps->usendsize);
+					if (bwritable)
+						add_event(ps->ucid, XPOLL_EVT_OPT_WRITABLE, XPOLL_EVT_ST_OK, nullptr, 0);
 					return nret;
 				}
 				else
@@ -406,7 +483,9 @@ namespace ec
 			t_xpoll_event evt;
 			memset(&evt, 0, sizeof(evt));
 			while (_cpevt.get(evt)) {
-				if (evt.pdata)
+				if (XPOLL_EVT_OPT_WRITABLE == evt.opt)
+					static_cast<_CLS*>(this)->onwritable();
+				else if (evt.pdata)
 					_pmem->mem_free(evt.pdata);//free memory				
 			}
 		}
@@ -423,13 +502,66 @@ namespace ec
 	{
 	public:
 		AioTcpSrvThread(xpoll* ppoll, ec::cLog* plog, memory* pmem, int threadno, uint16_t srvport) :
-			_pmem(pmem), _ppoll(ppoll), _plog(plog), _threadno(threadno), _srvport(srvport) {
+			_pmem(pmem), _ppoll(ppoll), _plog(plog), _threadno(threadno), _srvport(srvport), _nqueue(0), _npostpolicy(XPOLL_POST_BLOCK), _scratch(pmem) {
+		}
+		inline void set_queue(uint32_t nqueue) { // set complete event queue number of xpoll, used by affinity dispatch
+			_nqueue = nqueue;
 		}
-		inline int get_unsends(uint32_t ucid) { // Get the number of unfinished packages , < XPOLL_SEND_PKG_NUM,used for server put message
+		inline int get_unsends(uint32_t ucid) { // Get the number of unfinished packages,used for server put message
 			return _ppoll->sendnodone(ucid);
 		}
-		bool tcp_post(uint32_t ucid, void* pdata, size_t bytesize, int timeovermsec = 100) // post data, warning: zero copy, direct put pdata pointer to send buffer
+		inline int64_t get_unsendbytes(uint32_t ucid) { // Get the bytes not sent, post full when over high watermark
+			return _ppoll->sendbytes(ucid);
+		}
+		void onwritable(uint32_t ucid) // send queue drop below low watermark after post full, override in _CLS to post continue
+		{
+			(void)ucid;
+		}
+		void ontimeout(uint32_t ucid, uint32_t ukind) // timer ukind(XPOLL_TIMER_XXX) expired, override in _CLS, default disconnect
+		{
+			(void)ukind;
+			disconnect(ucid);
+		}
+		inline bool set_timer(uint32_t ucid, uint32_t ukind, uint32_t umsec) { // set or restart timer XPOLL_TIMER_XXX, ontimeout called by this worker when expired
+			return _ppoll->set_timer(ucid, ukind, umsec);
+		}
+		inline bool kill_timer(uint32_t ucid, uint32_t ukind) {
+			return _ppoll->kill_timer(ucid, ukind);
+		}
+		inline void set_post_policy(int npolicy) { // XPOLL_POST_XXX, what tcp_post do when send queue full
+			_npostpolicy = npolicy;
+		}
+		inline int get_post_policy() {
+			return _npostpolicy;
+		}
+		/*!
+		\brief post data and return at once, warning: zero copy, direct put pdata pointer to send buffer
+		\return XPOLL_POST_QUEUED; XPOLL_POST_WOULDBLOCK: full, caller own pdata, onwritable(ucid) when drained; XPOLL_POST_ERR: caller own pdata
+		*/
+		inline int tcp_trypost(uint32_t ucid, void* pdata, size_t bytesize)
+		{
+			return _ppoll->post_msg(ucid, pdata, bytesize, _npostpolicy);
+		}
+		inline int tcp_trypost(uint32_t ucid, vector<uint8_t> *pvd)
 		{
+			return _ppoll->post_msg(ucid, pvd, _npostpolicy);
+		}
+		inline int tcp_trypost(uint32_t ucid, shared_buffer* pbuf) // add one reference when queued, the caller still own its reference
+		{
+			return _ppoll->post_shared(ucid, pbuf, _npostpolicy);
+		}
+		/*!
+		\brief post one shared buffer to many ucids without copy, never wait, the caller still own its reference
+		\return number of ucids queued
+		*/
+		inline size_t tcp_post_shared(const uint32_t* pucids, size_t n, shared_buffer* pbuf)
+		{
+			return _ppoll->post_shared(pucids, n, pbuf, _npostpolicy);
+		}
+		bool tcp_post(uint32_t ucid, void* pdata, size_t bytesize, int timeovermsec = 100) // post data, warning: zero copy, direct put pdata pointer to send buffer. wait only by XPOLL_POST_BLOCK
+		{
+			if (XPOLL_POST_BLOCK != _npostpolicy)
+				return XPOLL_POST_QUEUED == tcp_trypost(ucid, pdata, bytesize);
 			int nerr = _ppoll->post_msg(ucid, pdata, bytesize);
 			if (nerr < 0)
 				return false;
@@ -443,8 +575,10 @@ namespace ec
 			}
 			return nerr > 0;
 		}
-		bool tcp_post(uint32_t ucid, vector<uint8_t> *pvd, int timeovermsec = 100) // post data, warning: zero copy, direct put pdata pointer to send buffer
+		bool tcp_post(uint32_t ucid, vector<uint8_t> *pvd, int timeovermsec = 100) // post data, warning: zero copy, direct put pdata pointer to send buffer. wait only by XPOLL_POST_BLOCK
 		{
+			if (XPOLL_POST_BLOCK != _npostpolicy)
+				return XPOLL_POST_QUEUED == tcp_trypost(ucid, pvd);
 			int nerr = _ppoll->post_msg(ucid, pvd);
 			if (nerr < 0)
 				return false;
@@ -473,17 +607,32 @@ namespace ec
 		inline void disconnect(uint32_t ucid) {
 			_ppoll->remove(ucid);
 		}
+		inline void* scratch_alloc(size_t size) { // temporary buffer valid until the current event returns or scratch_reset, call in this worker only
+			return _scratch.alloc(size);
+		}
+		inline void scratch_reset() { // give back all scratch_alloc of the current event, for handlers doing many messages in one event
+			_scratch.reset();
+		}
 	protected:
 		memory * _pmem;
 		xpoll * _ppoll;
 		cLog* _plog;
 		int _threadno;
 		uint16_t _srvport;
+		uint32_t _nqueue; // complete event queue number
+		int _npostpolicy; // XPOLL_POST_XXX
+		scratch_arena _scratch; // temporary buffers of one event, reset after each event
 	protected:
 		virtual	void dojob() {
-			t_xpoll_event evt;
-			if (!_ppoll->get_event(&evt))
-				return;
+			t_xpoll_event evts[AIOTCPSRV_EVT_BATCH];
+			size_t i, n = _ppoll->get_events(evts, AIOTCPSRV_EVT_BATCH, _nqueue);
+			scratch_arena::current() = &_scratch;
+			for (i = 0; i < n; i++) {
+				doevent(evts[i]);
+				_scratch.reset();
+			}
+		}
+		void doevent(t_xpoll_event &evt) {
 			if (XPOLL_EVT_OPT_READ == evt.opt) {
 				if (XPOLL_EVT_ST_CONNECT == evt.status) {
 					txtkeyval kv((const char*)evt.pdata, evt.ubytes);
@@ -502,10 +651,31 @@ namespace ec
 			}
 			else if (XPOLL_EVT_OPT_SEND == evt.opt)
 				static_cast<_CLS*>(this)->onsend(evt.ucid, evt.status, evt.pdata, evt.ubytes);
+			else if (XPOLL_EVT_OPT_WRITABLE == evt.opt)
+				static_cast<_CLS*>(this)->onwritable(evt.ucid);
+			else if (XPOLL_EVT_OPT_TIMEOUT == evt.opt)
+				static_cast<_CLS*>(this)->ontimeout(evt.ucid, evt.status);
 			else
 				static_cast<_CLS*>(this)->onself(evt.ucid, evt.opt, evt.pdata, evt.ubytes);
 			_ppoll->free_event(&evt);// free read buffer
-			return;
+		}
+	};
+
+	class AioTcpAcceptor : public cThread // accept thread for one SO_REUSEPORT listen fd
+	{
+	public:
+		AioTcpAcceptor(SOCKET fd, int nshard, std::function<void(SOCKET fd, int nshard)> fun) : _fd(fd), _nshard(nshard), _fun(fun) {
+		}
+		inline SOCKET getfd() {
+			return _fd;
+		}
+	protected:
+		SOCKET _fd;
+		int _nshard;
+		std::function<void(SOCKET fd, int nshard)> _fun;
+	protected:
+		virtual	void dojob() {
+			_fun(_fd, _nshard);
 		}
 	};
 
@@ -514,10 +684,20 @@ namespace ec
 	{
 	public:
 		AioTcpSrv(uint32_t maxconnum, ec::cLog* plog, memory* pmem, void* pappcls = nullptr, void* pargs = nullptr) : _pmem(pmem), _bkeepalivefast(false), _busebnagle(true), _wport(0),
-			_plog(plog), _poll(maxconnum) {
+			_plog(plog), _umaxconnum(maxconnum), _unextpoll(0), _nlisteners(1), _nbacklog(SOMAXCONN), _fd_listen(INVALID_SOCKET), _nshard(-1), _baffinity(false),
+			_usendhigh(XPOLL_SEND_HIGH_WATER), _usendlow(XPOLL_SEND_LOW_WATER), _npostpolicy(XPOLL_POST_BLOCK), _uidlems(0),
+			_umemarena(0), _nnumanodes(0) {
+		}
+		virtual ~AioTcpSrv() {
+			_polls.for_each([](xpoll* &pp) {
+				delete pp;
+			});
+			_polls.clear();
 		}
 		inline int getsendnodone(uint32_t ucid) { // get send not done pkg number
-			return _poll.sendnodone(ucid);
+			if (_polls.empty())
+				return -1;
+			return _polls[0]->sendnodone(ucid);
 		}
 	protected:
 		inline void InitArgs(_THREAD* pthread) {
@@ -531,30 +711,160 @@ namespace ec
 		bool	_busebnagle;
 		uint16_t _wport;
 
-		xpoll	_poll;
-		SOCKET	_fd_listen;
+		uint32_t _umaxconnum; // max connections of all shards
+		std::atomic<uint32_t> _unextpoll;  // next shard for accepted socket
+		ec::Array<xpoll*, XPOLL_MAX_SHARDS> _polls; // xpoll shards, one poll thread per shard
+		int _nlisteners; // listen fds number, >1 use SO_REUSEPORT; 0: one per reactor
+		int _nbacklog;   // listen backlog
+		SOCKET	_fd_listen; // listen fd of this thread, shard 0 when one listener per reactor
+		int _nshard; // shard of _fd_listen, -1: round robin
+		ec::Array<AioTcpAcceptor*, XPOLL_MAX_SHARDS> _acceptors; // other listeners
+		bool _baffinity; // each ucid bind to one worker, events of one ucid done in order
+		size_t _usendhigh, _usendlow; // send queue watermark bytes per connect
+		int _npostpolicy; // XPOLL_POST_XXX for workers
+		uint32_t _uidlems; // idle timeout milliseconds of new connects, 0 none
+		uint32_t _umemarena; // MEM_ARENA_XXX for read memory of shards
+		int _nnumanodes; // shard i read memory prefer NUMA node i % _nnumanodes, 0 none
 
 		ec::Array<_THREAD*, MAX_XPOLLTCPSRV_THREADS> _workers;
 	public:
-		bool start(uint16_t port, int workthreadnum, const char* sip = nullptr)
+		/*!
+		\brief set accept options, call before start
+		\param nlisteners listen fds number. >1 bind nlisteners fds with SO_REUSEPORT, each has an accept thread, the kernel
+			spread connections across them; 0: one listener per reactor, listener i add fds to shard i.
+			windows or no SO_REUSEPORT always use 1
+		\param nbacklog listen backlog
+		*/
+		void set_accept(int nlisteners, int nbacklog = SOMAXCONN)
+		{
+			_nlisteners = nlisteners;
+			_nbacklog = nbacklog > 0 ? nbacklog : SOMAXCONN;
+		}
+		/*!
+		\brief set affinity dispatch mode, call before start
+		each worker has its own complete event queue, ucid bind to one worker by hash,
+		so all events of one ucid done in order by one worker and session maps can parse without global lock
+		*/
+		void set_affinity(bool baffinity)
+		{
+			if (!IsRun())
+				_baffinity = baffinity;
+		}
+		inline bool is_affinity()
+		{
+			return _baffinity;
+		}
+		/*!
+		\brief set send queue watermark bytes per connect, call before start
+		tcp_post return full when queued bytes over uhigh, then worker onwritable(ucid) called when queued bytes drop to ulow
+		*/
+		bool set_send_watermark(size_t uhigh, size_t ulow)
+		{
+			if (!uhigh || ulow > uhigh || IsRun())
+				return false;
+			_usendhigh = uhigh;
+			_usendlow = ulow;
+			return true;
+		}
+		/*!
+		\brief set what workers tcp_post do when send queue full, call before start
+		\param npolicy XPOLL_POST_BLOCK: wait until timeout(default); XPOLL_POST_NOWAIT: return false at once;
+			XPOLL_POST_DROPOLDEST: drop oldest not sending messages; XPOLL_POST_DISCONNECT: disconnect the slow consumer
+		*/
+		void set_post_policy(int npolicy)
+		{
+			if (!IsRun())
+				_npostpolicy = npolicy;
+		}
+		/*!
+		\brief set idle timeout of new connects, call before start, 0 none
+		no read and send over umsec, worker ontimeout(ucid, XPOLL_TIMER_IDLE) called, default disconnect
+		*/
+		void set_idle_timeout(uint32_t umsec)
+		{
+			if (!IsRun())
+				_uidlems = umsec;
+		}
+		/*!
+		\brief set arena of shards read memory, call before start
+		\param uflags MEM_ARENA_XXX
+		\param nnumanodes >0: shard i prefer NUMA node i % nnumanodes; 0 none
+		*/
+		void set_memarena(uint32_t uflags, int nnumanodes = 0)
+		{
+			if (!IsRun()) {
+				_umemarena = uflags;
+				_nnumanodes = nnumanodes;
+			}
+		}
+		/*!
+		\brief start server
+		\param reactors number of xpoll shards(poll threads), accepted sockets are spread across shards,
+			worker i bind to shard i % reactors, so reactors <= workthreadnum
+		*/
+		bool start(uint16_t port, int workthreadnum, const char* sip = nullptr, int reactors = 1)
 		{
 			if (IsRun())
 				return true;
+			int i, n = workthreadnum;
+			if (n > MAX_XPOLLTCPSRV_THREADS)
+				n = MAX_XPOLLTCPSRV_THREADS;
+			int nr = reactors;
+			if (nr > n)
+				nr = n;
+			if (nr > XPOLL_MAX_SHARDS)
+				nr = XPOLL_MAX_SHARDS;
+			if (nr < 1)
+				nr = 1;
+			int nl = _nlisteners;
+#ifdef SO_REUSEPORT
+			if (!nl)
+				nl = nr;
+			if (nl > XPOLL_MAX_SHARDS)
+				nl = XPOLL_MAX_SHARDS;
+#endif
+			if (nl < 1)
+				nl = 1;
+#ifndef SO_REUSEPORT
+			nl = 1;
+#endif
 			_wport = port;
-			_fd_listen = listen_port(port, sip);
+			_fd_listen = listen_port(port, sip, nl > 1);
 			if (_fd_listen == INVALID_SOCKET)
 				return  false;
-			if (!_poll.open()) {
+			if (!open_polls(nr, n)) {
 				::closesocket(_fd_listen);
 				_fd_listen = INVALID_SOCKET;
 				return false;
 			}
-			int i, n = workthreadnum;
-			if (n > MAX_XPOLLTCPSRV_THREADS)
-				n = MAX_XPOLLTCPSRV_THREADS;
+			int nshard = nl == nr && nr > 1 ? 0 : -1; // -1: round robin
+			SOCKET fds[XPOLL_MAX_SHARDS];
+			int nfds = 1;
+			for (i = 1; i < nl; i++) {
+				fds[nfds] = listen_port(port, sip, true); // bind and listen errors logged by listen_port
+				if (fds[nfds] == INVALID_SOCKET) {
+					if (_plog)
+						_plog->add(CLOG_DEFAULT_ERR, "TCP port %u only %d of %d SO_REUSEPORT listeners opened, accept round robin", port, nfds, nl);
+					break;
+				}
+				nfds++;
+			}
+			if (nfds < nl) // shards without their own listener get fds from the others by round robin
+				nshard = -1;
+			_nshard = nshard;
+			for (i = 1; i < nfds; i++) {
+				AioTcpAcceptor* pa = new AioTcpAcceptor(fds[i], nshard < 0 ? -1 : i, [this](SOCKET fdl, int ns) {
+					accept_fds(fdl, ns);
+				});
+				pa->StartThread(nullptr);
+				_acceptors.add(pa);
+			}
 			_THREAD* p;
 			for (i = 0; i < n; i++) {
-				p = new _THREAD(&_poll, _plog, _pmem, i, port);
+				p = new _THREAD(_polls[i % nr], _plog, _pmem, i, port);
+				if (_baffinity)
+					p->set_queue(i / nr); // worker i use queue i / nr of shard i % nr
+				p->set_post_policy(_npostpolicy);
 				InitArgs(p);
 				p->StartThread(nullptr);
 				_workers.add(p);
@@ -564,15 +874,21 @@ namespace ec
 		}
 		bool post_self_event(uint32_t ucid, uint8_t optcode, void *pdata, size_t datasize) // post self event, optcode >= XPOLL_EVT_OPT_APP
 		{
-			if (optcode < XPOLL_EVT_OPT_APP)
+			if (optcode < XPOLL_EVT_OPT_APP || _polls.empty())
 				return false;
-			_poll.add_event(ucid, optcode, 0, pdata, datasize);
+			_polls[0]->add_event(ucid, optcode, 0, pdata, datasize); // route to shard by ucid
 			return true;
 		}
 		void stop()
 		{
-			if (_fd_listen) {
+			if (_fd_listen != INVALID_SOCKET) {
 				StopThread(); //stop accpet thread
+				_acceptors.for_each([](AioTcpAcceptor* &pa) {
+					pa->StopThread();
+					::closesocket(pa->getfd());
+					delete pa;
+				});
+				_acceptors.clear();
 #ifdef _WIN32
 				shutdown(_fd_listen, SD_BOTH);
 #else
@@ -580,24 +896,69 @@ namespace ec
 #endif
 				::closesocket(_fd_listen);
 
-				_poll.close();//close fds in poll
-
-				while (_poll.has_event()) // wait for all events done
-					std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				_polls.for_each([](xpoll* &pp) {
+					pp->close();//close fds in poll
+				});
+				_polls.for_each([](xpoll* &pp) {
+					while (pp->has_event()) // wait for all events done
+						std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				});
 
 				_workers.for_each([](_THREAD* &pt) {
 					pt->StopThread();
 					delete pt;
 				});//stop all workers
 				_workers.clear();
+				_polls.for_each([](xpoll* &pp) {
+					delete pp;
+				});
+				_polls.clear();
 				_fd_listen = INVALID_SOCKET;
 		}
 	}
 	private:
-		SOCKET listen_port(unsigned short wport, const char* sip = nullptr)
+		bool open_polls(int nshards, int nworkers)
+		{
+			int i;
+			uint32_t umax = (_umaxconnum + nshards - 1) / nshards;
+			for (i = 0; i < nshards; i++)
+				_polls.add(new xpoll(umax));
+			for (i = 0; i < nshards; i++) {
+				_polls[i]->set_shards(i, _polls.data(), nshards);
+				_polls[i]->set_watermark(_usendhigh, _usendlow);
+				_polls[i]->set_idle_timeout(_uidlems);
+				if (_umemarena || _nnumanodes > 0)
+					_polls[i]->set_memarena(_umemarena, _nnumanodes > 0 ? i % _nnumanodes : -1);
+				if (_baffinity)
+					_polls[i]->set_queues((nworkers - i + nshards - 1) / nshards); // one queue per worker of this shard
+				if (!_polls[i]->open())
+					break;
+			}
+			if (i == nshards)
+				return true;
+			while (i > 0)
+				_polls[--i]->close();
+			_polls.for_each([](xpoll* &pp) {
+				delete pp;
+			});
+			_polls.clear();
+			return false;
+		}
+		bool add_fd(SOCKET fd, const char* sinfo, int nshard) // add to shard nshard, or round robin if nshard < 0, try next shard if full
+		{
+			uint32_t i, n = (uint32_t)_polls.size();
+			if (nshard >= 0 && nshard < (int)n && _polls[nshard]->add_fd(fd, sinfo))
+				return true;
+			for (i = 0; i < n; i++) {
+				if (_polls[_unextpoll++ % n]->add_fd(fd, sinfo))
+					return true;
+			}
+			return false;
+		}
+		SOCKET listen_port(unsigned short wport, const char* sip = nullptr, bool breuseport = false)
 		{
 			if (!wport)
-				return false;
+				return INVALID_SOCKET;
 			SOCKET sl = INVALID_SOCKET;
 			struct sockaddr_in	netaddr;
 #ifdef _WIN32
@@ -609,7 +970,7 @@ namespace ec
 				if (_plog)
 					_plog->add(CLOG_DEFAULT_ERR, "TCP port %u socket error!", wport);
 				fprintf(stderr, "TCP port %u socket error!\n", wport);
-				return false;
+				return INVALID_SOCKET;
 			}
 			netaddr.sin_family = AF_INET;
 			if (!sip || !sip[0])
@@ -617,7 +978,15 @@ namespace ec
 			else
 				netaddr.sin_addr.s_addr = inet_addr(sip);
 			netaddr.sin_port = htons(wport);
-
+#ifdef SO_REUSEPORT
+			int nreuse = 1;
+			if (breuseport && setsockopt(sl, SOL_SOCKET, SO_REUSEPORT, (const char*)&nreuse, sizeof(nreuse)) == SOCKET_ERROR) {
+				::closesocket(sl);
+				if (_plog)
+					_plog->add(CLOG_DEFAULT_ERR, "TCP port [%d] set SO_REUSEPORT failed with error %d", wport, errno);
+				return INVALID_SOCKET;
+			}
+#endif
 			if (bind(sl, (const sockaddr *)&netaddr, sizeof(netaddr)) == SOCKET_ERROR)
 			{
 				::closesocket(sl);
@@ -626,7 +995,7 @@ namespace ec
 				fprintf(stderr, "ERR:TCP port [%d] bind failed with error %d\n", wport, errno);
 				return INVALID_SOCKET;
 			}
-			if (listen(sl, SOMAXCONN) == SOCKET_ERROR)
+			if (listen(sl, _nbacklog) == SOCKET_ERROR)
 			{
 				::closesocket(sl);
 				if (_plog)
@@ -634,62 +1003,92 @@ namespace ec
 				fprintf(stderr, "ERR: TCP port %d  listen failed with error %d\n", wport, errno);
 				return INVALID_SOCKET;
 			}
+#ifdef _WIN32
+			u_long ul = 1;
+			if (SOCKET_ERROR == ioctlsocket(sl, FIONBIO, &ul))
+#else
+			int nv = 1;
+			if (ioctl(sl, FIONBIO, &nv) == -1)
+#endif
+			{
+				::closesocket(sl);
+				if (_plog)
+					_plog->add(CLOG_DEFAULT_ERR, "TCP port %d set nonblocking failed with error %d", wport, errno);
+				return INVALID_SOCKET;
+			}
 			return sl;
 		}
-
-	protected:
-		virtual	void dojob()// accept thread
+		void accept_fds(SOCKET fdl, int nshard) // wait listen fd readable, then accept until EAGAIN
 		{
-			int nRet;
-			SOCKET	sAccept;
-			struct  sockaddr_in		 addrClient;
-			int		nClientAddrLen = sizeof(addrClient);
-
-			TIMEVAL tv01 = { 1,0 };
-			fd_set fdr;
-			FD_ZERO(&fdr);
-			FD_SET(_fd_listen, &fdr);
+			pollfd pfd;
+			pfd.fd = fdl;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
 #ifdef _WIN32
-			nRet = ::select(0, &fdr, NULL, NULL, &tv01);
+			int nret = WSAPoll(&pfd, 1, 1000);
 #else
-			nRet = ::select(_fd_listen + 1, &fdr, NULL, NULL, &tv01);
+			int nret = poll(&pfd, 1, 1000);
 #endif
-			if (!nRet || !FD_ISSET(_fd_listen, &fdr))
+			if (nret <= 0 || !(pfd.revents & POLLIN))
 				return;
+			SOCKET	sAccept;
+			struct  sockaddr_in		 addrClient;
+			char sip[32], sinfo[48];
+			for (int i = 0; i < AIOTCPSRV_ACCEPT_BATCH; i++) {
 #ifdef _WIN32
-			if ((sAccept = ::accept(_fd_listen, (struct sockaddr*)(&addrClient), &nClientAddrLen)) == INVALID_SOCKET)
-				return;
-			unsigned long ul = 1;
-			if (SOCKET_ERROR == ioctlsocket(sAccept, FIONBIO, (unsigned long*)&ul)) {
-				::closesocket(sAccept);
-				return;
-			}
+				int nClientAddrLen = sizeof(addrClient);
+				if ((sAccept = ::accept(fdl, (struct sockaddr*)(&addrClient), &nClientAddrLen)) == INVALID_SOCKET)
+					return; // WSAEWOULDBLOCK or error
+				u_long ul = 1;
+				if (SOCKET_ERROR == ioctlsocket(sAccept, FIONBIO, &ul)) {
+					::closesocket(sAccept);
+					continue;
+				}
 #else
-			if ((sAccept = ::accept(_fd_listen, (struct sockaddr*)(&addrClient), (socklen_t*)&nClientAddrLen)) == INVALID_SOCKET)
-				return;
-			int nv = 1;
-			if (ioctl(sAccept, FIONBIO, &nv) == -1) {
-				::closesocket(sAccept);
-				return;
-			}
+				socklen_t nClientAddrLen = sizeof(addrClient);
+#	ifdef __linux__
+				sAccept = ::accept4(fdl, (struct sockaddr*)(&addrClient), &nClientAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#	else
+				sAccept = ::accept(fdl, (struct sockaddr*)(&addrClient), &nClientAddrLen);
+#	endif
+				if (sAccept == INVALID_SOCKET) {
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+					if (errno == EMFILE || errno == ENFILE) // no fd, wait fds release
+						std::this_thread::sleep_for(std::chrono::milliseconds(10));
+					return; // EAGAIN or error
+				}
+#	ifndef __linux__
+				int nv = 1;
+				if (ioctl(sAccept, FIONBIO, &nv) == -1) {
+					::closesocket(sAccept);
+					continue;
+				}
+#	endif
 #endif
-			char        sip[32] = { 0 };
-			snprintf(sip, sizeof(sip), "ip:%s\n", inet_ntoa(addrClient.sin_addr));
-			sip[sizeof(sip) - 1] = 0;
+				if (!inet_ntop(AF_INET, &addrClient.sin_addr, sip, sizeof(sip)))
+					sip[0] = 0;
+				snprintf(sinfo, sizeof(sinfo), "ip:%s\n", sip);
+				sinfo[sizeof(sinfo) - 1] = 0;
 
-			netio_setkeepalive(sAccept, _bkeepalivefast);
-			if (!_busebnagle)
-				netio_tcpnodelay(sAccept);
-			if (!_poll.add_fd(sAccept, sip)) { // add to xpoll
+				netio_setkeepalive(sAccept, _bkeepalivefast);
+				if (!_busebnagle)
+					netio_tcpnodelay(sAccept);
+				if (!add_fd(sAccept, sinfo, nshard)) { // add to xpoll shard
 #ifdef _WIN32
-				shutdown(sAccept, SD_BOTH);
+					shutdown(sAccept, SD_BOTH);
 #else
-				shutdown(sAccept, SHUT_WR);
+					shutdown(sAccept, SHUT_WR);
 #endif
-				::closesocket(sAccept);
-				return;
+					::closesocket(sAccept);
+				}
+			}
+		}
+	protected:
+		virtual	void dojob()// accept thread
+		{
+			accept_fds(_fd_listen, _nshard);
 		}
-};
 	};
 #endif
 } // namespace ec
@@ -39,6 +39,10 @@ limitations under the License.
 #include "c11_tls12.h"
 #include "c11_tcp.h"
 
+#ifndef TLS_HANDSHAKE_TIMEOUT
+#	define TLS_HANDSHAKE_TIMEOUT (10 * 1000) // server handshake timeout milliseconds
+#endif
+
 namespace ec {
 
 	class args_tlsthread {
@@ -69,14 +73,14 @@ namespace ec {
 			static_cast<_CLS*>(this)->InitArgs(pthread);
 		}
 	public:
-		bool start(const char* filecert, const char* filerootcert, const char* fileprivatekey, uint16_t port, int workthreadnum, const char* sip = nullptr)
+		bool start(const char* filecert, const char* filerootcert, const char* fileprivatekey, uint16_t port, int workthreadnum, const char* sip = nullptr, int reactors = 1)
 		{
 			if (!_ca.InitCert(filecert, filerootcert, fileprivatekey)) {
 				if (base_::_plog)
 					base_::_plog->add(CLOG_DEFAULT_ERR, "Load certificate failed! port(%u)", port);
 				return false;
 			}
-			if (!base_::start(port, workthreadnum, sip)) {
+			if (!base_::start(port, workthreadnum, sip, reactors)) {
 				if (base_::_plog)
 					base_::_plog->add(CLOG_DEFAULT_ERR, "Start server port(%u) failed!", port);
 				return false;
@@ -98,6 +102,9 @@ namespace ec {
 			base_(ppoll, plog, pmem, threadno, srvport)
 		{
 		}
+		inline void set_post_policy(int npolicy) { // tls records are sequenced, can not drop, disconnect instead
+			base_::set_post_policy((XPOLL_POST_NOWAIT == npolicy || XPOLL_POST_DROPOLDEST == npolicy) ? XPOLL_POST_DISCONNECT : npolicy);
+		}
 		void InitTlsArgs(args_tlsthread* pargs) {
 			_pca = pargs->_pca;
 			_psss = pargs->_psss;
@@ -109,7 +116,7 @@ namespace ec {
 	public:
 		bool tls_post(uint32_t ucid, const void* pdata, size_t size, int waitmsec = 100)
 		{
-			ec::unique_lock lck(_psss->getcs());
+			ec::unique_lock lck(_psss->getcs(ucid));
 			vector<uint8_t> pkg(88 * (size / TLS_CBCBLKSIZE) + size + 88 - size % 88, base_::_pmem);
 			if (!_psss->mkr_appdata(ucid, &pkg, pdata, size))
 				return false;
@@ -128,6 +135,7 @@ namespace ec {
 				return;
 			ps->SetIP(sip);
 			_psss->Add(ucid, ps);
+			base_::set_timer(ucid, XPOLL_TIMER_HANDSHAKE, TLS_HANDSHAKE_TIMEOUT);
 			static_cast<_CLS*>(this)->onconnect(ucid, sip);
 		}
 		void ondisconnect(uint32_t ucid)//disconnect  event
@@ -148,6 +156,7 @@ namespace ec {
 					base_::close_ucid(ucid);// close graceful
 			}
 			else if (TLS_SESSION_HKOK == nst) {
+				base_::kill_timer(ucid, XPOLL_TIMER_HANDSHAKE);
 				if (pkg.size())
 					base_::tcp_post(ucid, &pkg);
 				static_cast<_CLS*>(this)->onhandshake(ucid);
@@ -176,6 +185,9 @@ namespace ec {
 		AioTlsClient(cLog* plog, memory* _pmem) : base_(_pmem), _plog(plog), _tls(0, _pmem, plog), _nstatus(TLS_SESSION_NONE)
 		{
 		}
+		inline void set_post_policy(int npolicy) { // tls records are sequenced, can not drop, disconnect instead
+			base_::set_post_policy((XPOLL_POST_NOWAIT == npolicy || XPOLL_POST_DROPOLDEST == npolicy) ? XPOLL_POST_DISCONNECT : npolicy);
+		}
 		inline bool SetServerPubkey(int len, const unsigned char *pubkey)
 		{
 			return _tls.SetServerPubkey(len, pubkey);			
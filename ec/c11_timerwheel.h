@@ -0,0 +1,258 @@
+﻿/*!
+\file c11_timerwheel.h
+\author	jiangyong
+\email  kipway@outlook.com
+\update 2018.8.14
+
+eclib hierarchical timing wheel, O(1) add/del/reset, run cost only depends on expired timers and cascades.
+4 levels (256,64,64,64 slots), timers are index linked nodes in one growable array, not thread safe, lock by owner
+
+class timerwheel
+
+eclib Copyright (c) 2017-2018, kipway
+source repository : https://github.com/kipway/eclib
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+
+#define TMWHEEL_ROOT_BITS 8
+#define TMWHEEL_LVL_BITS  6
+#define TMWHEEL_ROOT_SIZE (1 << TMWHEEL_ROOT_BITS)
+#define TMWHEEL_LVL_SIZE  (1 << TMWHEEL_LVL_BITS)
+#define TMWHEEL_SLOTS     (TMWHEEL_ROOT_SIZE + TMWHEEL_LVL_SIZE * 3)
+#define TMWHEEL_MAX_TICKS ((1ULL << (TMWHEEL_ROOT_BITS + TMWHEEL_LVL_BITS * 3)) - 1)
+#define TMWHEEL_NIL       0xFFFFFFFF
+
+namespace ec
+{
+	class timerwheel
+	{
+	public:
+		struct t_node {
+			uint32_t prev, next; // index, TMWHEEL_NIL end
+			uint32_t uslot;      // slot in, TMWHEEL_NIL free
+			uint32_t ukey;       // user key, ucid
+			uint32_t ukind;      // user timer kind
+			uint32_t umsec;      // interval
+			uint64_t uexpire;    // expire tick
+		};
+		/*!
+		\param utickms tick milliseconds
+		\param umaxtimers max timers, node array grow to it
+		*/
+		timerwheel(uint32_t utickms, uint32_t umaxtimers) : _pnodes(nullptr), _usize(0), _umax(umaxtimers), _ufree(TMWHEEL_NIL), _ucount(0)
+		{
+			_utickms = utickms ? utickms : 1;
+			for (uint32_t i = 0; i < TMWHEEL_SLOTS; i++)
+				_slots[i] = TMWHEEL_NIL;
+			_ucurtick = nowms() / _utickms;
+		}
+		~timerwheel()
+		{
+			if (_pnodes) {
+				::free(_pnodes);
+				_pnodes = nullptr;
+			}
+		}
+	private:
+		t_node* _pnodes;
+		uint32_t _usize, _umax; // nodes allocated, max nodes
+		uint32_t _ufree;  // free nodes list
+		uint32_t _ucount; // timers in wheel
+		uint32_t _utickms;
+		uint64_t _ucurtick; // all timers before this tick are done
+		uint32_t _slots[TMWHEEL_SLOTS];
+	public:
+		static inline uint64_t nowms()
+		{
+			return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+		inline uint64_t curtick() const
+		{
+			return _ucurtick;
+		}
+		inline uint32_t tickms() const
+		{
+			return _utickms;
+		}
+		inline uint32_t size() const
+		{
+			return _ucount;
+		}
+		/*!
+		\brief add one timer
+		\return timer id > 0, 0 if full
+		*/
+		uint32_t add(uint32_t umsec, uint32_t ukey, uint32_t ukind)
+		{
+			uint32_t i = alloc_node();
+			if (TMWHEEL_NIL == i)
+				return 0;
+			t_node* p = &_pnodes[i];
+			p->ukey = ukey;
+			p->ukind = ukind;
+			p->umsec = umsec;
+			link(i, umsec);
+			_ucount++;
+			return i + 1;
+		}
+		void del(uint32_t id)
+		{
+			if (!id || id > _usize || TMWHEEL_NIL == _pnodes[id - 1].uslot)
+				return;
+			unlink(id - 1);
+			free_node(id - 1);
+			_ucount--;
+		}
+		bool reset(uint32_t id, uint32_t umsec) // restart timer with new interval
+		{
+			if (!id || id > _usize || TMWHEEL_NIL == _pnodes[id - 1].uslot)
+				return false;
+			unlink(id - 1);
+			_pnodes[id - 1].umsec = umsec;
+			link(id - 1, umsec);
+			return true;
+		}
+		void clear()
+		{
+			for (uint32_t i = 0; i < TMWHEEL_SLOTS; i++)
+				_slots[i] = TMWHEEL_NIL;
+			_ufree = TMWHEEL_NIL;
+			for (uint32_t i = _usize; i > 0; i--) {
+				_pnodes[i - 1].uslot = TMWHEEL_NIL;
+				_pnodes[i - 1].next = _ufree;
+				_ufree = i - 1;
+			}
+			_ucount = 0;
+		}
+		/*!
+		\brief run ticks until unowms
+		\param fun uint32_t fun(uint32_t id, uint32_t ukey, uint32_t ukind, uint32_t umsec), called for expired timer,
+			return milliseconds to restart it, 0 delete it
+		*/
+		template<class _Fun>
+		void run(uint64_t unowms, _Fun fun)
+		{
+			uint64_t utarget = unowms / _utickms;
+			uint32_t i, idx, unext, unew;
+			while (_ucurtick < utarget) {
+				_ucurtick++;
+				idx = (uint32_t)(_ucurtick & (TMWHEEL_ROOT_SIZE - 1));
+				if (!idx && !cascade(0) && !cascade(1))
+					cascade(2);
+				i = _slots[idx];
+				_slots[idx] = TMWHEEL_NIL; // detach expired list, fun may add
+				while (TMWHEEL_NIL != i) {
+					unext = _pnodes[i].next;
+					_pnodes[i].uslot = TMWHEEL_NIL;
+					unew = fun(i + 1, _pnodes[i].ukey, _pnodes[i].ukind, _pnodes[i].umsec);
+					if (unew)
+						link(i, unew);
+					else {
+						free_node(i);
+						_ucount--;
+					}
+					i = unext;
+				}
+			}
+		}
+	private:
+		uint32_t alloc_node()
+		{
+			if (TMWHEEL_NIL == _ufree) {
+				if (_usize >= _umax)
+					return TMWHEEL_NIL;
+				uint32_t unew = _usize ? _usize * 2 : 256;
+				if (unew > _umax)
+					unew = _umax;
+				t_node* p = (t_node*)::realloc(_pnodes, sizeof(t_node) * unew);
+				if (!p)
+					return TMWHEEL_NIL;
+				_pnodes = p;
+				for (uint32_t i = unew; i > _usize; i--) {
+					_pnodes[i - 1].uslot = TMWHEEL_NIL;
+					_pnodes[i - 1].next = _ufree;
+					_ufree = i - 1;
+				}
+				_usize = unew;
+			}
+			uint32_t i = _ufree;
+			_ufree = _pnodes[i].next;
+			return i;
+		}
+		inline void free_node(uint32_t i)
+		{
+			_pnodes[i].uslot = TMWHEEL_NIL;
+			_pnodes[i].next = _ufree;
+			_ufree = i;
+		}
+		void link(uint32_t i, uint32_t umsec)
+		{
+			uint64_t ut = (umsec + _utickms - 1) / _utickms;
+			if (!ut)
+				ut = 1;
+			if (ut > TMWHEEL_MAX_TICKS)
+				ut = TMWHEEL_MAX_TICKS;
+			_pnodes[i].uexpire = _ucurtick + ut;
+			place(i);
+		}
+		void place(uint32_t i) // put to slot by uexpire
+		{
+			t_node* p = &_pnodes[i];
+			uint64_t ut = p->uexpire, ud = ut > _ucurtick ? ut - _ucurtick : 0;
+			uint32_t us;
+			if (ud < TMWHEEL_ROOT_SIZE)
+				us = (uint32_t)((ud ? ut : _ucurtick) & (TMWHEEL_ROOT_SIZE - 1)); // ud 0 only by cascade, done in this tick
+			else if (ud < (1ULL << (TMWHEEL_ROOT_BITS + TMWHEEL_LVL_BITS)))
+				us = TMWHEEL_ROOT_SIZE + (uint32_t)((ut >> TMWHEEL_ROOT_BITS) & (TMWHEEL_LVL_SIZE - 1));
+			else if (ud < (1ULL << (TMWHEEL_ROOT_BITS + TMWHEEL_LVL_BITS * 2)))
+				us = TMWHEEL_ROOT_SIZE + TMWHEEL_LVL_SIZE + (uint32_t)((ut >> (TMWHEEL_ROOT_BITS + TMWHEEL_LVL_BITS)) & (TMWHEEL_LVL_SIZE - 1));
+			else
+				us = TMWHEEL_ROOT_SIZE + TMWHEEL_LVL_SIZE * 2 + (uint32_t)((ut >> (TMWHEEL_ROOT_BITS + TMWHEEL_LVL_BITS * 2)) & (TMWHEEL_LVL_SIZE - 1));
+			p->uslot = us;
+			p->prev = TMWHEEL_NIL;
+			p->next = _slots[us];
+			if (TMWHEEL_NIL != p->next)
+				_pnodes[p->next].prev = i;
+			_slots[us] = i;
+		}
+		void unlink(uint32_t i)
+		{
+			t_node* p = &_pnodes[i];
+			if (TMWHEEL_NIL != p->prev)
+				_pnodes[p->prev].next = p->next;
+			else
+				_slots[p->uslot] = p->next;
+			if (TMWHEEL_NIL != p->next)
+				_pnodes[p->next].prev = p->prev;
+			p->uslot = TMWHEEL_NIL;
+		}
+		uint32_t cascade(int nlevel) // move the current slot of level nlevel(0-2) to lower levels, return slot index
+		{
+			uint32_t idx = (uint32_t)((_ucurtick >> (TMWHEEL_ROOT_BITS + TMWHEEL_LVL_BITS * nlevel)) & (TMWHEEL_LVL_SIZE - 1));
+			uint32_t us = TMWHEEL_ROOT_SIZE + TMWHEEL_LVL_SIZE * nlevel + idx;
+			uint32_t i = _slots[us], unext;
+			_slots[us] = TMWHEEL_NIL;
+			while (TMWHEEL_NIL != i) {
+				unext = _pnodes[i].next;
+				place(i);
+				i = unext;
+			}
+			return idx;
+		}
+	};
+}
@@ -68,6 +68,7 @@ namespace tls
 #include "c11_array.h"
 #include "c11_vector.h"
 #include "c11_map.h"
+#include "c11_shardmap.h"
 
 #include "openssl/rand.h"
 #include "openssl/x509.h"
@@ -1369,8 +1370,7 @@ namespace ec
 	{
 	public:
 		sessiontlsmap(uint32_t maxconnect) :
-			_memmap(ec::map<uint32_t, t_tls_session>::size_node(), 8192, 0, 0, 0, 0, &_mem_lock),
-			_map(11 + (uint32_t)(2048), &_memmap),
+			_map(maxconnect),
 			_memcls(sizeof(tls_session_srv), maxconnect, 0, 0, 0, 0, &_cscls)
 		{
 		}
@@ -1383,18 +1383,13 @@ namespace ec
 		}
 	protected:
 		unsigned int _ugroups;
-		map<uint32_t, t_tls_session> _map;
-		std::mutex _cs;
+		shardmap<t_tls_session> _map; // lock-striped by ucid, decrypt and encrypt of one ucid under its shard lock
 	private:
-		std::mutex _mem_lock;// lock for _memmap
-		ec::memory _memmap;// memory for send
-
 		std::mutex _cscls;// lock for _mem
 		ec::memory _memcls;// memory for tls_session_srv		
 	public:
 		void Add(uint32_t ucid, tls_session_srv* ps)
 		{
-			unique_lock lck(&_cs);
 			t_tls_session v;
 			v.pmem = &_memcls;
 			v.Pss = ps;
@@ -1402,28 +1397,27 @@ namespace ec
 		}
 		void Del(uint32_t ucid)
 		{
-			unique_lock lck(&_cs);
 			_map.erase(ucid);
 		}
 
 		int OnTcpRead(uint32_t ucid, const void* pd, size_t dsize, vector<uint8_t>* pout)
 		{
-			unique_lock lck(&_cs);
-			t_tls_session* pv = _map.get(ucid);
+			unique_lock lck(_map.getcs(ucid));
+			t_tls_session* pv = _map.get_nolock(ucid);
 			if (pv)
 				return pv->Pss->OnTcpRead(pd, dsize, pout);
 			pout->clear();
 			return TLS_SESSION_NONE;
 		}
-		bool mkr_appdata(uint32_t ucid, ec::vector<uint8_t>*po, const void* pd, size_t len)
-		{			
-			t_tls_session* pv = _map.get(ucid);
+		bool mkr_appdata(uint32_t ucid, ec::vector<uint8_t>*po, const void* pd, size_t len) // lock getcs(ucid) first
+		{
+			t_tls_session* pv = _map.get_nolock(ucid);
 			if (pv)
 				return pv->Pss->MakeAppRecord(po, pd, len);
 			return false;
 		}
-		inline std::mutex* getcs() {
-			return &_cs;
+		inline std::mutex* getcs(uint32_t ucid) { // lock of the shard of ucid
+			return _map.getcs(ucid);
 		}
 	};
 
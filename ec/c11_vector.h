@@ -2,10 +2,13 @@
 \file c11_vector.h
 \author	jiangyong
 \email  kipway@outlook.com
-\update 2018.7.27
+\update 2018.8.19
 
 eclib class vector with c++11. fast noexcept simple vector. members of a vector can only be simple types, pointers and structures
 
+class vector
+class small_vector; vector with N inline elements, use heap (or memory) only when grown beyond N
+
 eclib Copyright (c) 2017-2018, kipway
 source repository : https://github.com/kipway/eclib
 
@@ -35,70 +38,91 @@ namespace ec
 		typedef _Tp		value_type;
 		typedef size_t	size_type;
 		typedef _Tp*	iterator;
-		vector(size_type ugrownsize, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pmem(pmem), _doublegrown(false)
+		vector(size_type ugrownsize, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pinline(nullptr), _uinline(0), _pmem(pmem), _doublegrown(false)
 		{
 			set_grow(ugrownsize);
 		};
-		vector(size_type ugrownsize, const value_type& val, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pmem(pmem), _doublegrown(false)
+		vector(size_type ugrownsize, const value_type& val, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pinline(nullptr), _uinline(0), _pmem(pmem), _doublegrown(false)
 		{
 			set_grow(ugrownsize);
 			push_back(val);
 		};
-		vector(size_type ugrownsize, const value_type* pval, size_type size, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pmem(pmem), _doublegrown(false)
+		vector(size_type ugrownsize, const value_type* pval, size_type size, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pinline(nullptr), _uinline(0), _pmem(pmem), _doublegrown(false)
 		{
 			set_grow(ugrownsize);
 			add(pval, size);
 		};
-		vector(size_type initsize, bool doublegrown, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pmem(pmem), _doublegrown(doublegrown)
+		vector(size_type initsize, bool doublegrown, ec::memory* pmem = nullptr) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pinline(nullptr), _uinline(0), _pmem(pmem), _doublegrown(doublegrown)
 		{
 			set_grow(initsize);
 		}
-		vector(vector &&v)
+		vector(vector &&v) : _pbuf(nullptr), _usize(0), _ubufsize(0), _pinline(nullptr), _uinline(0)
 		{
-			_pbuf = v._pbuf;
-			_usize = v._usize;
-			_ubufsize = v._ubufsize;
 			_ugrown = v._ugrown;
 			_pmem = v._pmem;
 			_doublegrown = v._doublegrown;
-			v._pbuf = nullptr;
-			v._usize = 0;
-			v._ubufsize = 0;
+			take(v);
 		}
 		~vector()
 		{
-			if (_pbuf != nullptr) {
-				mem_free(_pbuf);
-				_pbuf = nullptr;
-				_usize = 0;
-				_ubufsize = 0;
-				_pmem = nullptr;
-			}
+			free_buf();
+			_usize = 0;
 		};
 		vector& operator = (vector&& v)
 		{
-			this->~vector();
-			_pbuf = v._pbuf;
-			_usize = v._usize;
-			_ubufsize = v._ubufsize;
+			if (this == &v)
+				return *this;
+			free_buf();
+			_usize = 0;
 			_ugrown = v._ugrown;
 			_pmem = v._pmem;
-			v._pbuf = nullptr;
-			v._usize = 0;
-			v._ubufsize = 0;
+			_doublegrown = v._doublegrown;
+			take(v);
 			return *this;
 		}
 		inline ec::memory* get_mem_allocator() {
 			return _pmem;
 		}
+		inline bool is_inline() const noexcept { // data in the inline buffer of small_vector, maybe on stack
+			return _pbuf && _pbuf == _pinline;
+		}
 	protected:
 		value_type * _pbuf;
 		size_type	_usize;
 		size_type	_ubufsize;
 		size_type	_ugrown;
+		value_type* _pinline; // inline buffer of small_vector, never freed
+		size_type	_uinline;
 		bool		_doublegrown; //auto double grown
+		vector(value_type* pinline, size_type uinline, size_type ugrownsize, ec::memory* pmem) : _pbuf(pinline), _usize(0), _ubufsize(uinline),
+			_pinline(pinline), _uinline(uinline), _pmem(pmem), _doublegrown(false)
+		{
+			set_grow(ugrownsize);
+		}
 	private:
 		ec::memory *_pmem;
+		void free_buf() noexcept // free heap buffer, back to inline buffer
+		{
+			if (_pbuf)
+				mem_free(_pbuf);
+			_pbuf = _pinline;
+			_ubufsize = _uinline;
+		}
+		void take(vector& v) noexcept // move buffer from v, copy if v use its inline buffer
+		{
+			if (v._pbuf && v._pbuf == v._pinline) {
+				if (v._usize)
+					add(v._pbuf, v._usize);
+			}
+			else if (v._pbuf) {
+				_pbuf = v._pbuf;
+				_usize = v._usize;
+				_ubufsize = v._ubufsize;
+				v._pbuf = v._pinline;
+				v._ubufsize = v._uinline;
+			}
+			v._usize = 0;
+		}
 		inline void *mem_malloc(size_t size, size_t &sizeout) {
 			if (_pmem)
 				return _pmem->malloc(size, sizeout);
@@ -106,20 +130,22 @@ namespace ec
 			return malloc(size);
 		}
 		inline void mem_free(void* p) {
+			if (p == _pinline)
+				return;
 			if (_pmem)
 				_pmem->mem_free(p);
 			else
 				free(p);
 		}
 		inline void* mem_realloc(size_t size, size_t &sizeout) {
-			if (_pmem) {
-				void *pnew = _pmem->malloc(size, sizeout);
+			if (_pmem || (_pbuf && _pbuf == _pinline)) {
+				void *pnew = mem_malloc(size, sizeout);
 				if (!pnew)
 					return nullptr;
 				if (_pbuf) {
 					if (_usize)
 						memcpy(pnew, _pbuf, ((_usize < size) ? _usize : size) * sizeof(value_type));
-					_pmem->mem_free(_pbuf);
+					mem_free(_pbuf);
 				}
 				return pnew;
 			}
@@ -155,11 +181,8 @@ namespace ec
 		inline void clear(bool bfreemem = false) noexcept
 		{
 			_usize = 0;
-			if (bfreemem && _pbuf) {
-				mem_free(_pbuf);
-				_pbuf = nullptr;
-				_ubufsize = 0;
-			}
+			if (bfreemem)
+				free_buf();
 		}
 		inline void clear(size_type shrinksize) noexcept
 		{
@@ -203,6 +226,22 @@ namespace ec
 		{
 			return add(val);
 		}
+		inline void push_back_unchecked(const value_type& val) noexcept // capacity must be reserved
+		{
+			_pbuf[_usize++] = val;
+		}
+		inline bool reserve_exact(size_type size) noexcept // capacity to size, no grow rounding
+		{
+			return expand(size);
+		}
+		value_type* append_uninitialized(size_type size) noexcept // add size elements not initialized, return the first for write
+		{
+			if (!_grown(size))
+				return nullptr;
+			value_type* p = _pbuf + _usize;
+			_usize += size;
+			return p;
+		}
 		inline void pop_back() noexcept
 		{
 			if (_usize > 0)
@@ -316,13 +355,13 @@ namespace ec
 		}
 		void shrink(size_type size) noexcept
 		{
-			if (!_pbuf || _ubufsize <= size)
+			if (!_pbuf || _pbuf == _pinline || _ubufsize <= size)
 				return;
-			if (!size && !_usize)
+			if (size <= _uinline && _usize <= _uinline)
 			{
-				mem_free(_pbuf);
-				_pbuf = 0;
-				_ubufsize = 0;
+				if (_usize)
+					memcpy(_pinline, _pbuf, _usize * sizeof(value_type));
+				free_buf();
 				return;
 			}
 			if (_usize >= size)
@@ -355,7 +394,15 @@ namespace ec
 			_ubufsize = sizeout / sizeof(value_type);
 			return true;
 		}
-		void* detach_buf() {
+		void* detach_buf() { // free by memory or free()
+			if (_pbuf && _pbuf == _pinline) { // copy out inline buffer
+				size_t sizeout = 0;
+				void* pc = mem_malloc(_usize ? _usize * sizeof(value_type) : 1, sizeout);
+				if (pc && _usize)
+					memcpy(pc, _pbuf, _usize * sizeof(value_type));
+				_usize = 0;
+				return pc;
+			}
 			void* p = (void*)_pbuf;
 			_usize = 0;
 			_ubufsize = 0;
@@ -391,4 +438,35 @@ namespace ec
 			return true;
 		}
 	};
+
+	template<typename _Tp, size_t _N>
+	class small_vector : public vector<_Tp> // first _N elements in object, for temporary buffers on stack
+	{
+	public:
+		typedef vector<_Tp> base_;
+		typedef typename base_::size_type size_type;
+		small_vector(size_type ugrownsize = _N, ec::memory* pmem = nullptr) : base_(_inline, _N, ugrownsize, pmem)
+		{
+		}
+		small_vector(small_vector&& v) : base_(_inline, _N, v._ugrown, v.get_mem_allocator())
+		{
+			base_::operator=(std::move(v));
+		}
+		small_vector& operator = (small_vector&& v)
+		{
+			base_::operator=(std::move(v));
+			return *this;
+		}
+		small_vector& operator = (base_&& v)
+		{
+			base_::operator=(std::move(v));
+			return *this;
+		}
+		inline bool is_inline() const noexcept
+		{
+			return base_::_pbuf == _inline;
+		}
+	private:
+		_Tp _inline[_N];
+	};
 }
@@ -30,6 +30,9 @@ limitations under the License.
 #include <stdio.h>
 #include "c11_netio.h"
 #include "c11_config.h"
+#include "c11_shardmap.h"
+#include "c11_iobuf.h"
+#include "c11_compress.h"
 
 #include "c_base64.h"
 
@@ -170,6 +173,8 @@ namespace ec
 		}
 		size_t ss = 0, us;
 		pout->clear();
+		if (!pout->reserve_exact(slen + (slen / EC_SIZE_WS_FRAME + 1) * 10)) // frames and heads, no realloc in loop
+			return false;
 		while (ss < slen)
 		{
 			uc = 0;
@@ -185,28 +190,28 @@ namespace ec
 				uc |= 0x80;
 				us = slen - ss;
 			}
-			pout->add(uc);
+			pout->push_back_unchecked(uc);
 			if (us < 126)
 			{
 				uc = (unsigned char)us;
-				pout->add(uc);
+				pout->push_back_unchecked(uc);
 			}
-			else if (uc < 65536)
+			else if (us < 65536)
 			{
 				uc = 126;
-				pout->add(uc);
-				pout->add((uint8_t)((us & 0xFF00) >> 8)); //high byte
-				pout->add((uint8_t)(us & 0xFF)); //low byte
+				pout->push_back_unchecked(uc);
+				pout->push_back_unchecked((uint8_t)((us & 0xFF00) >> 8)); //high byte
+				pout->push_back_unchecked((uint8_t)(us & 0xFF)); //low byte
 			}
 			else // < 4G
 			{
 				uc = 127;
-				pout->add((uint8_t)uc);
-				pout->add((uint8_t)0); pout->add((uint8_t)0); pout->add((uint8_t)0); pout->add((uint8_t)0);//high 4 bytes 0
-				pout->add((uint8_t)((us & 0xFF000000) >> 24));
-				pout->add((uint8_t)((us & 0x00FF0000) >> 16));
-				pout->add((uint8_t)((us & 0x0000FF00) >> 8));
-				pout->add((uint8_t)(us & 0xFF));
+				pout->push_back_unchecked((uint8_t)uc);
+				pout->push_back_unchecked((uint8_t)0); pout->push_back_unchecked((uint8_t)0); pout->push_back_unchecked((uint8_t)0); pout->push_back_unchecked((uint8_t)0);//high 4 bytes 0
+				pout->push_back_unchecked((uint8_t)((us & 0xFF000000) >> 24));
+				pout->push_back_unchecked((uint8_t)((us & 0x00FF0000) >> 16));
+				pout->push_back_unchecked((uint8_t)((us & 0x0000FF00) >> 8));
+				pout->push_back_unchecked((uint8_t)(us & 0xFF));
 			}
 			pout->add((const uint8_t*)(pds + ss), us);
 			ss += us;
@@ -223,6 +228,8 @@ namespace ec
 		unsigned char uc;
 		size_t ss = 0, us, fl;
 		pout->clear();
+		if (!pout->reserve_exact(slen + (slen / EC_SIZE_WS_FRAME + 1) * 10))
+			return false;
 		while (ss < slen)
 		{
 			uc = 0;
@@ -237,7 +244,6 @@ namespace ec
 				uc |= 0x80;
 				us = slen - ss;
 			}
-			pout->add(uc);
 			if (uc & 0x40)
 			{
 				tmp.clear();
@@ -251,28 +257,30 @@ namespace ec
 				pf = (char*)pds + ss;
 				fl = us;
 			}
-
+			if (!pout->reserve_exact(pout->size() + fl + 10)) // compressed frame may be longer
+				return false;
+			pout->push_back_unchecked(uc);
 			if (fl < 126)
 			{
 				uc = (unsigned char)fl;
-				pout->add(uc);
+				pout->push_back_unchecked(uc);
 			}
-			else if (uc < 65536)
+			else if (fl < 65536)
 			{
 				uc = 126;
-				pout->add(uc);
-				pout->add((uint8_t)((fl & 0xFF00) >> 8)); //high byte
-				pout->add((uint8_t)(fl & 0xFF)); //low byte
+				pout->push_back_unchecked(uc);
+				pout->push_back_unchecked((uint8_t)((fl & 0xFF00) >> 8)); //high byte
+				pout->push_back_unchecked((uint8_t)(fl & 0xFF)); //low byte
 			}
 			else // < 4G
 			{
 				uc = 127;
-				pout->add(uc);
-				pout->add((uint8_t)0); pout->add((uint8_t)0); pout->add((uint8_t)0); pout->add((uint8_t)0);//high 4 bytes 0
-				pout->add((uint8_t)((fl & 0xFF000000) >> 24));
-				pout->add((uint8_t)((fl & 0x00FF0000) >> 16));
-				pout->add((uint8_t)((fl & 0x0000FF00) >> 8));
-				pout->add((uint8_t)(fl & 0xFF));
+				pout->push_back_unchecked(uc);
+				pout->push_back_unchecked((uint8_t)0); pout->push_back_unchecked((uint8_t)0); pout->push_back_unchecked((uint8_t)0); pout->push_back_unchecked((uint8_t)0);//high 4 bytes 0
+				pout->push_back_unchecked((uint8_t)((fl & 0xFF000000) >> 24));
+				pout->push_back_unchecked((uint8_t)((fl & 0x00FF0000) >> 16));
+				pout->push_back_unchecked((uint8_t)((fl & 0x0000FF00) >> 8));
+				pout->push_back_unchecked((uint8_t)(fl & 0xFF));
 			}
 			pout->add((const uint8_t*)pf, fl);
 			ss += us;
@@ -330,6 +338,9 @@ namespace ec
 	.3gp = video/3gpp
 
 	*/
+#ifndef HTTP_KEEPALIVE_TIMEOUT
+#	define HTTP_KEEPALIVE_TIMEOUT 0 // default http keep-alive idle timeout seconds, 0 none, set "keepalive" in the http block to use
+#endif
 	class cHttpCfg : public config
 	{
 	public:
@@ -345,6 +356,7 @@ namespace ec
 	public:
 		unsigned short _wport; // http and ws
 		char _sroot[512];      // httpdoc root , utf8
+		unsigned int _keepalive; // http idle timeout seconds before upgrade websocket, 0 none
 
 		unsigned short _wport_wss;//https and wss
 		char _sroot_wss[512];     //httpsdoc root , utf8
@@ -377,6 +389,10 @@ namespace ec
 					if (lpszKeyVal && *lpszKeyVal)
 						_wport = (unsigned short)atoi(lpszKeyVal);
 				}
+				else if (!stricmp("keepalive", lpszKeyName)) {
+					if (lpszKeyVal && *lpszKeyVal)
+						_keepalive = (unsigned int)atoi(lpszKeyVal);
+				}
 			}
 			if (!stricmp("https", lpszBlkName)) {
 				if (!stricmp("rootpath", lpszKeyName)) {
@@ -413,6 +429,7 @@ namespace ec
 		void reset() {
 			_wport = 0;
 			memset(_sroot, 0, sizeof(_sroot));
+			_keepalive = HTTP_KEEPALIVE_TIMEOUT;
 
 			_wport_wss = 0;
 			memset(_sroot_wss, 0, sizeof(_sroot_wss));
@@ -611,7 +628,7 @@ namespace ec
 		int	 _protocol;   // HTTP_PROTOCOL:http; WEB_SOCKET:websocket        
 		uint32_t   _ucid; // client user connect ID
 		char _sip[32];	  //ip address
-		vector<char> _txt;   // tmp
+		iobuf _txt;          // tmp
 		vector<char> _wsmsg; // complete websocket message
 		int _comp;// compress flag
 		int _opcode;  // operate code
@@ -762,35 +779,39 @@ namespace ec
 			size_t sizedo = 0;
 			pout->Resetwscomp();
 			pout->_nprotocol = _protocol;
-			_txt.add(pdata, usize);
+			if (!_txt.append(pdata, usize))
+				return he_failed;
 			if (_protocol == PROTOCOL_HTTP)
 			{
-				int nr = pout->HttpParse(_txt.data(), _txt.size(), sizedo);
+				const char* ptxt = (const char*)_txt.linearize(_txt.size());
+				if (!ptxt)
+					return _txt.empty() ? he_waitdata : he_failed;
+				int nr = pout->HttpParse(ptxt, _txt.size(), sizedo);
 				if (nr == he_ok)
-					_txt.erase(0, sizedo);
+					_txt.consume(sizedo);
 				else
 				{
 					if (nr >= he_failed || _txt.size() > SIZE_HTTPMAXREQUEST)
-						_txt.clear((size_t)0);
+						_txt.clear();
 				}
-				_txt.shrink(0);
 				return nr;
 			}
-			int nr = WebsocketParse(_txt.data(), _txt.size(), sizedo, pout);//websocket
+			const char* ptxt = (const char*)_txt.linearize(_txt.size());
+			if (!ptxt)
+				return _txt.empty() ? he_waitdata : he_failed;
+			int nr = WebsocketParse(ptxt, _txt.size(), sizedo, pout);//websocket
 			if (nr == he_failed)
-				_txt.clear((size_t)0);
-
+				_txt.clear();
 			else {
 				if (sizedo)
-					_txt.erase(0, sizedo);
+					_txt.consume(sizedo);
 				else
 				{
 					if (_txt.size() > EC_SIZE_WS_READ_FRAME_MAX) {
-						_txt.clear((size_t)0);
+						_txt.clear();
 						return he_failed;
 					}
 				}
-				_txt.shrink(0);
 			}
 			return nr;
 		}
@@ -801,31 +822,35 @@ namespace ec
 			size_t sizedo = 0;
 			if (_protocol == PROTOCOL_HTTP)
 			{
-				int nr = pout->HttpParse(_txt.data(), _txt.size(), sizedo);
+				const char* ptxt = (const char*)_txt.linearize(_txt.size());
+				if (!ptxt)
+					return _txt.empty() ? he_waitdata : he_failed;
+				int nr = pout->HttpParse(ptxt, _txt.size(), sizedo);
 				if (nr == he_ok)
-					_txt.erase(0, sizedo);
+					_txt.consume(sizedo);
 				else
 				{
 					if (nr >= he_failed || _txt.size() > SIZE_HTTPMAXREQUEST)
-						_txt.clear((size_t)0);
+						_txt.clear();
 				}
-				_txt.shrink(0);
 				return nr;
 			}
-			int nr = WebsocketParse(_txt.data(), _txt.size(), sizedo, pout);
+			const char* ptxt = (const char*)_txt.linearize(_txt.size());
+			if (!ptxt)
+				return _txt.empty() ? he_waitdata : he_failed;
+			int nr = WebsocketParse(ptxt, _txt.size(), sizedo, pout);
 			if (nr == he_failed)
-				_txt.clear((size_t)0);
+				_txt.clear();
 			else {
 				if (sizedo)
-					_txt.erase(0, sizedo);
+					_txt.consume(sizedo);
 				else
 				{
 					if (_txt.size() > EC_SIZE_WS_READ_FRAME_MAX) {
-						_txt.clear((size_t)0);
+						_txt.clear();
 						return he_failed;
 					}
 				}
-				_txt.shrink(0);
 			}
 			return nr;
 		}
@@ -868,45 +893,73 @@ namespace ec
 	public:
 		cHttpClientMap(uint32_t nmaxconnect) :
 			_mem(ec::map<const char*, t_httpclient>::size_node(), nmaxconnect, 1024 * 16, 64, 1024 * 512, 24, &_lockmem),
-			_map(nmaxconnect, &_mem), _memcls(sizeof(cHttpClient), nmaxconnect, 0, 0, 0, 0, &_lockcls)
+			_map(nmaxconnect), _memcls(sizeof(cHttpClient), nmaxconnect, 0, 0, 0, 0, &_lockcls), _baffinity(false)
 		{
 		}
+		inline void SetAffinity(bool baffinity) // the read data of one ucid only done by one worker, parse without lock
+		{
+			_baffinity = baffinity;
+		}
+		void memstat(memory::t_stat* pmap, memory::t_stat* pcls) // memory statistics snapshot, nullptr skip
+		{
+			if (pmap)
+				_mem.stat(*pmap);
+			if (pcls)
+				_memcls.stat(*pcls);
+		}
 		~cHttpClientMap()
 		{
 			_map.clear();
 		}
 	private:
-		std::mutex _cs;
 		std::mutex _lockmem;
-		ec::memory _mem; //memory for map
+		ec::memory _mem; //memory for client buffers
 
-		map<unsigned int, t_httpclient> _map;
+		shardmap<t_httpclient> _map; // lock-striped by ucid
 
 		std::mutex _lockcls;
 		ec::memory _memcls; // memory for new cHttpClient
+		bool _baffinity;
 	public:
 
 		int OnReadData(unsigned int ucid, const char* pdata, size_t usize, cHttpPacket* pout) // return he_ok: msg in pout
 		{
-			ec::unique_lock lck(&_cs);
 			t_httpclient item;
-			if (!_map.get(ucid, item))
+			if (_baffinity) {
+				if (!getclient(ucid, item))
+					return he_failed;
+				return item.pcli->OnReadData(ucid, pdata, usize, pout);
+			}
+			ec::unique_lock lck(_map.getcs(ucid));
+			t_httpclient* pi = _map.get_nolock(ucid);
+			if (!pi)
 				return he_failed;
-			return item.pcli->OnReadData(ucid, pdata, usize, pout);
+			return pi->pcli->OnReadData(ucid, pdata, usize, pout);
 		}
 
 		int DoNextData(unsigned int ucid, cHttpPacket* pout)
 		{
-			unique_lock lck(&_cs);
 			t_httpclient item;
-			if (!_map.get(ucid, item))
+			if (_baffinity) {
+				if (!getclient(ucid, item))
+					return he_failed;
+				return item.pcli->DoNextData(ucid, pout);
+			}
+			unique_lock lck(_map.getcs(ucid));
+			t_httpclient* pi = _map.get_nolock(ucid);
+			if (!pi)
 				return he_failed;
-			return item.pcli->DoNextData(ucid, pout);
+			return pi->pcli->DoNextData(ucid, pout);
 		}
 
+	private:
+		bool getclient(unsigned int ucid, t_httpclient &item) // lock only map lookup, the client keep until Del by the same worker
+		{
+			return _map.get(ucid, item);
+		}
+	public:
 		void Add(unsigned int ucid, const char* sip)// add one client
 		{
-			unique_lock lck(&_cs);
 			void *p = _memcls.mem_malloc(sizeof(cHttpClient));
 			if (!p)
 				return;
@@ -920,28 +973,25 @@ namespace ec
 		}
 		bool Del(unsigned int ucid)
 		{
-			unique_lock lck(&_cs);
 			return _map.erase(ucid);
 		}
 
 		void UpgradeWebSocket(unsigned int ucid, int wscompress)
 		{
-			unique_lock lck(&_cs);
-			t_httpclient item;
-			if (!_map.get(ucid, item))
-				return;
-			item.pcli->_protocol = PROTOCOL_WS;
-			item.pcli->_wscompress = wscompress;
-			item.pcli->_txt.clear((size_t)0);
+			_map.apply(ucid, [&](t_httpclient& item) {
+				item.pcli->_protocol = PROTOCOL_WS;
+				item.pcli->_wscompress = wscompress;
+				item.pcli->_txt.clear();
+			});
 		}
 
 		int GetCompress(unsigned int ucid)
 		{
-			unique_lock lck(&_cs);
-			t_httpclient item;
-			if (!_map.get(ucid, item))
-				return 0;
-			return item.pcli->_wscompress;
+			int ncomp = 0;
+			_map.apply(ucid, [&](t_httpclient& item) {
+				ncomp = item.pcli->_wscompress;
+			});
+			return ncomp;
 		}
 	};
 
@@ -960,12 +1010,15 @@ namespace ec
 		cHttpClientMap*	_pclis;
 		ec::memory*     _pmem;
 		cHttpPacket		_httppkg;
+		comp_policy     _compolicy; // skip deflate for incompressible messages and files
 	protected:
 		/*
 		void onwsread(uint32_t ucid, int bFinal, int wsopcode, const void* pdata, size_t size) = 0;
 		void dodisconnect(uint32_t ucid) = 0;
 		int  dosend(uint32_t ucid, vector<uint8_t> *pvd, int timeovermsec = 0) = 0;
+		int  dosend_shared(uint32_t ucid, shared_buffer* pbuf) = 0; // never wait, caller still own its reference
 		bool onhttprequest(uint32_t ucid, cHttpPacket* pPkg);
+		void onwsupgrade(uint32_t ucid);
 		*/
 		bool DoUpgradeWebSocket(int ucid, const char *skey)
 		{
@@ -1045,6 +1098,7 @@ namespace ec
 			}
 			vret.add((const uint8_t*)"\x0d\x0a", 2);
 			_pclis->UpgradeWebSocket(ucid, ncompress);
+			static_cast<_CLS*>(this)->onwsupgrade(ucid);
 
 			int ns = 0;
 			if (_plog) {
@@ -1149,7 +1203,7 @@ namespace ec
 			}
 
 			int necnode = 0;
-			if (pPkg->GetHeadFiled("Accept-Encoding", tmp, sizeof(tmp))) {
+			if (_compolicy.compressible(filetmp.data(), filetmp.size()) && pPkg->GetHeadFiled("Accept-Encoding", tmp, sizeof(tmp))) {
 				char sencode[16] = { 0 };
 				size_t pos = 0;
 				while (ec::str_getnext(";,", tmp, strlen(tmp), pos, sencode, sizeof(sencode))) {
@@ -1242,9 +1296,10 @@ namespace ec
 			}
 			else // ws_permessage_deflate
 			{
-				if(size > 128 && ncomp)
+				bool bcomp = size > 128 && ncomp && _compolicy.compressible(pdata, size);
+				if (bcomp)
 					vret.set_grow(2048 + size / 2 - size % 1024);
-				bsend = ws_make_permsg(pdata, size, wsopt, &vret, size > 128 && ncomp);
+				bsend = ws_make_permsg(pdata, size, wsopt, &vret, bcomp);
 			}
 			if (!bsend) {
 				if (cWebsocket::_plog)
@@ -1253,6 +1308,44 @@ namespace ec
 			}
 			return static_cast<_CLS*>(this)->dosend(ucid, &vret, waitmsec);
 		}
+		/*!
+		\brief send one websocket message to many ucids, make frames once for each compress mode and post them shared
+		\return number of ucids queued
+		*/
+		size_t ws_broadcast(const uint32_t* pucids, size_t n, const void* pdata, size_t size, unsigned char wsopt)
+		{
+			shared_buffer* pbufs[3] = { nullptr, nullptr, nullptr }; // no compress, permessage-deflate, deflate-frame
+			size_t i, nq = 0;
+			int k;
+			bool bmake, bcomp = size > 128 && _compolicy.compressible(pdata, size);
+			for (i = 0; i < n; i++) {
+				int ncomp = _pclis->GetCompress(pucids[i]);
+				k = ncomp == ws_x_webkit_deflate_frame ? 2 : (bcomp && ncomp ? 1 : 0);
+				if (!pbufs[k]) {
+					vector<uint8_t> vret(2048 + size - size % 1024, _pmem);
+					if (k)
+						vret.set_grow(2048 + size / 2 - size % 1024);
+					if (2 == k)
+						bmake = ws_make_perfrm(pdata, size, wsopt, &vret);
+					else
+						bmake = ws_make_permsg(pdata, size, wsopt, &vret, k);
+					if (bmake)
+						pbufs[k] = shared_buffer::create(_pmem, vret.data(), vret.size());
+					if (!pbufs[k]) {
+						if (_plog)
+							_plog->add(CLOG_DEFAULT_ERR, "broadcast make wsframe failed,size %u", (unsigned int)size);
+						break;
+					}
+				}
+				if (static_cast<_CLS*>(this)->dosend_shared(pucids[i], pbufs[k]) >= 0)
+					nq++;
+			}
+			for (k = 0; k < 3; k++) {
+				if (pbufs[k])
+					pbufs[k]->release();
+			}
+			return nq;
+		}
 		inline int http_send(unsigned int ucid, vector<uint8_t> *pvd, int waitmsec = 0)
 		{
 			return  static_cast<_CLS*>(this)->dosend(ucid, pvd, waitmsec);
@@ -1261,8 +1354,9 @@ namespace ec
 
 	class http_pargs {
 	public:
-		http_pargs(cHttpCfg* pcfg, cHttpClientMap* pmap) : _pcfg(pcfg), _pmap(pmap) {}
+		http_pargs(cHttpCfg* pcfg, cHttpClientMap* pmap, const comp_policy* ppolicy = nullptr) : _pcfg(pcfg), _pmap(pmap), _pcompolicy(ppolicy) {}
 		cHttpCfg* _pcfg;
 		cHttpClientMap* _pmap;
+		const comp_policy* _pcompolicy;
 	};
 }
@@ -2,11 +2,26 @@
 \file c11_xpoll.h
 \author	jiangyong
 \email  kipway@outlook.com
-\update 2018.5.28
+\update 2018.8.10
 
 eclibe xpoll for windows & linux, send data with zero copy
+linux use epoll(edge-triggered, per-fd registration), windows use WSAPoll. define XPOLL_USE_EPOLL 0 to use poll() on linux
+send gather all queued packages of one ucid to one sendmsg/WSASend
+send queue is a chained package list bounded by bytes, post_msg return full over high watermark,
+then a XPOLL_EVT_OPT_WRITABLE event is added when the queue drop below low watermark.
+post policy XPOLL_POST_XXX decide what to do when full: return would block, drop oldest or disconnect the slow consumer
+per ucid timers XPOLL_TIMER_XXX run in a timing wheel by poll thread, expired as XPOLL_EVT_OPT_TIMEOUT event to the worker of ucid,
+idle, keep-alive and write-stall timers restart lazily by the last read/send tick, so activity cost no wheel operation
+post_shared queue one shared_buffer to many ucids, the reference is released when send complete, the event pdata is nullptr
+multi xpoll can work as shards, ucid % shards is the shard number, post_msg/remove route to the shard by ucid
+complete events can be split to multi queues, (ucid / shards) % queues is the queue number, one worker per queue,
+so the events of one ucid done in order by one worker
+complete event queue is lock-free mpmc_queue, workers spin then park
+poll thread wakeup use eventfd on linux, pipe on other unix, loopback udp on windows, burst set_event coalesce to one signal
+
 
 class udpevt
+class pollevt
 class xpoll
 
 eclib Copyright (c) 2017-2018, kipway
@@ -29,9 +44,11 @@ limitations under the License.
 #include "c_str.h"
 #include "c11_thread.h"
 #include "c11_memory.h"
-#include "c11_map.h"
+#include "c11_flatmap.h"
 #include "c11_fifo.h"
+#include "c11_mpmc.h"
 #include "c11_vector.h"
+#include "c11_timerwheel.h"
 
 #ifdef _WIN32
 #	include <windows.h>
@@ -51,6 +68,7 @@ typedef struct pollfd {
 #	define  pollfd WSAPOLLFD
 #else
 #	include <sys/socket.h>
+#	include <sys/uio.h>
 #	include <sys/ioctl.h>
 #	include <sys/select.h>
 #	include <netinet/tcp.h>
@@ -58,21 +76,96 @@ typedef struct pollfd {
 #	include <string.h>
 #	include <errno.h>
 #	include <poll.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	ifdef __linux__
+#		include <sys/eventfd.h>
+#	endif
+#endif
+
+#ifndef XPOLL_USE_EPOLL
+#	ifdef __linux__
+#		define XPOLL_USE_EPOLL 1 // epoll readiness backend, O(ready) event dispatch
+#	else
+#		define XPOLL_USE_EPOLL 0 // poll()/WSAPoll readiness backend
+#	endif
+#endif
+
+#if XPOLL_USE_EPOLL
+#	include <sys/epoll.h>
+#	ifndef XPOLL_EPOLL_EVENTS
+#		define XPOLL_EPOLL_EVENTS 256 // max events per epoll_wait
+#	endif
+#	ifndef XPOLL_EPOLL_SENDPKGS
+#		define XPOLL_EPOLL_SENDPKGS 16 // max sendmsg per ucid per loop, then requeue
+#	endif
+#endif
+
+#ifndef XPOLL_SEND_HIGH_WATER
+#	define XPOLL_SEND_HIGH_WATER (1024 * 1024 * 4)  // default send queue high watermark bytes per connect
+#endif
+
+#ifndef XPOLL_SEND_LOW_WATER
+#	define XPOLL_SEND_LOW_WATER (1024 * 1024)  // default send queue low watermark bytes per connect
 #endif
 
-#ifndef XPOLL_SEND_PKG_NUM
-#	define XPOLL_SEND_PKG_NUM   6  // max none send pkg per connect
+#ifndef XPOLL_SEND_IOV_NUM
+#	define XPOLL_SEND_IOV_NUM 32 // max packages gather to one sendmsg
 #endif
 
 #define XPOLL_EVT_ST_OK		 0
 #define XPOLL_EVT_ST_ERR	 1
 #define XPOLL_EVT_ST_CONNECT 2
 #define XPOLL_EVT_ST_CLOSE	 3
+#define XPOLL_EVT_ST_DROP	 4 // send package dropped by XPOLL_POST_DROPOLDEST
 
 #define XPOLL_EVT_OPT_READ	0
 #define XPOLL_EVT_OPT_SEND	1
+#define XPOLL_EVT_OPT_WRITABLE 2 // send queue drop below low watermark after post_msg return full
+#define XPOLL_EVT_OPT_TIMEOUT  3 // ucid timer expired, status is XPOLL_TIMER_XXX, ubytes is interval milliseconds
 #define XPOLL_EVT_OPT_APP	100
 
+#define XPOLL_POST_ERR        (-1) // post return: error, the message not queued
+#define XPOLL_POST_WOULDBLOCK 0    // post return: full, the message not queued, XPOLL_EVT_OPT_WRITABLE event when drained
+#define XPOLL_POST_QUEUED     1    // post return: queued
+
+#define XPOLL_POST_BLOCK      0 // post policy when full: caller wait and retry until timeout
+#define XPOLL_POST_NOWAIT     1 // post policy when full: return XPOLL_POST_WOULDBLOCK at once
+#define XPOLL_POST_DROPOLDEST 2 // post policy when full: drop oldest packages not sending with XPOLL_EVT_ST_DROP, only for independent messages
+#define XPOLL_POST_DISCONNECT 3 // post policy when full: disconnect the slow consumer, return XPOLL_POST_ERR
+
+#define XPOLL_TIMER_IDLE       0 // no read and send over interval
+#define XPOLL_TIMER_HANDSHAKE  1 // one shot, kill when handshake done
+#define XPOLL_TIMER_LOGIN      2 // one shot, kill when login success
+#define XPOLL_TIMER_WRITESTALL 3 // send queue not empty and no send progress over interval
+#define XPOLL_TIMER_FLUSH      4 // one shot, flush the messages coalesced by application
+#define XPOLL_TIMER_KEEPALIVE  5 // same as idle, for the protocol layer(http keep-alive), independent of the application idle timer
+#define XPOLL_TIMERS           6
+
+#ifndef XPOLL_TIMER_TICK
+#	define XPOLL_TIMER_TICK 100 // timing wheel tick milliseconds, also max poll wait
+#endif
+
+#ifndef XPOLL_MAX_SHARDS
+#	define XPOLL_MAX_SHARDS 16 // max xpoll shards
+#endif
+
+#ifndef XPOLL_MAX_QUEUES
+#	define XPOLL_MAX_QUEUES 16 // max complete event queues per xpoll
+#endif
+
+#define XPOLL_FLAG_READNOTDONE 0x01 // read event not done, can't read continue
+#define XPOLL_FLAG_READABLE    0x02 // epoll: socket has data not read
+#define XPOLL_FLAG_PENDING     0x04 // epoll: ucid in pending list
+#define XPOLL_FLAG_WAITWRITABLE 0x08 // post_msg return full, add writable event when below low watermark
+#define XPOLL_FLAG_RDHUP       0x10 // epoll: peer shutdown write, read continue until recv return 0
+
+#define XPOLL_PKG_SHARED 0x01 // t_xpoll_sendpkg.res and t_xpoll_event.res[0], pd is data of shared_buffer
+
+#ifndef XPOLL_MAP_INITSIZE
+#	define XPOLL_MAP_INITSIZE 1024 // initial ucid map size of one shard, grow with incremental rehash
+#endif
+
 #ifndef XPOLL_READ_BLK_SIZE
 #	define XPOLL_READ_BLK_SIZE (1024 * 16)
 #endif
@@ -154,6 +247,202 @@ namespace ec {
 		struct sockaddr_in _sinaddr;
 	};
 
+	class pollevt // coalesced wakeup event for poll/select wait, set_event only signal when not pending
+	{
+	public:
+		pollevt() : _pending(0) {
+#ifndef _WIN32
+			_fd = INVALID_SOCKET;
+			_fdw = INVALID_SOCKET;
+#endif
+		}
+		~pollevt() {
+			close();
+		}
+		bool open()
+		{
+			_pending = 0;
+#ifdef _WIN32
+			return _udpevt.open();
+#elif defined __linux__
+			_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			return _fd >= 0;
+#else
+			int fds[2];
+			if (pipe(fds) < 0)
+				return false;
+			for (int i = 0; i < 2; i++) {
+				fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+				fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+			}
+			_fd = fds[0];
+			_fdw = fds[1];
+			return true;
+#endif
+		}
+		void close()
+		{
+#ifdef _WIN32
+			_udpevt.close();
+#else
+			if (_fd != INVALID_SOCKET) {
+				::close(_fd);
+				_fd = INVALID_SOCKET;
+			}
+			if (_fdw != INVALID_SOCKET) {
+				::close(_fdw);
+				_fdw = INVALID_SOCKET;
+			}
+#endif
+		}
+		void set_event()
+		{
+			if (_pending.exchange(1, std::memory_order_acq_rel)) // already signaled, poll thread not reset yet
+				return;
+#ifdef _WIN32
+			_udpevt.set_event();
+#elif defined __linux__
+			if (_fd != INVALID_SOCKET) {
+				uint64_t u = 1;
+				if (::write(_fd, &u, sizeof(u)) < 0)
+					_pending = 0;
+			}
+#else
+			if (_fdw != INVALID_SOCKET) {
+				char c = 0;
+				if (::write(_fdw, &c, 1) < 0)
+					_pending = 0;
+			}
+#endif
+		}
+		/*!
+		\brief called by poll thread before do the pending jobs
+		drain the signal first then clear _pending, a set_event after the clear always write a new signal.
+		clear with an RMW, so the jobs queued before a suppressed set_event are visible to the pending jobs after.
+		*/
+		void reset_event()
+		{
+#ifdef _WIN32
+			_udpevt.reset_event();
+#elif defined __linux__
+			uint64_t u;
+			if (_fd != INVALID_SOCKET)
+				while (::read(_fd, &u, sizeof(u)) < 0 && errno == EINTR);
+#else
+			char buf[256];
+			while (_fd != INVALID_SOCKET && ::read(_fd, buf, sizeof(buf)) > 0);
+#endif
+			_pending.exchange(0, std::memory_order_acq_rel);
+		}
+		inline SOCKET getfd() {
+#ifdef _WIN32
+			return _udpevt.getfd();
+#else
+			return _fd;
+#endif
+		}
+	private:
+		std::atomic<int> _pending;
+#ifdef _WIN32
+		udpevt _udpevt;
+#else
+		int _fd, _fdw;
+#endif
+	};
+
+	struct t_xpoll_sendpkg // send package node
+	{
+		t_xpoll_sendpkg* pnext;
+		uint8_t  *pd;  //message
+		uint32_t size; //message bytes size
+		uint32_t res;  // XPOLL_PKG_XXX
+	};
+
+	struct t_xpoll_sendq // chained send queue counted by bytes, memset 0 to init, locked by owner, nodes from pmem
+	{
+		t_xpoll_sendpkg* phead; // first package, current send
+		t_xpoll_sendpkg* ptail; // last package
+		size_t   ubytes;   // bytes not send
+		uint32_t upkgs;    // packages number
+		uint32_t usendsize;// send bytes of phead
+		uint32_t usending; // packages from phead in sending without lock, can not drop
+
+		inline bool empty() const
+		{
+			return !phead;
+		}
+		bool full(size_t size, size_t uhighwater) const // always can add one package when empty
+		{
+			return phead && ubytes + size > uhighwater;
+		}
+		bool add(void* pd, size_t size, memory* pmem, uint32_t ures = 0)
+		{
+			t_xpoll_sendpkg* pn = (t_xpoll_sendpkg*)pmem->mem_malloc(sizeof(t_xpoll_sendpkg));
+			if (!pn)
+				return false;
+			pn->pnext = nullptr;
+			pn->pd = (uint8_t*)pd;
+			pn->size = (uint32_t)size;
+			pn->res = ures;
+			if (ptail)
+				ptail->pnext = pn;
+			else
+				phead = pn;
+			ptail = pn;
+			ubytes += size;
+			upkgs++;
+			return true;
+		}
+		void* pop(uint32_t *psize, memory* pmem, uint32_t *pres = nullptr) // remove head, return message
+		{
+			t_xpoll_sendpkg* pn = phead;
+			if (!pn)
+				return nullptr;
+			void* pd = pn->pd;
+			*psize = pn->size;
+			if (pres)
+				*pres = pn->res;
+			ubytes -= pn->size - usendsize;
+			usendsize = 0;
+			upkgs--;
+			phead = pn->pnext;
+			if (!phead)
+				ptail = nullptr;
+			pmem->mem_free(pn);
+			return pd;
+		}
+		void* drop(uint32_t ukeep, uint32_t *psize, memory* pmem, uint32_t *pres = nullptr) // remove the oldest package after ukeep packages and not started, stop at zero size message
+		{
+			t_xpoll_sendpkg *pre = nullptr, *pn = phead;
+			if (usendsize && !ukeep)
+				ukeep = 1;
+			for (; pn && ukeep; ukeep--) {
+				pre = pn;
+				pn = pn->pnext;
+			}
+			if (!pn || !pn->size)
+				return nullptr;
+			if (!pre)
+				return pop(psize, pmem, pres);
+			pre->pnext = pn->pnext;
+			if (ptail == pn)
+				ptail = pre;
+			void* pd = pn->pd;
+			*psize = pn->size;
+			if (pres)
+				*pres = pn->res;
+			ubytes -= pn->size;
+			upkgs--;
+			pmem->mem_free(pn);
+			return pd;
+		}
+		void sent(size_t size) // part of phead sent
+		{
+			usendsize += (uint32_t)size;
+			ubytes -= size;
+		}
+	};
+
 	struct t_xpoll_item //
 	{
 		uint32_t ucid;  //key
@@ -163,16 +452,13 @@ namespace ec {
 #else
 		int		 fd; //Non-block
 #endif		
-		uint32_t uflag; //d0=1:read event not done; 0：done ,can read continue
-		uint32_t uhead; // get position, point first data and current send message
-		uint32_t usendsize;//current send bytes
-		uint32_t utail; //add position, point empty
+		uint32_t uflag; //XPOLL_FLAG_XXX, d0=1:read event not done; 0：done ,can read continue
 		time_t	 lasterr; //last time send failed
 		char     sinfo[64];// '\n' seperate, now just has "ip:192.168.1.41\n"
-		struct t_pkg {
-			uint32_t size; //message bytes size
-			uint8_t  *pd;  //message
-		} pkg[XPOLL_SEND_PKG_NUM]; //FIFO buffer
+		t_xpoll_sendq sq; // send queue
+		uint32_t tmrid[XPOLL_TIMERS]; // timer id in timing wheel, 0 none
+		uint64_t tkactive; // wheel tick of last read or send
+		uint64_t tksend;   // wheel tick of last send progress
 	};
 
 	struct t_xpoll_send // send item
@@ -195,7 +481,7 @@ namespace ec {
 		uint32_t ubytes;//send or read bytes
 		uint8_t  opt;   //0(XPOLL_EVT_OPT_READ):read ; 1(XPOLL_EVT_OPT_SEND):send
 		uint8_t  status;//0(XPOLL_EVT_ST_OK):OK ; 1(XPOLL_EVT_ST_ERR):failed; 2(XPOLL_EVT_ST_CLOSE): xpoll close
-		uint8_t  res[2];//res,set 0
+		uint8_t  res[2];//res,set 0; send event res[0] XPOLL_PKG_XXX inside xpoll
 		void*    pdata; //if ucopt==read,pdata is xpoll buffer,else is user buffer
 	};
 #if (!defined _WIN32) || (_WIN32_WINNT >= 0x0600)
@@ -207,43 +493,144 @@ namespace ec {
 			return key == val.ucid;
 		}
 	};
+	typedef mpmc_queue<t_xpoll_event> xpoll_evtqueue; // complete event queue
+
 	class xpoll : public cThread
 	{
 	private:
-		std::mutex _cpevtlock;//lock for _cpevt
-		ec::cEvent _evtiocp, _evtcanadd; // for _cpevt
-		ec::fifo<t_xpoll_event> _cpevt;//completely event
+		uint32_t _ucpqs; // number of complete event queues
+		xpoll_evtqueue* _pcpq[XPOLL_MAX_QUEUES]; // complete event queues
 
 		std::mutex _memread_lock;// lock for _memread
 		ec::memory _memread;// memory for read
 
+		std::mutex _memsend_lock;// lock for _memsend
+		ec::memory _memsend;// memory for send queue nodes
+
 		std::mutex _maplock;//lock for _map
 		ec::memory _memmap;// memory for _map 
 		bool _fdchanged;   //fds changed lock with _map
-		ec::map<uint32_t, t_xpoll_item> _map;
-		ec::map<uint32_t, t_xpoll_item>::iterator _posnext;
-
+		ec::flatmap<uint32_t, t_xpoll_item> _map; // get() pointer valid until next set/erase, all under _maplock
+		ec::flatmap<uint32_t, t_xpoll_item>::iterator _posnext;
+#if XPOLL_USE_EPOLL
+		int _epfd; // epoll fd
+		ec::vector<uint32_t> _pending;  // ucids need send or read continue, lock with _map
+		ec::vector<uint32_t> _pendingdo;// swap from _pending, used by poll thread
+		struct epoll_event _epevts[XPOLL_EPOLL_EVENTS];
+#else
 		ec::vector<pollfd> _pollfd;
 		ec::vector<uint32_t> _pollkey;
-		udpevt _udpevt;
+#endif
+		pollevt _pollevt;
 		uint32_t _unextid, _umaxconnects;
+		uint32_t _ushardno, _ushards; // shard number and shards number, ucid % _ushards == _ushardno
+		xpoll* _pshards[XPOLL_MAX_SHARDS]; // all shards, include this
+		size_t _uhighwater, _ulowwater; // send queue watermark bytes
+		timerwheel _tmw; // ucid timers, lock with _map
+		uint32_t _uidlems; // idle timer set when add_fd, 0 none
+		ec::vector<t_xpoll_event> _tmevts; // expired timer events, used by poll thread
 
 	public:
 		xpoll(uint32_t maxconnum) :
-			_cpevt(maxconnum * 5, &_cpevtlock),
+			_ucpqs(1),
 			_memread(XPOLL_READ_BLK_SIZE, 16 + maxconnum / 8, 0, 0, 0, 0, &_memread_lock),
-			_memmap(ec::map<uint32_t, t_xpoll_item>::size_node(), maxconnum),
-			_map(11 + (uint32_t)(maxconnum / 3), &_memmap),
+			_memsend(sizeof(t_xpoll_sendpkg), 64 + maxconnum * 2, 0, 0, 0, 0, &_memsend_lock),
+			_memmap(ec::flatmap<uint32_t, t_xpoll_item>::size_node(), maxconnum),
+			_map(maxconnum < XPOLL_MAP_INITSIZE ? maxconnum : XPOLL_MAP_INITSIZE, &_memmap),
+#if XPOLL_USE_EPOLL
+			_epfd(-1), _pending(1024), _pendingdo(1024),
+#else
 			_pollfd(maxconnum),
-			_pollkey(maxconnum), _unextid(100), _umaxconnects(maxconnum)
+			_pollkey(maxconnum),
+#endif
+			_unextid(100), _umaxconnects(maxconnum), _ushardno(0), _ushards(1),
+			_uhighwater(XPOLL_SEND_HIGH_WATER), _ulowwater(XPOLL_SEND_LOW_WATER),
+			_tmw(XPOLL_TIMER_TICK, maxconnum * XPOLL_TIMERS), _uidlems(0), _tmevts(256)
 		{
 			_posnext = 0;
 			_fdchanged = false;
+			memset(_pshards, 0, sizeof(_pshards));
+			_pshards[0] = this;
+			memset(_pcpq, 0, sizeof(_pcpq));
+			_pcpq[0] = new xpoll_evtqueue(maxconnum * 5);
+		}
+		virtual ~xpoll()
+		{
+			StopThread();
+			for (uint32_t i = 0; i < _ucpqs; i++) {
+				if (_pcpq[i])
+					delete _pcpq[i];
+			}
+		}
+		bool set_queues(uint32_t uqueues) // call before open, uqueues complete event queues, one worker per queue
+		{
+			if (!uqueues || uqueues > XPOLL_MAX_QUEUES || IsRun())
+				return false;
+			uint32_t i, usize = (_umaxconnects * 5) / uqueues + 256;
+			for (i = 0; i < _ucpqs; i++) {
+				delete _pcpq[i];
+				_pcpq[i] = nullptr;
+			}
+			for (i = 0; i < uqueues; i++)
+				_pcpq[i] = new xpoll_evtqueue(usize);
+			_ucpqs = uqueues;
+			return true;
+		}
+		inline uint32_t queues()
+		{
+			return _ucpqs;
+		}
+		bool set_shards(uint32_t ushardno, xpoll** pshards, uint32_t ushards) // call before open, pshards[ushardno] must be this
+		{
+			if (!ushards || ushards > XPOLL_MAX_SHARDS || ushardno >= ushards || pshards[ushardno] != this)
+				return false;
+			memset(_pshards, 0, sizeof(_pshards));
+			memcpy(_pshards, pshards, sizeof(xpoll*) * ushards);
+			_ushardno = ushardno;
+			_ushards = ushards;
+			_unextid = 100 - 100 % ushards + ushardno;
+			if (_unextid < 100)
+				_unextid += ushards;
+			return true;
+		}
+		inline xpoll* shard(uint32_t ucid) // get the shard of ucid
+		{
+			return _pshards[ucid % _ushards];
+		}
+		inline uint32_t shardno()
+		{
+			return _ushardno;
+		}
+		void memstat(memory::t_stat* pread, memory::t_stat* psend, memory::t_stat* pmap) // memory statistics snapshot of this shard, nullptr skip
+		{
+			if (pread)
+				_memread.stat(*pread);
+			if (psend)
+				_memsend.stat(*psend);
+			if (pmap)
+				_memmap.stat(*pmap);
 		}
 		bool open()
 		{
-			if (!_udpevt.open())
+			if (!_pollevt.open())
+				return false;
+#if XPOLL_USE_EPOLL
+			_epfd = epoll_create1(EPOLL_CLOEXEC);
+			if (_epfd < 0) {
+				_pollevt.close();
+				return false;
+			}
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN; // level-triggered, ucid 0 is pollevt
+			ev.data.u32 = 0;
+			if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _pollevt.getfd(), &ev) < 0) {
+				::close(_epfd);
+				_epfd = -1;
+				_pollevt.close();
 				return false;
+			}
+#endif
 			_fdchanged = true;
 			StartThread(nullptr);
 			return true;
@@ -254,25 +641,30 @@ namespace ec {
 			_maplock.lock();
 			_map.for_each([this](t_xpoll_item & v) //make all complete event
 			{
-				t_xpoll_event evt;
-				while (v.uhead != v.utail) {
-					evt.ucid = v.ucid;
-					evt.ubytes = 0;
-					evt.opt = XPOLL_EVT_OPT_SEND;
-					evt.status = XPOLL_EVT_ST_CLOSE;
-					evt.pdata = v.pkg[v.uhead].pd;
-					add_evt_wait(evt);
-					_evtiocp.SetEvent();
-					v.uhead = (v.uhead + 1) % XPOLL_SEND_PKG_NUM;
-				}
+				free_sendq(v.ucid, &v.sq, XPOLL_EVT_ST_CLOSE);
 			});
 			_map.clear(); // remove all from map
+			_tmw.clear();
+#if XPOLL_USE_EPOLL
+			_pending.clear();
+#endif
 			_maplock.unlock();
-			_udpevt.close();
+#if XPOLL_USE_EPOLL
+			if (_epfd >= 0) {
+				::close(_epfd);
+				_epfd = -1;
+			}
+#endif
+			_pollevt.close();
 		}
 
 		void add_event(uint32_t ucid, uint8_t opt, uint8_t st, void *pdata, size_t datasize)
 		{
+			xpoll* ps = shard(ucid);
+			if (ps != this) {
+				ps->add_event(ucid, opt, st, pdata, datasize);
+				return;
+			}
 			t_xpoll_event evt;//先添加一个connect事件到 _cpevt
 			memset(&evt, 0, sizeof(evt));
 			evt.opt = opt;
@@ -284,106 +676,290 @@ namespace ec {
 		}
 		bool add_fd(SOCKET fd, const char* sinfo) //add to pool
 		{
+			t_xpoll_item t;
+			memset(&t, 0, sizeof(t));
+			t.fd = fd;
+			t.uflag = XPOLL_FLAG_READNOTDONE; //set read event not done until connect event done, can't read continue
 			_maplock.lock();
 			uint32_t ucid = alloc_ucid();
-			if (!ucid) {
+			t.ucid = ucid;
+			t.tkactive = _tmw.curtick();
+			if (!ucid || !_map.set(ucid, t)) { // add to map first, connect event free_event will find it
 				_maplock.unlock();
 				return false; // return false if full
 			}
+			if (_uidlems)
+				_map.get(ucid)->tmrid[XPOLL_TIMER_IDLE] = _tmw.add(_uidlems, ucid, XPOLL_TIMER_IDLE);
 			_maplock.unlock();
 			void *pinfo = _memread.mem_malloc(XPOLL_READ_BLK_SIZE);
-			if (!pinfo)
+			if (!pinfo) {
+				_maplock.lock();
+				kill_timers(_map.get(ucid));
+				_map.erase(ucid);
+				_maplock.unlock();
 				return false;
+			}
 			str_ncpy((char*)pinfo, sinfo, XPOLL_READ_BLK_SIZE - 1);
 			add_event(ucid, XPOLL_EVT_OPT_READ, XPOLL_EVT_ST_CONNECT, pinfo, strlen((char*)pinfo) + 1);//add one connect event
 
-			t_xpoll_item t; //add to map
-			memset(&t, 0, sizeof(t));
-			t.ucid = ucid;
-			t.fd = fd;
-			t.uflag = 1; //set read event not done,can't read continue
 			_maplock.lock();
-			if (!_map.set(ucid, t)) {
+#if XPOLL_USE_EPOLL
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // register once, edge-triggered
+			ev.data.u32 = ucid;
+			if (_map.get(ucid) && epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
 				_maplock.unlock();
-				add_event(ucid, XPOLL_EVT_OPT_READ, XPOLL_EVT_ST_ERR, 0, 0);
+				do_delete(ucid, XPOLL_EVT_ST_ERR);
 				return true; // return true , delete with event
 			}
+#else
 			_fdchanged = true;
-			_udpevt.set_event();
+			_pollevt.set_event();
+#endif
 			_maplock.unlock();
 			return true;
 		}
 		inline void remove(uint32_t ucid) // remove from pool
 		{
+			xpoll* ps = shard(ucid);
+			if (ps != this) {
+				ps->remove(ucid);
+				return;
+			}
 			do_delete(ucid, XPOLL_EVT_ST_CLOSE);
 		}
-		int post_msg(uint32_t ucid, void *pd, size_t size)//post message,return -1:error  0:full ; 1:one message post
+		bool set_watermark(size_t uhigh, size_t ulow) // send queue watermark bytes per connect, call before open
+		{
+			if (!uhigh || ulow > uhigh || IsRun())
+				return false;
+			_uhighwater = uhigh;
+			_ulowwater = ulow;
+			return true;
+		}
+		/*!
+		\brief post message, zero size message will disconnect after all before sent
+		\param npolicy what to do when queued bytes over high watermark, XPOLL_POST_BLOCK same as XPOLL_POST_NOWAIT here
+		\return XPOLL_POST_ERR(-1):error or disconnected by XPOLL_POST_DISCONNECT;
+			XPOLL_POST_WOULDBLOCK(0):full, a XPOLL_EVT_OPT_WRITABLE event will add when below low watermark;
+			XPOLL_POST_QUEUED(1):one message post
+		*/
+		inline int post_msg(uint32_t ucid, void *pd, size_t size, int npolicy = XPOLL_POST_NOWAIT)
+		{
+			return post_pkg(ucid, pd, size, 0, npolicy);
+		}
+		int post_msg(uint32_t ucid, vector<uint8_t> *pvd, int npolicy = XPOLL_POST_NOWAIT)//post message,return as post_msg(ucid, pd, size, npolicy)
+		{
+			if (!pvd->is_inline()) {
+				int nret = post_msg(ucid, pvd->data(), pvd->size(), npolicy);
+				if (XPOLL_POST_QUEUED == nret)
+					pvd->detach_buf();
+				return nret;
+			}
+			size_t size = pvd->size(); // small_vector inline data, queue the heap copy from detach_buf()
+			void* pd = pvd->detach_buf();
+			if (!pd)
+				return XPOLL_POST_ERR;
+			int nret = post_msg(ucid, pd, size, npolicy);
+			if (XPOLL_POST_QUEUED != nret) {
+				pvd->add((const uint8_t*)pd, size); // restore, the caller still own the data
+				ec::memory* pm = pvd->get_mem_allocator();
+				if (pm)
+					pm->mem_free(pd);
+				else
+					free(pd);
+			}
+			return nret;
+		}
+		/*!
+		\brief post shared buffer, add one reference when queued, the caller still own its reference
+		\return as post_msg
+		*/
+		int post_shared(uint32_t ucid, shared_buffer* pbuf, int npolicy = XPOLL_POST_NOWAIT)
+		{
+			pbuf->addref();
+			int nret = post_pkg(ucid, pbuf->data(), pbuf->size(), XPOLL_PKG_SHARED, npolicy);
+			if (XPOLL_POST_QUEUED != nret)
+				pbuf->release();
+			return nret;
+		}
+		size_t post_shared(const uint32_t* pucids, size_t n, shared_buffer* pbuf, int npolicy = XPOLL_POST_NOWAIT) // return number of ucids queued
+		{
+			size_t i, nq = 0;
+			for (i = 0; i < n; i++) {
+				if (XPOLL_POST_QUEUED == post_shared(pucids[i], pbuf, npolicy))
+					nq++;
+			}
+			return nq;
+		}
+	private:
+		int post_pkg(uint32_t ucid, void *pd, size_t size, uint32_t ures, int npolicy)
+		{
+			xpoll* ps = shard(ucid);
+			if (ps != this)
+				return ps->post_pkg(ucid, pd, size, ures, npolicy);
+			t_xpoll_event evts[XPOLL_SEND_IOV_NUM];
+			uint32_t i, usize, upres, nevt = 0;
+			int nret = XPOLL_POST_QUEUED;
+			_maplock.lock();
+			t_xpoll_item* pi = _map.get(ucid);
+			if (!pi) {
+				_maplock.unlock();
+				return XPOLL_POST_ERR;
+			}
+			if (XPOLL_POST_DROPOLDEST == npolicy) {
+				memset(evts, 0, sizeof(evts));
+				while (nevt < XPOLL_SEND_IOV_NUM && pi->sq.full(size, _uhighwater)) {
+					evts[nevt].pdata = pi->sq.drop(pi->sq.usending, &usize, &_memsend, &upres);
+					if (!evts[nevt].pdata)
+						break;
+					evts[nevt].ucid = ucid;
+					evts[nevt].opt = XPOLL_EVT_OPT_SEND;
+					evts[nevt].status = XPOLL_EVT_ST_DROP;
+					evts[nevt].res[0] = (uint8_t)upres;
+					evts[nevt].ubytes = usize;
+					nevt++;
+				}
+			}
+			if (pi->sq.full(size, _uhighwater)) {
+				pi->uflag |= XPOLL_FLAG_WAITWRITABLE;
+				nret = XPOLL_POST_DISCONNECT == npolicy ? XPOLL_POST_ERR : XPOLL_POST_WOULDBLOCK;
+			}
+			else if (!pi->sq.add(pd, size, &_memsend, ures))
+				nret = XPOLL_POST_ERR;
+			else
+				set_pending(pi);
+			_maplock.unlock();
+			for (i = 0; i < nevt; i++)
+				add_evt_wait(evts[i]);
+			if (XPOLL_POST_ERR == nret && XPOLL_POST_DISCONNECT == npolicy)
+				do_delete(ucid, XPOLL_EVT_ST_ERR);
+			return nret;
+		}
+	public:
+		/*!
+		\brief set arena of read blocks memory, call before open
+		\param uflags MEM_ARENA_XXX
+		\param nnumanode prefer NUMA node, -1 none
+		\remark read blocks for 1/8 of max connections are prefaulted
+		*/
+		bool set_memarena(uint32_t uflags, int nnumanode = -1)
+		{
+			if (IsRun())
+				return false;
+			return _memread.set_arena(uflags, (size_t)XPOLL_READ_BLK_SIZE * (16 + _umaxconnects / 8), nnumanode);
+		}
+		bool set_idle_timeout(uint32_t umsec) // idle timer of new ucid, call before open, 0 none
+		{
+			if (IsRun())
+				return false;
+			_uidlems = umsec;
+			return true;
+		}
+		/*!
+		\brief set or restart timer ukind(XPOLL_TIMER_XXX) of ucid, a XPOLL_EVT_OPT_TIMEOUT event add to the worker of ucid when expired
+		\param umsec interval milliseconds, 0 kill the timer
+		*/
+		bool set_timer(uint32_t ucid, uint32_t ukind, uint32_t umsec)
 		{
+			xpoll* ps = shard(ucid);
+			if (ps != this)
+				return ps->set_timer(ucid, ukind, umsec);
+			if (ukind >= XPOLL_TIMERS)
+				return false;
 			ec::unique_lock lck(&_maplock);
 			t_xpoll_item* pi = _map.get(ucid);
 			if (!pi)
-				return -1;
-			if ((pi->utail + 1) % XPOLL_SEND_PKG_NUM == pi->uhead) //full
-				return 0;
-			pi->pkg[pi->utail].size = (uint32_t)size;
-			pi->pkg[pi->utail].pd = (uint8_t*)pd;
-			pi->utail = (pi->utail + 1) % XPOLL_SEND_PKG_NUM;
-			_udpevt.set_event();
-			return 1;
+				return false;
+			if (!umsec) {
+				_tmw.del(pi->tmrid[ukind]);
+				pi->tmrid[ukind] = 0;
+				return true;
+			}
+			if (XPOLL_TIMER_IDLE == ukind || XPOLL_TIMER_KEEPALIVE == ukind)
+				pi->tkactive = _tmw.curtick();
+			else if (XPOLL_TIMER_WRITESTALL == ukind)
+				pi->tksend = _tmw.curtick();
+			if (pi->tmrid[ukind] && _tmw.reset(pi->tmrid[ukind], umsec))
+				return true;
+			pi->tmrid[ukind] = _tmw.add(umsec, ucid, ukind);
+			return 0 != pi->tmrid[ukind];
+		}
+		inline bool kill_timer(uint32_t ucid, uint32_t ukind)
+		{
+			return set_timer(ucid, ukind, 0);
 		}
-		int post_msg(uint32_t ucid, vector<uint8_t> *pvd)//post message,return -1:error  0:full ; 1:one message post
+		int sendnodone(uint32_t ucid) // return number of packages not sent, -1 if not exist
 		{
+			xpoll* ps = shard(ucid);
+			if (ps != this)
+				return ps->sendnodone(ucid);
 			ec::unique_lock lck(&_maplock);
 			t_xpoll_item* pi = _map.get(ucid);
 			if (!pi)
 				return -1;
-			if ((pi->utail + 1) % XPOLL_SEND_PKG_NUM == pi->uhead) //full
-				return 0;
-			pi->pkg[pi->utail].size = (uint32_t)pvd->size();
-			pi->pkg[pi->utail].pd = (uint8_t*)pvd->detach_buf();
-			pi->utail = (pi->utail + 1) % XPOLL_SEND_PKG_NUM;
-			_udpevt.set_event();
-			return 1;
+			return (int)pi->sq.upkgs;
 		}
-		int sendnodone(uint32_t ucid)
+		int64_t sendbytes(uint32_t ucid) // return bytes not sent, -1 if not exist
 		{
+			xpoll* ps = shard(ucid);
+			if (ps != this)
+				return ps->sendbytes(ucid);
 			ec::unique_lock lck(&_maplock);
 			t_xpoll_item* pi = _map.get(ucid);
 			if (!pi)
 				return -1;
-			uint32_t n = 0, h = pi->uhead, t = pi->utail;
-			while (h != t) {
-				h = (h + 1) % XPOLL_SEND_PKG_NUM;
-				n++;
-			}
-			return (int)n;
+			return (int64_t)pi->sq.ubytes;
 		}
-		bool get_event(t_xpoll_event *pout)// get one complete event
+		bool get_event(t_xpoll_event *pout, uint32_t nqueue = 0)// get one complete event from queue nqueue
 		{
-			_evtiocp.Wait(100);
-			if (_cpevt.get(*pout)) {
-				_evtiocp.SetEvent();
-				_evtcanadd.SetEvent();
-				return true;
-			}
-			return false;
+			return _pcpq[nqueue < _ucpqs ? nqueue : 0]->get(*pout, 100);
+		}
+		size_t get_events(t_xpoll_event *pout, size_t n, uint32_t nqueue = 0)// get max n complete events from queue nqueue, wait max 100ms
+		{
+			return _pcpq[nqueue < _ucpqs ? nqueue : 0]->get(pout, n, 100);
 		}
 		void free_event(t_xpoll_event *pi)// when done event by get_event,must call free_event
 		{
 			if (pi->opt != XPOLL_EVT_OPT_READ)
 				return;
+			xpoll* ps = shard(pi->ucid);
+			if (ps != this) {
+				ps->free_event(pi);
+				return;
+			}
 			_maplock.lock();
 			t_xpoll_item* p = _map.get(pi->ucid);
-			if (p)
-				p->uflag = 0; //set read done 
+			if (p) {
+				p->uflag &= ~XPOLL_FLAG_READNOTDONE; //set read done
+#if XPOLL_USE_EPOLL
+				if (p->uflag & XPOLL_FLAG_READABLE)
+					set_pending(p); // edge-triggered, read continue in poll thread
+#endif
+			}
 			_maplock.unlock();
 			_memread.mem_free(pi->pdata);//recycle read memory			
 		}
 		inline bool has_event()
 		{
-			return !_cpevt.empty();
+			for (uint32_t i = 0; i < _ucpqs; i++) {
+				if (!_pcpq[i]->empty())
+					return true;
+			}
+			return false;
 		}
 	private:
+		inline void set_pending(t_xpoll_item* pi) // lock with _map, wakeup poll thread to do send or read
+		{
+#if XPOLL_USE_EPOLL
+			if (pi->uflag & XPOLL_FLAG_PENDING)
+				return; // already in _pending, poll thread will do it
+			pi->uflag |= XPOLL_FLAG_PENDING;
+			_pending.add(pi->ucid);
+#endif
+			_pollevt.set_event();
+		}
+#if !XPOLL_USE_EPOLL
 		void make_pollfd()
 		{
 			ec::unique_lock lck(&_maplock);
@@ -393,7 +969,7 @@ namespace ec {
 			_pollkey.clear();
 
 			pollfd tv;
-			tv.fd = _udpevt.getfd(); //add udoevt fd
+			tv.fd = _pollevt.getfd(); //add pollevt fd
 			tv.events = POLLIN;
 			tv.revents = 0;
 			_pollfd.add(tv);
@@ -402,7 +978,7 @@ namespace ec {
 			_map.for_each([this](t_xpoll_item & v) {
 				pollfd t;
 				t.fd = v.fd;
-				if (v.uhead != v.utail)
+				if (!v.sq.empty())
 					t.events = POLLIN | POLLOUT;
 				else
 					t.events = POLLIN;
@@ -412,30 +988,79 @@ namespace ec {
 			});
 			_fdchanged = false;
 		}
-		bool add_evt_wait(t_xpoll_event &evt)
+#endif
+		inline xpoll_evtqueue* evtqueue(uint32_t ucid) // complete event queue of ucid
 		{
-			bool bfull = false;
-			int i, nr = _cpevt.add(evt, &bfull);
-			if (nr > 0)
-			{
-				if (!bfull)
-					_evtcanadd.SetEvent();
-				return true;
+			return _pcpq[_ucpqs > 1 ? (ucid / _ushards) % _ucpqs : 0];
+		}
+		inline bool add_evt_wait(t_xpoll_event &evt) // add to the queue of evt.ucid and notify, wait max 2 seconds if full
+		{
+			if (XPOLL_EVT_OPT_SEND == evt.opt && (evt.res[0] & XPOLL_PKG_SHARED)) { // send done, release the reference here
+				shared_buffer::from_data(evt.pdata)->release();
+				evt.pdata = nullptr;
+				evt.res[0] = 0;
 			}
-			else if (nr < 0)
-				return false;
-			for (i = 0; i < 20; i++) {
-				_evtiocp.SetEvent();
-				_evtcanadd.Wait(100);
-				nr = _cpevt.add(evt, &bfull);
-				if (nr > 0)
-				{
-					if (!bfull)
-						_evtcanadd.SetEvent();
-					return true;
-				}
+			return evtqueue(evt.ucid)->add(evt, 2000);
+		}
+		void free_sendq(uint32_t ucid, t_xpoll_sendq* pq, uint8_t status) // add send complete event with status for all not sent packages
+		{
+			t_xpoll_event evt;
+			uint32_t usize, ures;
+			memset(&evt, 0, sizeof(evt));
+			evt.ucid = ucid;
+			evt.opt = XPOLL_EVT_OPT_SEND;
+			evt.status = status;
+			while (!pq->empty()) {
+				evt.pdata = pq->pop(&usize, &_memsend, &ures);
+				evt.res[0] = (uint8_t)ures;
+				add_evt_wait(evt);
+			}
+		}
+		void kill_timers(t_xpoll_item* pi) // lock with _map
+		{
+			if (!pi)
+				return;
+			for (int i = 0; i < XPOLL_TIMERS; i++) {
+				_tmw.del(pi->tmrid[i]);
+				pi->tmrid[i] = 0;
 			}
-			return false;
+		}
+		void do_timer() // run timing wheel in poll thread, add XPOLL_EVT_OPT_TIMEOUT events
+		{
+			_maplock.lock();
+			_tmevts.clear();
+			_tmw.run(timerwheel::nowms(), [this](uint32_t id, uint32_t ucid, uint32_t ukind, uint32_t umsec) -> uint32_t {
+				t_xpoll_item* pi = _map.get(ucid);
+				if (!pi || ukind >= XPOLL_TIMERS || pi->tmrid[ukind] != id)
+					return 0;
+				uint64_t ucur = _tmw.curtick(), ulast = ucur;
+				if (XPOLL_TIMER_IDLE == ukind || XPOLL_TIMER_KEEPALIVE == ukind)
+					ulast = pi->tkactive;
+				else if (XPOLL_TIMER_WRITESTALL == ukind) {
+					if (pi->sq.empty()) {
+						pi->tksend = ucur; // nothing to send, check again from now
+						return umsec;
+					}
+					ulast = pi->tksend;
+				}
+				uint64_t ums = ulast < ucur ? (ucur - ulast) * _tmw.tickms() : 0;
+				if (XPOLL_TIMER_IDLE == ukind || XPOLL_TIMER_KEEPALIVE == ukind || XPOLL_TIMER_WRITESTALL == ukind) {
+					if (ums < umsec)
+						return (uint32_t)(umsec - ums); // active after start, restart for the rest
+				}
+				pi->tmrid[ukind] = 0;
+				t_xpoll_event evt;
+				memset(&evt, 0, sizeof(evt));
+				evt.ucid = ucid;
+				evt.opt = XPOLL_EVT_OPT_TIMEOUT;
+				evt.status = (uint8_t)ukind;
+				evt.ubytes = umsec;
+				_tmevts.add(evt);
+				return 0;
+			});
+			_maplock.unlock();
+			for (size_t i = 0; i < _tmevts.size(); i++)
+				add_evt_wait(_tmevts[i]);
 		}
 		void add_close_event(uint32_t ucid, int status)
 		{
@@ -445,57 +1070,71 @@ namespace ec {
 			evt.opt = XPOLL_EVT_OPT_READ;
 			evt.status = status;
 			add_evt_wait(evt);
-			_evtiocp.SetEvent();
 		}
 
-		bool get_send(uint32_t ucid, t_xpoll_send* ps)
+		int sendv(uint32_t ucid) // gather all queued packages to one sendmsg/WSASend. return -1:error and deleted; 0:empty; 1:has more to send; 2:would block
 		{
-			ec::unique_lock lck(&_maplock);
-			t_xpoll_item* p = nullptr;
-			p = _map.get(ucid);
-			if (!p)
-				return false;
-			if (p->uhead != p->utail) //not empty
-			{
-				ps->ucid = p->ucid;
-				ps->fd = p->fd;
-				ps->upos = p->uhead;
-				ps->usendsize = p->usendsize;
-				ps->pd = p->pkg[p->uhead].pd;
-				ps->usize = p->pkg[p->uhead].size;
-				return true;
+			SOCKET fd;
+			uint32_t n = 0;
+			t_xpoll_sendpkg* pk;
+#ifdef _WIN32
+			WSABUF iov[XPOLL_SEND_IOV_NUM];
+#else
+			struct iovec iov[XPOLL_SEND_IOV_NUM];
+#endif
+			_maplock.lock();
+			t_xpoll_item* pi = _map.get(ucid);
+			if (!pi || pi->sq.empty()) {
+				_maplock.unlock();
+				return 0;
 			}
-			return false;
-		}
-		int sendts(t_xpoll_send* ps) // return -1:error; 0:no send ; >0 send byte
-		{
-			int nret, ns = (int)(ps->usize - ps->usendsize);
-			if (ns < 0 || ps->usendsize > ps->usize) {
-				do_sendbyte(ps, -1);
+			pk = pi->sq.phead;
+			if (!pk->size || pi->sq.usendsize >= pk->size) {
+				uint8_t st = pk->size ? XPOLL_EVT_ST_ERR : XPOLL_EVT_ST_CLOSE; // zero size msg will disconenct
+				_maplock.unlock();
+				do_delete(ucid, st);
 				return -1;
 			}
-#ifdef _WIN32            
-			nret = ::send(ps->fd, (char*)ps->pd + ps->usendsize, ns, 0);
-			if (-1 == nret) {
-				int nerr = WSAGetLastError();
-				if (WSAEWOULDBLOCK == nerr || WSAENOBUFS == nerr) {  // nonblocking  mode
-					do_sendbyte(ps, 0);
-					return 0;
+			fd = pi->fd;
+			for (; pk && pk->size && n < XPOLL_SEND_IOV_NUM; pk = pk->pnext) { // stop at zero size msg
+#ifdef _WIN32
+				iov[n].buf = (char*)pk->pd;
+				iov[n].len = pk->size;
+				if (!n) {
+					iov[n].buf += pi->sq.usendsize;
+					iov[n].len -= pi->sq.usendsize;
 				}
-			}
 #else
-			nret = ::send(ps->fd, (char*)ps->pd + ps->usendsize, ns, MSG_DONTWAIT | MSG_NOSIGNAL);
-			if (-1 == nret) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) { // nonblocking  mode
-					do_sendbyte(ps, 0);
-					return 0;
+				iov[n].iov_base = pk->pd;
+				iov[n].iov_len = pk->size;
+				if (!n) {
+					iov[n].iov_base = pk->pd + pi->sq.usendsize;
+					iov[n].iov_len -= pi->sq.usendsize;
 				}
+#endif
+				n++;
 			}
+			pi->sq.usending = n; // can not drop until do_sendbytes
+			_maplock.unlock();
+			long nsend;
+#ifdef _WIN32
+			DWORD dwsend = 0;
+			if (SOCKET_ERROR == WSASend(fd, iov, n, &dwsend, 0, NULL, NULL)) {
+				int nerr = WSAGetLastError();
+				nsend = (WSAEWOULDBLOCK == nerr || WSAENOBUFS == nerr) ? 0 : -1;
+			}
+			else
+				nsend = (long)dwsend;
+#else
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+			nsend = (long)::sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (nsend < 0)
+				nsend = (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
 #endif
-			if (nret > 0)
-				ps->usendsize += nret; //add to send bytes
-			do_sendbyte(ps, nret);
-			return nret;
+			return do_sendbytes(ucid, nsend);
 		}
 
 		void do_delete(uint32_t ucid, uint8_t status)
@@ -509,6 +1148,9 @@ namespace ec {
 			}
 
 			if (INVALID_SOCKET != pi->fd) {
+#if XPOLL_USE_EPOLL
+				epoll_ctl(_epfd, EPOLL_CTL_DEL, pi->fd, nullptr);
+#endif
 #ifdef _WIN32
 				shutdown(pi->fd, SD_BOTH);
 #else
@@ -519,102 +1161,120 @@ namespace ec {
 				add_close_event(ucid, status);
 			}
 
+			kill_timers(pi);
 			t = *pi;
 			_map.erase(ucid);// delete from map
 			_maplock.unlock();
-			t_xpoll_event evt;
-			while (t.uhead != t.utail) {
-				evt.ucid = ucid;
-				evt.ubytes = 0;
-				evt.opt = XPOLL_EVT_OPT_SEND;
-				evt.status = status;
-				evt.pdata = t.pkg[t.uhead].pd;
-				add_evt_wait(evt);
-				_evtiocp.SetEvent();
-				t.uhead = (t.uhead + 1) % XPOLL_SEND_PKG_NUM;
-			}
+			free_sendq(ucid, &t.sq, status);
 			_fdchanged = true;
 		}
-		int  do_sendbyte(t_xpoll_send* ps, int nerr) //return 0:no more send data;  >0：has more send data
+		int do_sendbytes(uint32_t ucid, long nsend) // nsend: -1 error, 0 would block, >0 bytes sent. add complete event per fully sent package, return as sendv
 		{
-			int nret = 0;
+			t_xpoll_event evts[XPOLL_SEND_IOV_NUM + 1];
+			uint32_t i, usize, ures, nevt = 0;
+			int nret;
 			_maplock.lock();
-			t_xpoll_item* pi = _map.get(ps->ucid);
+			t_xpoll_item* pi = _map.get(ucid);
 			if (!pi) {
 				_maplock.unlock();
-				return 0;
+				return -1;
 			}
-			if (nerr > 0) //success
-			{
-				pi->errnum = 0;// reset error counter
-				if (ps->usendsize == ps->usize)//complete
-				{
-					pi->uhead = (pi->uhead + 1) % XPOLL_SEND_PKG_NUM;//next
-					pi->lasterr = 0;
-					pi->usendsize = 0;
-					_maplock.unlock();
-					t_xpoll_event evt;
-					evt.ucid = ps->ucid;
-					evt.ubytes = ps->usendsize;
-					evt.opt = XPOLL_EVT_OPT_SEND;
-					evt.status = XPOLL_EVT_ST_OK;
-					evt.pdata = ps->pd;
-					add_evt_wait(evt);
-					_evtiocp.SetEvent();
-					if (pi->uhead != pi->utail)
-						nret = 1;
-					return nret;
-				}
-				else
-					nret = 1;
+			pi->sq.usending = 0;
+			if (nsend < 0) {
+				_maplock.unlock();
+				do_delete(ucid, XPOLL_EVT_ST_ERR);
+				return -1;
 			}
-			else if (nerr == 0)
-			{
+			if (!nsend) {
 				pi->errnum++;
 				if (pi->errnum == 1)
 					pi->lasterr = ::time(0);
-				else if (pi->errnum > 2) {
-					time_t tcur = ::time(0);
-					if (pi->lasterr && (tcur - pi->lasterr) > 5) {
-						_maplock.unlock();
-						do_delete(ps->ucid, XPOLL_EVT_ST_ERR);
-						return 0;
-					}
+				else if (pi->errnum > 2 && pi->lasterr && ::time(0) - pi->lasterr > 5) { // can not send over 5 seconds
+					_maplock.unlock();
+					do_delete(ucid, XPOLL_EVT_ST_ERR);
+					return -1;
 				}
-			}
-			else if (nerr < 0) {
 				_maplock.unlock();
-				do_delete(ps->ucid, XPOLL_EVT_ST_ERR);
-				return 0;
+				return 2;
 			}
+			pi->errnum = 0;// reset error counter
+			pi->lasterr = 0;
+			pi->tkactive = _tmw.curtick();
+			pi->tksend = pi->tkactive;
+			size_t uleft = (size_t)nsend, ur;
+			while (uleft && !pi->sq.empty() && nevt < XPOLL_SEND_IOV_NUM) {
+				ur = pi->sq.phead->size - pi->sq.usendsize;
+				if (uleft < ur) {
+					pi->sq.sent(uleft);
+					break;
+				}
+				uleft -= ur;
+				memset(&evts[nevt], 0, sizeof(t_xpoll_event));
+				evts[nevt].ucid = ucid;
+				evts[nevt].opt = XPOLL_EVT_OPT_SEND;
+				evts[nevt].status = XPOLL_EVT_ST_OK;
+				evts[nevt].pdata = pi->sq.pop(&usize, &_memsend, &ures);
+				evts[nevt].ubytes = usize;
+				evts[nevt].res[0] = (uint8_t)ures;
+				nevt++;
+			}
+			if ((pi->uflag & XPOLL_FLAG_WAITWRITABLE) && pi->sq.ubytes <= _ulowwater) { // notify can post again
+				pi->uflag &= ~XPOLL_FLAG_WAITWRITABLE;
+				memset(&evts[nevt], 0, sizeof(t_xpoll_event));
+				evts[nevt].ucid = ucid;
+				evts[nevt].opt = XPOLL_EVT_OPT_WRITABLE;
+				evts[nevt].status = XPOLL_EVT_ST_OK;
+				evts[nevt].ubytes = (uint32_t)pi->sq.ubytes;
+				nevt++;
+			}
+			if (pi->sq.usendsize)
+				nret = 2; // part sent, socket buffer full
+			else
+				nret = pi->sq.empty() ? 0 : 1;
 			_maplock.unlock();
+			for (i = 0; i < nevt; i++)
+				add_evt_wait(evts[i]);
 			return nret;
 		}
-		void set_read_data_flag(uint32_t ucid, bool bhasdata)
+		void set_read_data_flag(uint32_t ucid, bool bhasdata, bool breadable = false)
 		{
 			ec::unique_lock lck(&_maplock);
 			t_xpoll_item* p = _map.get(ucid);
-			if (!p || (p->uflag & 0x01)) {
-				_maplock.unlock();
+			if (!p)
 				return;
+			if (bhasdata) {
+				p->uflag |= XPOLL_FLAG_READNOTDONE; // set bit 0
+				p->tkactive = _tmw.curtick();
 			}
-			if (bhasdata)
-				p->uflag |= 0x01; // set bit 0				
 			else
-				p->uflag ^= ~(0x01);// clear bit0				
+				p->uflag &= ~XPOLL_FLAG_READNOTDONE;// clear bit0
+			if (breadable)
+				p->uflag |= XPOLL_FLAG_READABLE; // edge-triggered, socket may has more data
+			else
+				p->uflag &= ~XPOLL_FLAG_READABLE;
 		}
-#ifdef _WIN32
-		void do_read(uint32_t ucid, SOCKET fd)
-#else
-		void do_read(uint32_t ucid, int fd)
-#endif
+		void set_rdhup(uint32_t ucid)
+		{
+			ec::unique_lock lck(&_maplock);
+			t_xpoll_item* p = _map.get(ucid);
+			if (p)
+				p->uflag |= XPOLL_FLAG_RDHUP;
+		}
+		void do_read(uint32_t ucid)
 		{
 			_maplock.lock();
 			t_xpoll_item* p = _map.get(ucid);
-			if (!p || (p->uflag & 0x01)) {
+			if (!p) {
+				_maplock.unlock();
+				return;
+			}
+			if (p->uflag & XPOLL_FLAG_READNOTDONE) {
+				p->uflag |= XPOLL_FLAG_READABLE; // read continue at free_event
 				_maplock.unlock();
 				return;
 			}
+			SOCKET fd = p->fd;
+			bool brdhup = 0 != (p->uflag & XPOLL_FLAG_RDHUP);
 			_maplock.unlock();
 
 			t_xpoll_event evt;//读
@@ -622,6 +1282,8 @@ namespace ec {
 			evt.ubytes = 0;
 			evt.opt = XPOLL_EVT_OPT_READ;
 			evt.status = XPOLL_EVT_ST_OK;
+			evt.res[0] = 0;
+			evt.res[1] = 0;
 			evt.pdata = _memread.mem_malloc(XPOLL_READ_BLK_SIZE);
 			if (!evt.pdata)
 				return;
@@ -641,8 +1303,10 @@ namespace ec {
 				if (WSAEWOULDBLOCK == WSAGetLastError())
 					_memread.mem_free(evt.pdata);
 #else
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
 					_memread.mem_free(evt.pdata);
+					set_read_data_flag(ucid, false, false); // no more data until next EPOLLIN
+				}
 #endif
 				else {
 					_memread.mem_free(evt.pdata);
@@ -653,10 +1317,8 @@ namespace ec {
 			else //read event
 			{
 				evt.ubytes = nr;
-				set_read_data_flag(ucid, true);
-				if (add_evt_wait(evt))
-					_evtiocp.SetEvent();
-				else
+				set_read_data_flag(ucid, true, brdhup || nr >= XPOLL_READ_BLK_SIZE); // short read means socket buffer empty, but FIN still to read after RDHUP
+				if (!add_evt_wait(evt))
 				{
 					set_read_data_flag(ucid, false);
 					_memread.mem_free(evt.pdata);//free memory
@@ -667,33 +1329,109 @@ namespace ec {
 		{
 			if (_map.size() >= _umaxconnects)
 				return 0;
-			_unextid++;
+			_unextid += _ushards;
 			while (_unextid < 100 || _map.get(_unextid)) {
-				_unextid++;
+				if (_unextid < 100) { // wrap, keep _unextid % _ushards == _ushardno
+					_unextid = 100 - 100 % _ushards + _ushardno;
+					if (_unextid < 100)
+						_unextid += _ushards;
+					continue;
+				}
+				_unextid += _ushards;
 			}
 			return _unextid;// not 0
 		}
+#if XPOLL_USE_EPOLL
+		void do_send(uint32_t ucid) // send until empty or EAGAIN, EPOLLOUT will continue
+		{
+			int nloop = 0;
+			while (sendv(ucid) == 1) {
+				if (++nloop >= XPOLL_EPOLL_SENDPKGS) { // requeue, do other ucids first
+					ec::unique_lock lck(&_maplock);
+					t_xpoll_item* pi = _map.get(ucid);
+					if (pi)
+						set_pending(pi);
+					return;
+				}
+			}
+		}
+		void do_pending()
+		{
+			_pendingdo.clear();
+			_maplock.lock();
+			if (_pending.size()) {
+				t_xpoll_item* pi;
+				for (auto &ucid : _pending) {
+					pi = _map.get(ucid);
+					if (pi) {
+						pi->uflag &= ~XPOLL_FLAG_PENDING;
+						_pendingdo.add(ucid);
+					}
+				}
+				_pending.clear();
+			}
+			_maplock.unlock();
+			for (auto &ucid : _pendingdo) {
+				do_send(ucid);
+				if (is_readable(ucid))
+					do_read(ucid);
+			}
+		}
+		bool is_readable(uint32_t ucid)
+		{
+			ec::unique_lock lck(&_maplock);
+			t_xpoll_item* pi = _map.get(ucid);
+			return pi && (pi->uflag & XPOLL_FLAG_READABLE) && !(pi->uflag & XPOLL_FLAG_READNOTDONE);
+		}
+#endif
 	protected:
+#if XPOLL_USE_EPOLL
+		virtual	void dojob()
+		{
+			int i, n = epoll_wait(_epfd, _epevts, XPOLL_EPOLL_EVENTS, XPOLL_TIMER_TICK);
+			uint32_t ucid, uevts;
+			for (i = 0; i < n; i++) {
+				ucid = _epevts[i].data.u32;
+				uevts = _epevts[i].events;
+				if (!ucid) { //pollevt
+					_pollevt.reset_event();
+					continue;
+				}
+				if (uevts & (EPOLLERR | EPOLLHUP)) { // error
+					do_delete(ucid, XPOLL_EVT_ST_ERR);
+					continue;
+				}
+				if (uevts & EPOLLOUT) //send first
+					do_send(ucid);
+				if (uevts & EPOLLRDHUP) //peer half-closed, FIN may arrive with last data, no more edge
+					set_rdhup(ucid);
+				if (uevts & (EPOLLIN | EPOLLRDHUP)) //read
+					do_read(ucid);
+			}
+			do_pending();
+			do_timer();
+		};
+#else
 		virtual	void dojob()
 		{
 			size_t i = 0;
 			int n;
-			t_xpoll_send ts;
 			make_pollfd();
 #ifdef _WIN32
-			n = WSAPoll(_pollfd.data(), (ULONG)_pollfd.size(), 200);
+			n = WSAPoll(_pollfd.data(), (ULONG)_pollfd.size(), XPOLL_TIMER_TICK);
 #else
-			n = poll(_pollfd.data(), _pollfd.size(), 200);
+			n = poll(_pollfd.data(), _pollfd.size(), XPOLL_TIMER_TICK);
 #endif
+			do_timer();
 			if (n <= 0)
 				return;
 			int nevtout = 0;
 			pollfd* p = _pollfd.data();
 			uint32_t* puid = _pollkey.data();
 			for (i = 0; i < _pollfd.size(); i++) {
-				if (i == 0) { //udpevt
+				if (i == 0) { //pollevt
 					if (p[i].revents & POLLIN) {
-						_udpevt.reset_event();
+						_pollevt.reset_event();
 						p[i].revents = 0;
 					}
 					continue;
@@ -702,17 +1440,9 @@ namespace ec {
 					do_delete(puid[i], XPOLL_EVT_ST_ERR);
 					continue;
 				}
-				nevtout = 0;
-				if (get_send(puid[i], &ts)) { //send first		
-					if (!ts.usize)
-						do_delete(puid[i], XPOLL_EVT_ST_CLOSE);// zero size msg will disconenct
-					else {
-						if (sendts(&ts) > 0) // not send complete 
-							nevtout = 1;
-					}
-				}
+				nevtout = sendv(puid[i]) > 0; //send first, wait POLLOUT if not send complete
 				if (p[i].revents & POLLIN)  //read
-					do_read(puid[i], p[i].fd);
+					do_read(puid[i]);
 				if (nevtout)
 					p[i].events = POLLIN | POLLOUT;
 				else
@@ -720,6 +1450,7 @@ namespace ec {
 				p[i].revents = 0;
 			}
 		};
+#endif
 	};
 #endif
 }
@@ -2,12 +2,44 @@
 \file c_crc32.h
 \brief crc32
 
+CRC-32 and CRC-32C use slice-by-8 tables, on x86 CRC-32 folding by PCLMULQDQ and CRC-32C by SSE4.2 crc32 instruction,
+selected at run time by cpuid. define CRC32_USE_HW 0 to use tables only.
+crc32_combine/crc32c_combine get the CRC of joined blocks from the CRC of each block.
+
 ec library is free C++ library.
 
 \author	 kipway@outlook.com
 */
 #ifndef C_CRC32_H
 #define C_CRC32_H
+#include <stddef.h>
+#include <string.h>
+
+#ifndef CRC32_USE_HW
+#   if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#       define CRC32_USE_HW 1
+#   else
+#       define CRC32_USE_HW 0
+#   endif
+#endif
+
+#ifndef CRC32_PCLMUL_MINSIZE
+#   define CRC32_PCLMUL_MINSIZE 128 // min bytes CRC-32 use PCLMULQDQ folding
+#endif
+
+#if CRC32_USE_HW
+#   ifdef _MSC_VER
+#       include <intrin.h>
+#       include <nmmintrin.h>
+#       include <wmmintrin.h>
+#       define CRC32_TARGET(s)
+#   else
+#       include <cpuid.h>
+#       include <nmmintrin.h>
+#       include <wmmintrin.h>
+#       define CRC32_TARGET(s) __attribute__((target(s)))
+#   endif
+#endif
 
 namespace ec
 {
@@ -55,18 +87,258 @@ namespace ec
         0XB3667A2E,0XC4614AB8,0X5D681B02,0X2A6F2B94,0XB40BBE37,0XC30C8EA1,0X5A05DF1B,0X2D02EF8D
     };    
 
-    inline unsigned int crc32(const void *pData, unsigned int dwSize)
+    /*
+    * slice-by-8 tables for reflected CRC-32, t[0] is the byte table
+    */
+    struct crc32_slice8
+    {
+        unsigned int t[8][256];
+        crc32_slice8(unsigned int poly, const unsigned int* pbytetab = nullptr) // pbytetab: byte table of poly if already have
+        {
+            unsigned int i, k, c;
+            for (i = 0; i < 256; i++) {
+                if (pbytetab) {
+                    t[0][i] = pbytetab[i];
+                    continue;
+                }
+                c = i;
+                for (k = 0; k < 8; k++)
+                    c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+                t[0][i] = c;
+            }
+            for (i = 0; i < 256; i++) {
+                for (k = 1; k < 8; k++)
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            }
+        }
+        unsigned int update(unsigned int crc, const unsigned char* p, size_t len) const // crc is the register, not inverted
+        {
+            unsigned int a, b;
+            while (len >= 8) {
+                a = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+                b = p[4] | (p[5] << 8) | (p[6] << 16) | ((unsigned int)p[7] << 24);
+                crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF] ^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24]
+                    ^ t[3][b & 0xFF] ^ t[2][(b >> 8) & 0xFF] ^ t[1][(b >> 16) & 0xFF] ^ t[0][b >> 24];
+                p += 8;
+                len -= 8;
+            }
+            while (len--)
+                crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+            return crc;
+        }
+    };
+
+    inline const crc32_slice8& crc32_tables() // CRC-32, poly 04C11DB7 reflected
+    {
+        static const crc32_slice8 tabs(0xEDB88320, crc32_table);
+        return tabs;
+    }
+
+    inline const crc32_slice8& crc32c_tables() // CRC-32C (Castagnoli), poly 1EDC6F41 reflected
+    {
+        static const crc32_slice8 tabs(0x82F63B78);
+        return tabs;
+    }
+
+#if CRC32_USE_HW
+    struct crc32_cpu
     {
-        register unsigned int	crc = 0xffffffff;
-        register unsigned int	len;
-        register const unsigned char	*buffer = (const unsigned char*)pData;
+        bool bsse42;  // crc32 instruction, CRC-32C
+        bool bpclmul; // carry-less multiply and sse4.1, CRC-32 folding
+        crc32_cpu() : bsse42(false), bpclmul(false)
+        {
+            unsigned int r[4] = { 0 };
+#ifdef _MSC_VER
+            __cpuid((int*)r, 1);
+#else
+            if (!__get_cpuid(1, &r[0], &r[1], &r[2], &r[3]))
+                return;
+#endif
+            bsse42 = 0 != (r[2] & (1u << 20));
+            bpclmul = 0 != (r[2] & (1u << 1)) && 0 != (r[2] & (1u << 19));
+        }
+    };
 
-        len = dwSize;
+    inline const crc32_cpu& crc32_getcpu()
+    {
+        static const crc32_cpu cpu;
+        return cpu;
+    }
+
+    CRC32_TARGET("sse4.2") inline unsigned int crc32c_sse42(unsigned int crc, const unsigned char* p, size_t len) // crc is the register
+    {
+#if defined(_M_X64) || defined(__x86_64__)
+        unsigned long long c = crc, v;
+        while (len >= 8) {
+            memcpy(&v, p, 8);
+            c = _mm_crc32_u64(c, v);
+            p += 8;
+            len -= 8;
+        }
+        crc = (unsigned int)c;
+#endif
+        unsigned int u;
+        while (len >= 4) {
+            memcpy(&u, p, 4);
+            crc = _mm_crc32_u32(crc, u);
+            p += 4;
+            len -= 4;
+        }
         while (len--)
-            crc = (crc >> 8) ^ crc32_table[(crc & 0xFF) ^ *buffer++];
-        return crc ^ 0xffffffff;
+            crc = _mm_crc32_u8(crc, *p++);
+        return crc;
+    }
+
+    /*
+    * CRC-32 by PCLMULQDQ folding, 4 x 128 bits in parallel, then Barrett reduce.
+    * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009.
+    * len >= 64 and multiple of 16, crc is the register.
+    */
+    CRC32_TARGET("pclmul,sse4.1") inline unsigned int crc32_pclmul(unsigned int crc, const unsigned char* p, size_t len)
+    {
+        const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+        const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+        const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+        const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+        const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+        __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+        x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_cvtsi32_si128((int)crc));
+        x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+        x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+        x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+        p += 64;
+        len -= 64;
+        while (len >= 64) { // fold 4 x 128 bits
+            x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+            x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+            x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+            x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)p));
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 16)));
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 32)));
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 48)));
+            p += 64;
+            len -= 64;
+        }
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00); // fold to 128 bits
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+        while (len >= 16) {
+            x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+            x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_loadu_si128((const __m128i*)p)), x5);
+            p += 16;
+            len -= 16;
+        }
+        x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10); // fold to 64 bits
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+        x2 = _mm_srli_si128(x1, 4);
+        x1 = _mm_and_si128(x1, mask32);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+        x2 = _mm_and_si128(x1, mask32); // Barrett reduce to 32 bits
+        x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+        x2 = _mm_and_si128(x2, mask32);
+        x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+        x1 = _mm_xor_si128(x1, x2);
+        return (unsigned int)_mm_extract_epi32(x1, 1);
+    }
+#endif
+
+    /*!
+    \brief continue CRC-32 of the data before, crc is the result of last call, 0 for start
+    */
+    inline unsigned int crc32_update(unsigned int crc, const void *pData, size_t size)
+    {
+        const unsigned char* p = (const unsigned char*)pData;
+        crc = ~crc;
+#if CRC32_USE_HW
+        if (size >= CRC32_PCLMUL_MINSIZE && crc32_getcpu().bpclmul) {
+            size_t n = size & ~(size_t)15;
+            crc = crc32_pclmul(crc, p, n);
+            p += n;
+            size -= n;
+        }
+#endif
+        return ~crc32_tables().update(crc, p, size);
+    }
+
+    inline unsigned int crc32(const void *pData, unsigned int dwSize)
+    {
+        return crc32_update(0, pData, dwSize);
     };
 
+    /*!
+    \brief continue CRC-32C(Castagnoli) of the data before, crc is the result of last call, 0 for start
+    */
+    inline unsigned int crc32c_update(unsigned int crc, const void *pData, size_t size)
+    {
+#if CRC32_USE_HW
+        if (crc32_getcpu().bsse42)
+            return ~crc32c_sse42(~crc, (const unsigned char*)pData, size);
+#endif
+        return ~crc32c_tables().update(~crc, (const unsigned char*)pData, size);
+    }
+
+    /*
+    * CRC-32C, Poly 1EDC6F41, Output for "123456789" : E3069283
+    */
+    inline unsigned int crc32c(const void *pData, size_t size)
+    {
+        return crc32c_update(0, pData, size);
+    }
+
+    inline unsigned int crc32_multmodp(unsigned int a, unsigned int b, unsigned int poly) // a(x) * b(x) modulo p(x), reflected
+    {
+        unsigned int m = 1u << 31, p = 0;
+        for (;;) {
+            if (a & m) {
+                p ^= b;
+                if (!(a & (m - 1)))
+                    break;
+            }
+            m >>= 1;
+            b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+        }
+        return p;
+    }
+
+    inline unsigned int crc32_x8nmodp(unsigned long long n, unsigned int poly) // x^(8 * n) modulo p(x), reflected
+    {
+        unsigned int p = 1u << 31, xk = 1u << 30; // x^0, x^1
+        int i;
+        for (i = 0; i < 3; i++)
+            xk = crc32_multmodp(xk, xk, poly); // x^8
+        while (n) {
+            if (n & 1)
+                p = crc32_multmodp(xk, p, poly);
+            n >>= 1;
+            if (n)
+                xk = crc32_multmodp(xk, xk, poly);
+        }
+        return p;
+    }
+
+    /*!
+    \brief CRC-32 of data1 + data2 from crc1 = crc32(data1), crc2 = crc32(data2) and len2 = bytes of data2,
+    so blocks can be checked in parallel or out of order.
+    */
+    inline unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, unsigned long long len2)
+    {
+        return crc32_multmodp(crc32_x8nmodp(len2, 0xEDB88320), crc1, 0xEDB88320) ^ crc2;
+    }
+
+    inline unsigned int crc32c_combine(unsigned int crc1, unsigned int crc2, unsigned long long len2)
+    {
+        return crc32_multmodp(crc32_x8nmodp(len2, 0x82F63B78), crc1, 0x82F63B78) ^ crc2;
+    }
+
     /*
     * name                       :CRC-16-ANSI (aka CRC-16-IBM, CRC-16/ARC)
     * Width                      : 16 bit
@@ -40,6 +40,7 @@ limitations under the License.
 
 #include "c_str.h"
 #include "c11_vector.h"
+#include "c11_iobuf.h"
 #include "c_stream.h"
 #include "c11_thread.h"
 #include "c11_critical.h"
@@ -84,12 +85,12 @@ namespace ec
 			return ns;
 		}
 	protected:
-		ec::vector<uint8_t>	_rbuf;
+		ec::iobuf	_rbuf;
 	public:
 		int parse(const uint8_t* pdata, size_t usize, ec::vector<uint8_t> *pout)
 		{
 			if (pdata && usize)
-				_rbuf.add(pdata, usize);
+				_rbuf.append(pdata, usize);
 			return parsepkg(pout);
 		}
 		inline void clear()
@@ -99,11 +100,10 @@ namespace ec
 	protected:
 		int parsepkg(ec::vector<uint8_t> *pout)//return 0:wait; -1:err; 1:OK
 		{
-			size_t  ulen = _rbuf.size();
-			uint8_t* pu = _rbuf.data();
-			if (_rbuf.size() < 6)
+			uint8_t head[6];
+			if (_rbuf.peek(head, sizeof(head)) < sizeof(head))
 				return 0;
-			ec::cStream ss((void*)pu, _rbuf.size());
+			ec::cStream ss((void*)head, sizeof(head));
 			t_head h;
 			ss > &h.sync;
 			ss > &h.flag;
@@ -111,16 +111,11 @@ namespace ec
 			if (h.sync != 0xF5 || h.flag != 0x10 || h.msglen > IPCMSG_MAXSIZE)
 				return -1;
 			if (h.msglen + 6 > _rbuf.size())
-			{
-				if (_rbuf.capacity() < h.msglen + 6)
-					_rbuf.set_grow(h.msglen + 8);
 				return 0;
-			}			
 			pout->clear();
-			pout->add(pu + 6, h.msglen);						
-			_rbuf.erase(0, h.msglen + 6);
-			_rbuf.shrink(1024 * 32);
-			_rbuf.set_grow(1024 * 16);
+			_rbuf.consume(6);
+			if (!_rbuf.readto(pout, h.msglen))
+				return -1;
 			return 1;
 		}
 	};
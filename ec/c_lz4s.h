@@ -40,16 +40,46 @@ You can contact the author at :
 #ifndef C_LZ4_H
 #define C_LZ4_H
 
+#include <stdlib.h>
+#include <string.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 	int LZ4_compressBound(int isize);
 	int LZ4_compress_default(const char* source, char* dest, int sourceSize, int maxDestSize);
 	int LZ4_decompress_safe(const char* source, char* dest, int compressedSize, int maxDecompressedSize);
+	int LZ4_compress_HC(const char* src, char* dst, int srcSize, int dstCapacity, int compressionLevel); // in lz4hc.c, LZ4 block format
+
+	typedef union LZ4_stream_u LZ4_stream_t; // streaming, blocks compressed with the history of blocks before
+	typedef union LZ4_streamDecode_u LZ4_streamDecode_t;
+	LZ4_stream_t* LZ4_createStream(void);
+	int LZ4_freeStream(LZ4_stream_t* streamPtr);
+	void LZ4_resetStream(LZ4_stream_t* streamPtr);
+	int LZ4_loadDict(LZ4_stream_t* streamPtr, const char* dictionary, int dictSize);
+	int LZ4_compress_fast_continue(LZ4_stream_t* streamPtr, const char* src, char* dst, int srcSize, int dstCapacity, int acceleration);
+	LZ4_streamDecode_t* LZ4_createStreamDecode(void);
+	int LZ4_freeStreamDecode(LZ4_streamDecode_t* LZ4_stream);
+	int LZ4_setStreamDecode(LZ4_streamDecode_t* LZ4_streamDecode, const char* dictionary, int dictSize);
+	int LZ4_decompress_safe_continue(LZ4_streamDecode_t* LZ4_streamDecode, const char* src, char* dst, int srcSize, int dstCapacity);
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
 
+#ifndef LZ4S_RING_SIZE
+#	define LZ4S_RING_SIZE (1024 * 128) // history ring buffer bytes of lz4s_encoder and lz4s_decoder, must be the same at both ends
+#endif
+
+#ifndef LZ4S_BLOCK_MAX
+#	define LZ4S_BLOCK_MAX (1024 * 32) // max source bytes of one stream block
+#endif
+
+#define LZ4S_DICT_MAX (1024 * 64) // LZ4 only matches the last 64K bytes, longer dictionary use the tail
+
+#if LZ4S_RING_SIZE < LZ4S_DICT_MAX + LZ4S_BLOCK_MAX
+#	error "LZ4S_RING_SIZE too small"
+#endif
+
 namespace ec
 {
 	inline  bool encode_lz4(const void *pSrc, size_t size_src, void* pDes, size_t* psize_des)
@@ -64,6 +94,18 @@ namespace ec
 			return false;
 		}
 	}
+	inline  bool encode_lz4hc(const void *pSrc, size_t size_src, void* pDes, size_t* psize_des, int nlevel = 9) // decode by decode_lz4
+	{
+		int noutsize = LZ4_compress_HC((const char*)pSrc, (char*)pDes, static_cast<int>(size_src), static_cast<int>(*psize_des), nlevel);
+		if (noutsize > 0) {
+			*psize_des = (size_t)noutsize;
+			return true;
+		}
+		else {
+			*psize_des = 0;
+			return false;
+		}
+	}
 	inline  bool decode_lz4(const void *pSrc, size_t size_src, void* pDes, size_t* psize_des)
 	{
 		int noutsize = LZ4_decompress_safe((const char*)pSrc, (char*)pDes, static_cast<int>(size_src), static_cast<int>(*psize_des));
@@ -76,6 +118,168 @@ namespace ec
 			return false;
 		}
 	}
+
+	/*!
+	\brief LZ4 block stream encoder, each block is copied to a ring buffer and compressed with the history
+	of the blocks before and the preloaded dictionary. lz4s_decoder uses the same ring size and wrap rule,
+	so the history is found at the same place, blocks must be decoded in the order encoded.
+	the dictionary is not copied, keep it until this encoder destroyed.
+	*/
+	class lz4s_encoder
+	{
+	public:
+		lz4s_encoder(const void* pdict = nullptr, size_t dictsize = 0) : _ps(nullptr), _pring(nullptr), _upos(0), _bnew(true)
+		{
+			setdict(pdict, dictsize);
+		}
+		~lz4s_encoder()
+		{
+			if (_ps)
+				LZ4_freeStream(_ps);
+			if (_pring)
+				::free(_pring);
+		}
+		lz4s_encoder(const lz4s_encoder&) = delete;
+		lz4s_encoder& operator = (const lz4s_encoder&) = delete;
+
+		void setdict(const void* pdict, size_t dictsize) // call reset() after
+		{
+			_pdict = (const char*)pdict;
+			_udict = pdict ? dictsize : 0;
+			if (_udict > LZ4S_DICT_MAX) {
+				_pdict += _udict - LZ4S_DICT_MAX;
+				_udict = LZ4S_DICT_MAX;
+			}
+		}
+		void reset() // start a new stream, the next block tell the decoder to reset
+		{
+			_bnew = true;
+			_upos = 0;
+			if (!_ps || !_pring)
+				return;
+			LZ4_resetStream(_ps);
+			if (_udict) {
+				memcpy(_pring, _pdict, _udict);
+				LZ4_loadDict(_ps, _pring, (int)_udict);
+				_upos = _udict;
+			}
+		}
+		/*!
+		\brief compress one block not larger than LZ4S_BLOCK_MAX, outsize not less than LZ4_compressBound(size)
+		\param pbnew [out] true: the first block of a new stream, the decoder must reset before decode it
+		\return compressed bytes; 0: failed and the stream reset
+		*/
+		size_t encode(const void* pin, size_t size, void* pout, size_t outsize, bool* pbnew)
+		{
+			if (!size || size > LZ4S_BLOCK_MAX)
+				return 0;
+			if (!_ps || !_pring) {
+				if (!_ps)
+					_ps = LZ4_createStream();
+				if (!_pring)
+					_pring = (char*)::malloc(LZ4S_RING_SIZE);
+				if (!_ps || !_pring)
+					return 0;
+				reset();
+			}
+			if (_upos + size > LZ4S_RING_SIZE)
+				_upos = 0;
+			char* pb = _pring + _upos;
+			memcpy(pb, pin, size);
+			int n = LZ4_compress_fast_continue(_ps, pb, (char*)pout, (int)size, (int)outsize, 1);
+			if (n <= 0) {
+				reset();
+				return 0;
+			}
+			_upos += size;
+			*pbnew = _bnew;
+			_bnew = false;
+			return (size_t)n;
+		}
+	private:
+		LZ4_stream_t* _ps;
+		char* _pring;
+		size_t _upos; // next block position in _pring
+		bool _bnew;   // next block is the first of a new stream
+		const char* _pdict;
+		size_t _udict;
+	};
+
+	/*!
+	\brief LZ4 block stream decoder of lz4s_encoder, with the same dictionary
+	*/
+	class lz4s_decoder
+	{
+	public:
+		lz4s_decoder(const void* pdict = nullptr, size_t dictsize = 0) : _ps(nullptr), _pring(nullptr), _upos(0)
+		{
+			setdict(pdict, dictsize);
+		}
+		~lz4s_decoder()
+		{
+			if (_ps)
+				LZ4_freeStreamDecode(_ps);
+			if (_pring)
+				::free(_pring);
+		}
+		lz4s_decoder(const lz4s_decoder&) = delete;
+		lz4s_decoder& operator = (const lz4s_decoder&) = delete;
+
+		void setdict(const void* pdict, size_t dictsize) // call reset() after
+		{
+			_pdict = (const char*)pdict;
+			_udict = pdict ? dictsize : 0;
+			if (_udict > LZ4S_DICT_MAX) {
+				_pdict += _udict - LZ4S_DICT_MAX;
+				_udict = LZ4S_DICT_MAX;
+			}
+		}
+		void reset()
+		{
+			_upos = 0;
+			if (!_ps || !_pring)
+				return;
+			if (_udict)
+				memcpy(_pring, _pdict, _udict);
+			LZ4_setStreamDecode(_ps, _udict ? _pring : nullptr, (int)_udict);
+			_upos = _udict;
+		}
+		/*!
+		\brief decode one block
+		\param usrcsize source bytes of the block(size_dn)
+		\param bnew the first block of a new stream
+		\return the decoded block in the ring buffer, valid until the next decode; nullptr: error
+		*/
+		const void* decode(const void* pin, size_t insize, size_t usrcsize, bool bnew)
+		{
+			if (!usrcsize || usrcsize > LZ4S_BLOCK_MAX)
+				return nullptr;
+			if (!_ps || !_pring) {
+				if (!_ps)
+					_ps = LZ4_createStreamDecode();
+				if (!_pring)
+					_pring = (char*)::malloc(LZ4S_RING_SIZE);
+				if (!_ps || !_pring)
+					return nullptr;
+				reset();
+			}
+			else if (bnew)
+				reset();
+			if (_upos + usrcsize > LZ4S_RING_SIZE)
+				_upos = 0;
+			char* pb = _pring + _upos;
+			if (LZ4_decompress_safe_continue(_ps, (const char*)pin, pb, (int)insize, (int)usrcsize) != (int)usrcsize)
+				return nullptr;
+			_upos += usrcsize;
+			return pb;
+		}
+	private:
+		LZ4_streamDecode_t* _ps;
+		char* _pring;
+		size_t _upos;
+		const char* _pdict;
+		size_t _udict;
+	};
 }//namespace ec
 
 #endif //C_LZ4_H
@@ -27,6 +27,7 @@ limitations under the License.
 #pragma once
 #include "c_minisrv.h"
 #include "c_tcp_tl.h"
+#include "c11_iobuf.h"
 #include "c_log.h"
 #ifndef MINI_PKG_FLAG
 #	define MINI_PKG_FLAG 0xF5
@@ -80,12 +81,12 @@ namespace ec
 			return true;
 		}
 	protected:
-		ec::vector<uint8_t>	_rbuf;
+		ec::iobuf	_rbuf;
 	public:
 		int parse(const uint8_t* pdata, size_t usize, ec::vector<uint8_t> *pout,cLog* plog = 0)
 		{
 			if (pdata && usize)
-				_rbuf.add(pdata, usize);
+				_rbuf.append(pdata, usize);
 			return parsepkg(pout,plog);
 		}
 		inline void clear()
@@ -95,10 +96,10 @@ namespace ec
 	protected:
 		int parsepkg(ec::vector<uint8_t> *pout,  cLog* plog = 0)//return 0:wait; -1:err; 1:OK
 		{
-			uint8_t* pu = _rbuf.data();
-			if (_rbuf.size() < 6)
+			uint8_t head[6];
+			if (_rbuf.peek(head, sizeof(head)) < sizeof(head))
 				return 0;
-			ec::cStream ss((void*)pu, _rbuf.size());
+			ec::cStream ss((void*)head, sizeof(head));
 			t_head h;
 			ss > &h.sync;
 			ss > &h.flag;
@@ -106,21 +107,16 @@ namespace ec
 			if (h.sync != MINI_PKG_FLAG || h.flag != 0x10 || h.msglen > MINI_MSG_MAXSIZE) {
 				if (plog) {
 					plog->AddLog("ERR: parsepkg failed sync=%u,flag=%u,msglen=%u", h.sync, h.flag, h.msglen);
-					//plog->AddLogMem(pu, _rbuf.size());
+					//plog->AddLogMem(head, sizeof(head));
 				}
 				return -1;
 			}
 			if (h.msglen + 6 > _rbuf.size())
-			{
-				if (_rbuf.capacity() < h.msglen + 6)
-					_rbuf.set_grow(h.msglen + 8);
 				return 0;
-			}
 			pout->clear();
-			pout->add(pu + 6, h.msglen);
-			_rbuf.erase(0, h.msglen + 6);
-			_rbuf.shrink(1024 * 16);
-			_rbuf.set_grow(1024 * 16);
+			_rbuf.consume(6);
+			if (!_rbuf.readto(pout, h.msglen))
+				return -1;
 			return 1;
 		}
 	};
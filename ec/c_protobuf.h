@@ -74,20 +74,25 @@ namespace ec
 		template<class _Tp>
 		bool out_varint(_Tp v, ec::vector<uint8_t>* pout) const //out Varint (Base 128 Varints)
 		{
-			int nbit = 0;
+			size_t zpos = pout->size();
+			uint8_t* po = pout->append_uninitialized(sizeof(_Tp) + 2); // reserve max bytes once, at most 10 bytes for 64-bit
+			if (!po)
+				return false;
+			int nbit = 0, n = 0;
 			uint8_t out = 0;
 			do{
 				out = (v >> nbit) & 0x7F;
 				nbit += 7;
 				if (v >> nbit) {
 					out |= 0x80;
-					pout->add(out);
+					po[n++] = out;
 				}
 				else {
-					pout->add(out);
+					po[n++] = out;
 					break;
 				}
 			} while (nbit < 8 * sizeof(_Tp));
+			pout->set_size(zpos + n);
 			return nbit <= 8 * sizeof(_Tp);
 		}
 		template<class _Tp>